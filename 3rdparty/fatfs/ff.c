@@ -454,7 +454,7 @@ typedef struct {
 /* File/Volume controls           */
 /*--------------------------------*/
 
-#if FF_VOLUMES < 1 || FF_VOLUMES > 10
+#if FF_VOLUMES < 1 || FF_VOLUMES > 256 || (FF_VOLUMES > 10 && FF_STR_VOLUME_ID)
 #error Wrong FF_VOLUMES setting
 #endif
 static FATFS* FatFs[FF_VOLUMES];	/* Pointer to the filesystem objects (logical drives) */
@@ -3164,8 +3164,11 @@ static int get_ldnumber (	/* Returns logical drive number (-1:invalid drive numb
 
 	if (tc == ':') {	/* DOS/Windows style volume ID? */
 		i = FF_VOLUMES;
-		if (IsDigit(*tp) && tp + 2 == tt) {	/* Is there a numeric volume ID + colon? */
-			i = (int)*tp - '0';	/* Get the LD number */
+		if (IsDigit(*tp)) {	/* Is there a numeric volume ID + colon? */
+			for (i = 0; IsDigit(*tp) && i < FF_VOLUMES; tp++) {	/* Get the LD number, of as many digits as FF_VOLUMES needs */
+				i = i * 10 + (int)*tp - '0';
+			}
+			if (tp + 1 != tt) i = FF_VOLUMES;
 		}
 #if FF_STR_VOLUME_ID == 1	/* Arbitrary string is enabled */
 		else {
@@ -4047,8 +4050,24 @@ FRESULT f_write (
 			sect += csect;
 			cc = btw / SS(fs);				/* When remaining bytes >= sector size, */
 			if (cc > 0) {					/* Write maximum contiguous sectors directly */
-				if (csect + cc > fs->csize) {	/* Clip at cluster boundary */
-					cc = fs->csize - csect;
+				if (csect + cc > fs->csize) {	/* Clip at the end of the contiguous cluster run */
+					UINT run = fs->csize - csect;
+
+#if FF_USE_FASTSEEK
+					if (!fp->cltbl)
+#endif
+					if (!FF_FS_EXFAT || fs->fs_type != FS_EXFAT) {
+						while (run + fs->csize <= cc) {	/* Follow or stretch the chain while it stays contiguous */
+							clst = create_chain(&fp->obj, fp->clust);
+							if (clst == 0) break;		/* Disk full, leave it to the next round */
+							if (clst == 1) ABORT(fs, FR_INT_ERR);
+							if (clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
+							if (clst != fp->clust + 1) break;	/* Fragmented, the next round follows the link */
+							fp->clust = clst;
+							run += fs->csize;
+						}
+					}
+					cc = run;
 				}
 				if (disk_write(fs->pdrv, wbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
 #if FF_FS_MINIMIZE <= 2
@@ -0,0 +1,585 @@
+#include "BuildCommand.h"
+#include "FATFilesystemLayout.h"
+#include "FilesystemTree.h"
+#include "RawBlockDevice.h"
+#include "CachingBlockDevice.h"
+#include "WriteCombiningBlockDevice.h"
+#include "MemoryBlockDevice.h"
+#include "SparseBlockDevice.h"
+#include "ThreadPool.h"
+#include "FATFilesystem.h"
+#include "FATImageBuilder.h"
+#include "BuildState.h"
+#include "FATLayoutMap.h"
+#include "FATClock.h"
+#include "ImageCache.h"
+#include "TextRecords.h"
+#include "ManifestLexer.h"
+#include "MappedFile.h"
+#include "SourceCache.h"
+
+#if defined(FATBUILDER_HAVE_IO_URING)
+#include "IoUringBlockDevice.h"
+#endif
+
+#if !defined(_WIN32)
+#include "FileTransfer.h"
+#include "MmapBlockDevice.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <CLI/CLI.hpp>
+
+#include <algorithm>
+#include <optional>
+#include <sstream>
+
+static std::unique_ptr<unsigned char[]> loadCodeFile(const std::filesystem::path& path, size_t size) {
+	std::ifstream stream;
+	stream.exceptions(std::ios::failbit | std::ios::eofbit | std::ios::badbit);
+	stream.open(path, std::ios::in | std::ios::binary);
+
+	auto result = std::make_unique<unsigned char[]>(size);
+
+	stream.read(reinterpret_cast<char*>(result.get()), size);
+
+	return result;
+}
+
+struct BlockDeviceOptions {
+	std::string backend = "raw";
+#if defined(FATBUILDER_HAVE_IO_URING)
+	unsigned int queueDepth = IoUringBlockDevice::DefaultQueueDepth;
+#else
+	unsigned int queueDepth = 0; /* there is no io_uring backend to use it */
+#endif
+	size_t mmapWindowSize = 0;
+	size_t cacheSize = CachingBlockDevice::DefaultCapacitySectors * CachingBlockDevice::SectorSize;
+	size_t writeBatchSize = WriteCombiningBlockDevice::DefaultMaxBatchSize;
+	bool writeZeros = false;
+};
+
+static std::unique_ptr<IBlockDevice> createBlockDevice(const BlockDeviceOptions& options, std::filesystem::path&& path, uint64_t size, bool keepContents) {
+#if defined(FATBUILDER_HAVE_IO_URING)
+	if (options.backend == "io_uring")
+		return IoUringBlockDevice::create(std::move(path), size, options.queueDepth, keepContents);
+#endif
+
+	if (options.backend == "memory") {
+		if (keepContents)
+			throw std::logic_error("the memory backend cannot update an existing image");
+
+		return std::make_unique<MemoryBlockDevice>(std::move(path), size);
+	}
+
+#if !defined(_WIN32)
+	if (options.backend == "mmap")
+		return std::make_unique<MmapBlockDevice>(std::move(path), size, options.mmapWindowSize, MmapBlockDevice::DefaultMaxWindows, keepContents);
+#endif
+
+	return std::make_unique<RawBlockDevice>(std::move(path), size, keepContents);
+}
+
+/*
+ * The image device with the layers in front of it. Only a freshly created
+ * image reads as zeros, so only that one is kept sparse.
+ */
+static std::unique_ptr<IBlockDevice> openImage(const BlockDeviceOptions& options, const std::filesystem::path& path, uint64_t size, bool keepContents) {
+	auto blockDevice = createBlockDevice(options, std::filesystem::path(path), size, keepContents);
+
+	if (!keepContents && !options.writeZeros) {
+		blockDevice = std::make_unique<SparseBlockDevice>(std::move(blockDevice));
+	}
+
+	/*
+	 * The mapped and in-memory images are accessed without system calls, so
+	 * there is nothing for the cache and the write combiner to save.
+	 */
+	bool buffered = options.backend != "mmap" && options.backend != "memory";
+
+	if (buffered && options.writeBatchSize != 0) {
+		blockDevice = std::make_unique<WriteCombiningBlockDevice>(std::move(blockDevice), options.writeBatchSize);
+	}
+
+	if (buffered && options.cacheSize != 0) {
+		blockDevice = std::make_unique<CachingBlockDevice>(std::move(blockDevice), options.cacheSize / CachingBlockDevice::SectorSize);
+	}
+
+	return blockDevice;
+}
+
+/*
+ * Describes what, besides the tree, decides the contents of the volume
+ * metadata, so that an image is only updated in place when a full build would
+ * have formatted it the same way.
+ */
+static std::string describeFormat(const std::string& layoutPolicy, const FATFilesystemLayout& layout) {
+	uint64_t hash = 14695981039346656037ULL;
+	auto add = [&hash](const unsigned char* data, size_t size) {
+		for (size_t index = 0; index < size; index++) {
+			hash = (hash ^ data[index]) * 1099511628211ULL;
+		}
+	};
+
+	add(layout.mbrCode, FATFilesystemLayout::MBRCodeSize);
+	add(layout.pbrCode12_16, FATFilesystemLayout::PBRCode12_16Size);
+	add(layout.pbrCode32, FATFilesystemLayout::PBRCode32Size);
+
+	std::ostringstream description;
+	description << layoutPolicy << ' ' << std::hex << hash;
+
+	return description.str();
+}
+
+/*
+ * Allocation unit the image device is going to report, which the volume
+ * layout depends on. Raw and io_uring images take it from the filesystem
+ * they are created on.
+ */
+static unsigned int imageAllocationUnit(const BlockDeviceOptions& options, const std::filesystem::path& path) {
+#if !defined(_WIN32)
+	if (options.backend == "raw" || options.backend == "io_uring") {
+		auto directory = path.parent_path();
+		if (directory.empty())
+			directory = ".";
+
+		int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+		if (fd >= 0) {
+			auto blockSize = hostBlockSize(fd);
+			close(fd);
+			return blockSize;
+		}
+	}
+#else
+	(void)options;
+	(void)path;
+#endif
+
+	return 512;
+}
+
+/*
+ * The time reproducible builds are stamped with: SOURCE_DATE_EPOCH, as other
+ * reproducible build tools take it, or else the earliest time FAT can store.
+ */
+static int64_t reproducibleTime(const BuildCommand& command) {
+	if (!command.sourceDateEpoch || command.sourceDateEpoch->empty())
+		return INT64_C(315532800);
+
+	int64_t time;
+	if (!parseRecordNumber(*command.sourceDateEpoch, time))
+		throw std::runtime_error("SOURCE_DATE_EPOCH is not a number of seconds");
+
+	return time;
+}
+
+BuildResources::BuildResources(unsigned int readThreads, size_t sourceCacheSize) : m_uses(0) {
+	if (readThreads != 0) {
+		m_readPool = std::make_unique<ThreadPool>(readThreads);
+	}
+
+	if (sourceCacheSize != 0) {
+		m_sourceCache = std::make_unique<SourceCache>(sourceCacheSize);
+	}
+}
+
+BuildResources::~BuildResources() = default;
+
+std::unique_ptr<FilesystemTree> BuildResources::parseManifest(const std::filesystem::path& path) {
+	auto file = examineFile(path, std::filesystem::path());
+	auto key = file.absolutePath.u8string();
+
+	std::shared_ptr<const FilesystemTree> parsed;
+
+	{
+		std::unique_lock<std::mutex> locker(m_mutex);
+
+		auto manifest = m_manifests.find(key);
+		if (manifest != m_manifests.end() && BuildState::sameSource(manifest->second.file, file)) {
+			manifest->second.lastUsed = ++m_uses;
+			parsed = manifest->second.tree;
+		}
+	}
+
+	if (!parsed) {
+		auto tree = std::make_shared<FilesystemTree>();
+		tree->parse(path, m_readPool.get());
+		parsed = tree;
+
+		std::unique_lock<std::mutex> locker(m_mutex);
+
+		/*
+		 * Makes room by forgetting the manifest used least recently.
+		 */
+		if (m_manifests.size() >= MaxManifests && m_manifests.count(key) == 0) {
+			auto oldest = std::min_element(m_manifests.begin(), m_manifests.end(), [](const auto& a, const auto& b) {
+				return a.second.lastUsed < b.second.lastUsed;
+			});
+
+			m_manifests.erase(oldest);
+		}
+
+		m_manifests[key] = ParsedManifest{ std::move(file), parsed, ++m_uses };
+	}
+
+	return parsed->clone();
+}
+
+ImageCache* BuildResources::imageCache(const std::filesystem::path& directory) {
+	std::unique_lock<std::mutex> locker(m_mutex);
+
+	auto& cache = m_imageCaches[directory];
+	if (!cache) {
+		cache = std::make_unique<ImageCache>(directory);
+	}
+
+	return cache.get();
+}
+
+int runBuildCommand(const BuildCommand& command, BuildResources* resources, std::ostream& out, std::ostream& err) {
+	CLI::App app("FAT filesystem builder", "fatbuilder");
+
+	std::filesystem::path inputFilename;
+	std::filesystem::path outputFilename;
+	std::filesystem::path depfile;
+	std::filesystem::path stateFile;
+	std::filesystem::path previousLayoutFile;
+	std::filesystem::path layoutMapFile;
+	std::filesystem::path cacheDirectory;
+	BlockDeviceOptions blockDeviceOptions;
+	unsigned int readThreads = ThreadPool::defaultThreadCount();
+	unsigned int payloadThreads = 0;
+	FilesystemBuildOptions buildOptions;
+	std::string sourceIo = SourceReader::DefaultMode == SourceReader::Mode::Map ? "mmap" : "read";
+	std::string fatWriter = "native";
+	bool printSize = false;
+	std::string layoutPolicy = "mkfs";
+	std::string timestamps = "now";
+
+	FATFilesystemLayout layout;
+
+	std::unique_ptr<unsigned char[]> mbrCode;
+	std::unique_ptr<unsigned char[]> pbrCode12_16;
+	std::unique_ptr<unsigned char[]> pbrCode32;
+
+	app.add_option("--input", inputFilename, "Manifest of the tree, as text or as compiled by --compile-manifest")->required(true);
+	app.add_option("--output", outputFilename)->required(true);
+	app.add_option("--depfile", depfile);
+	app.add_option("--state-file", stateFile, "Remember the built tree in this file, and update the image in place instead of rebuilding it while the output is still the one it describes");
+	app.add_option("--cache-size", blockDeviceOptions.cacheSize, "Size of the write-back sector cache in bytes, 0 to disable");
+	app.add_option("--write-batch-size", blockDeviceOptions.writeBatchSize, "Maximum size of a combined write in bytes, 0 to disable write combining");
+	app.add_option("--io-backend", blockDeviceOptions.backend, "Output image I/O backend, io_uring falls back to raw when unavailable")->check(CLI::IsMember({ "raw", "io_uring", "mmap", "memory" }));
+	app.add_option("--queue-depth", blockDeviceOptions.queueDepth, "Maximum number of writes in flight for the io_uring backend")->check(CLI::Range(1u, 4096u));
+	app.add_option("--fat-writer", fatWriter, "Component laying out the volume: the native composer, or fatfs as the reference")->check(CLI::IsMember({ "native", "fatfs" }));
+	app.add_option("--layout-policy", layoutPolicy, "How the cluster size, FAT type, number of FATs and root directory size are chosen: as f_mkfs does, for the smallest image, or for the fewest FAT and directory sectors")->check(CLI::IsMember({ "mkfs", "size", "metadata" }));
+	app.add_option("--previous-layout", previousLayoutFile, "Layout map of a previous build: keep its volume while the tree fits, and its directories and files in the same clusters; needs the native writer");
+	app.add_option("--layout-map", layoutMapFile, "Write the layout map of the image to this file; needs the native writer");
+	app.add_option("--timestamps", timestamps, "What the entries and the volume serial number are stamped with: the current time, SOURCE_DATE_EPOCH (1980-01-01 when unset), or for files the modification time of their source where that is earlier; all but now make the image reproducible")->check(CLI::IsMember({ "now", "epoch", "source" }));
+	app.add_option("--cache-dir", cacheDirectory, "Keep the images built in this directory, filed by what went into them, and copy the image from there instead of building it again; needs reproducible timestamps");
+	app.add_flag("--print-size", printSize, "Print the size of the image in bytes and exit without writing anything");
+	app.add_flag("--write-zeros", blockDeviceOptions.writeZeros, "Write all-zero sectors even where the new image already reads as zeros");
+	app.add_option("--mmap-window-size", blockDeviceOptions.mmapWindowSize, "Size of the mapped windows for the mmap backend in bytes, 0 to map the whole image");
+
+	app.add_option("--read-threads", readThreads, "Number of threads examining and reading source files ahead of the image writer, 0 to do it on the writer thread");
+	app.add_option("--payload-threads", payloadThreads, "Number of threads copying file contents straight to their allocated place in the image, 0 to write them in order; needs the raw, mmap or memory backend");
+	app.add_option("--read-ahead", buildOptions.readAhead, "Maximum amount of source data read ahead, in bytes");
+	app.add_option("--read-chunk-size", buildOptions.chunkSize, "Size of the pieces source files are read and written in, in bytes, rounded up to whole clusters");
+	app.add_option("--source-io", sourceIo, "How source files are read, mmap reads like read on Windows")->check(CLI::IsMember({ "read", "mmap" }));
+	app.add_option("--direct-copy-threshold", buildOptions.directCopyThreshold, "Minimum size of the files copied into the image by the kernel, in bytes, 0 to disable");
+
+	app.add_option_function<std::filesystem::path>("--mbr-code", [&command, &layout, &mbrCode](const std::filesystem::path& path) {
+		mbrCode = loadCodeFile(command.workingDirectory / path, FATFilesystemLayout::MBRCodeSize);
+		layout.mbrCode = mbrCode.get();
+	});
+
+	app.add_option_function<std::filesystem::path>("--pbr-code1216", [&command, &layout, &pbrCode12_16](const std::filesystem::path& path) {
+		pbrCode12_16 = loadCodeFile(command.workingDirectory / path, FATFilesystemLayout::PBRCode12_16Size);
+		layout.pbrCode12_16 = pbrCode12_16.get();
+	});
+
+	app.add_option_function<std::filesystem::path>("--pbr-code32", [&command, &layout, &pbrCode32](const std::filesystem::path& path) {
+		pbrCode32 = loadCodeFile(command.workingDirectory / path, FATFilesystemLayout::PBRCode32Size);
+		layout.pbrCode32 = pbrCode32.get();
+	});
+
+	std::vector<std::string> arguments{ "fatbuilder" };
+	arguments.insert(arguments.end(), command.arguments.begin(), command.arguments.end());
+
+	std::vector<char*> argv;
+	for (auto& argument : arguments) {
+		argv.push_back(argument.data());
+	}
+
+	try {
+		app.parse(static_cast<int>(argv.size()), argv.data());
+	}
+	catch (const CLI::ParseError& e) {
+		return app.exit(e, out, err);
+	}
+
+	/*
+	 * Paths are taken relative to the directory the command was given in,
+	 * which a build server does not share.
+	 */
+	for (auto path : { &inputFilename, &outputFilename, &depfile, &stateFile, &previousLayoutFile, &layoutMapFile, &cacheDirectory }) {
+		if (!path->empty())
+			*path = command.workingDirectory / *path;
+	}
+
+	if (fatWriter != "native" && (!previousLayoutFile.empty() || !layoutMapFile.empty())) {
+		err << "fatbuilder: layout maps need the native writer" << std::endl;
+		return 1;
+	}
+
+	if (!cacheDirectory.empty() && timestamps == "now") {
+		err << "fatbuilder: the image cache needs reproducible timestamps" << std::endl;
+		return 1;
+	}
+
+	if (!cacheDirectory.empty() && !stateFile.empty()) {
+		err << "fatbuilder: the image cache cannot be combined with a state file" << std::endl;
+		return 1;
+	}
+
+	/*
+	 * Stands still for the whole build, volume serial number included.
+	 */
+	std::optional<FATClock> clock;
+	if (timestamps != "now") {
+		clock.emplace(reproducibleTime(command), timestamps == "source");
+	}
+
+	/*
+	 * A build server has its own read pool; builds that ask for none still
+	 * get none.
+	 */
+	std::unique_ptr<ThreadPool> ownReadPool;
+	ThreadPool* readPool = nullptr;
+	if (readThreads != 0 && resources && resources->readPool()) {
+		readPool = resources->readPool();
+	}
+	else if (readThreads != 0) {
+		ownReadPool = std::make_unique<ThreadPool>(readThreads);
+		readPool = ownReadPool.get();
+	}
+
+	std::unique_ptr<FilesystemTree> parsedTree;
+	if (resources) {
+		parsedTree = resources->parseManifest(inputFilename);
+	}
+	else {
+		parsedTree = std::make_unique<FilesystemTree>();
+		parsedTree->parse(inputFilename, readPool);
+	}
+
+	auto& tree = *parsedTree;
+	tree.statInputs(readPool, command.workingDirectory);
+
+	BuildState state;
+	if (!stateFile.empty() || !cacheDirectory.empty()) {
+		tree.collectBuildState(state);
+	}
+
+	FATImageBuilder::Options imageOptions;
+	imageOptions.writer = fatWriter == "fatfs" ? FATImageBuilder::Writer::Fatfs : FATImageBuilder::Writer::Native;
+	imageOptions.bootCode = layout;
+	imageOptions.allocationUnit = imageAllocationUnit(blockDeviceOptions, outputFilename);
+
+	if (layoutPolicy == "size") {
+		imageOptions.layoutPolicy = FATImageBuilder::LayoutPolicy::Size;
+	}
+	else if (layoutPolicy == "metadata") {
+		imageOptions.layoutPolicy = FATImageBuilder::LayoutPolicy::Metadata;
+	}
+
+	std::optional<FATLayoutMap> previousLayout;
+	if (!previousLayoutFile.empty()) {
+		previousLayout = FATLayoutMap::load(previousLayoutFile);
+		imageOptions.previousLayout = &*previousLayout;
+	}
+
+	FATImageBuilder image(tree, imageOptions);
+	auto size = image.mediaSize();
+	const auto& volumeParameters = image.parameters();
+
+	if (printSize) {
+		out << size << std::endl;
+		return 0;
+	}
+
+	if (!depfile.empty()) {
+		std::basic_ofstream<FatfsCharacter> stream;
+		stream.exceptions(std::ios::failbit | std::ios::eofbit | std::ios::badbit);
+		stream.open(depfile, std::ios::out | std::ios::trunc | std::ios::binary);
+
+		stream << outputFilename.generic_string<FatfsCharacter>() << ": \\\n";
+
+		auto printInput = [&stream](const std::filesystem::path& absolutePath) {
+			stream << "\t" << absolutePath.generic_string<FatfsCharacter>() << " \\\n";
+		};
+
+		printInput(inputFilename);
+
+		tree.enumerateInputs([&printInput](const Inode& inode) {
+			printInput(inode.sourceInformation().absolutePath);
+		});
+
+		stream << "\n\n";
+	}
+
+	/*
+	 * The tree goes into the key with the contents of the files, wherever
+	 * their sources are, and the options with what they decided about the
+	 * volume.
+	 */
+	std::optional<ImageCache> ownCache;
+	ImageCache* cache = nullptr;
+	std::string cacheKey;
+
+	if (!cacheDirectory.empty() && resources) {
+		cache = resources->imageCache(cacheDirectory);
+	}
+	else if (!cacheDirectory.empty()) {
+		ownCache.emplace(cacheDirectory);
+		cache = &*ownCache;
+	}
+
+	if (cache) {
+
+		std::ostringstream options;
+		options << "writer\t" << fatWriter << "\n";
+		options << "format\t" << describeFormat(layoutPolicy, layout) << "\n";
+		options << "volume\t" << size << '\t' << static_cast<int>(volumeParameters.types) << '\t' << volumeParameters.fatCount << '\t' <<
+			volumeParameters.rootEntries << '\t' << volumeParameters.clusterSize << '\t' << imageOptions.allocationUnit << "\n";
+		options << "previous-layout\t" << (previousLayoutFile.empty() ? "none" : ImageCache::hashFile(previousLayoutFile));
+
+		cacheKey = cache->key(options.str(), state, *clock, readPool);
+
+		if (cache->fetch(cacheKey, outputFilename, layoutMapFile))
+			return 0;
+	}
+
+	std::unique_ptr<ThreadPool> payloadPool;
+	if (payloadThreads != 0) {
+		payloadPool = std::make_unique<ThreadPool>(payloadThreads);
+	}
+
+	buildOptions.readPool = readPool;
+	buildOptions.payloadPool = payloadPool.get();
+	buildOptions.sourceCache = resources ? resources->sourceCache() : nullptr;
+	buildOptions.readMode = sourceIo == "mmap" ? SourceReader::Mode::Map : SourceReader::Mode::Read;
+
+	bool updated = false;
+
+	if (!stateFile.empty()) {
+		state.format = describeFormat(layoutPolicy, layout);
+
+		auto previous = BuildState::load(stateFile);
+
+		/*
+		 * The state no longer holds once the image is touched, whether the
+		 * update below succeeds or not.
+		 */
+		std::filesystem::remove(stateFile);
+
+		/*
+		 * Layout maps are kept by the native writer, which always builds
+		 * from scratch.
+		 */
+		bool updatable = blockDeviceOptions.backend != "memory" && previousLayoutFile.empty() && layoutMapFile.empty();
+
+		if (previous && updatable && previous->format == state.format && previous->describesImage(outputFilename)) {
+			try {
+				/*
+				 * The image keeps its size; a tree that no longer fits falls
+				 * back to the full build.
+				 */
+				FATFilesystem fs(openImage(blockDeviceOptions, outputFilename, previous->image.size, true), FATFilesystem::MountExisting());
+
+				FilesystemTree::updateFilesystem(&fs, *previous, state, buildOptions);
+
+				fs.flush();
+
+				updated = true;
+			}
+			catch (const std::exception& e) {
+				err << "fatbuilder: cannot update " << outputFilename.u8string() << " in place, rebuilding it: " << e.what() << std::endl;
+			}
+		}
+	}
+
+	if (!updated) {
+		FATLayoutMap layoutMap;
+
+		if (!image.build(openImage(blockDeviceOptions, outputFilename, size, false), buildOptions, layoutMapFile.empty() ? nullptr : &layoutMap)) {
+			err << "fatbuilder: the volume no longer has the cluster size or FAT type of the previous layout, placing everything anew" << std::endl;
+		}
+
+		if (!layoutMapFile.empty()) {
+			layoutMap.save(layoutMapFile);
+		}
+	}
+
+	if (cache) {
+		cache->store(cacheKey, outputFilename, layoutMapFile);
+	}
+
+	if (!stateFile.empty()) {
+		state.recordImage(outputFilename);
+		state.save(stateFile);
+	}
+
+	return 0;
+}
+
+std::vector<BuildCommand> parseBuildBatch(const std::filesystem::path& path, const BuildCommand& base) {
+	MappedFile batch(path);
+
+	std::vector<BuildCommand> commands;
+
+	lexManifest(batch.text(), [&commands, &base](size_t, const std::vector<std::string_view>& tokens) {
+		auto command = base;
+		command.arguments.assign(tokens.begin(), tokens.end());
+		commands.emplace_back(std::move(command));
+	});
+
+	return commands;
+}
+
+int runBuildBatch(const std::vector<BuildCommand>& commands, BuildResources* resources, unsigned int jobs, std::ostream& out, std::ostream& err) {
+	std::unique_ptr<ThreadPool> pool;
+	if (jobs > 1) {
+		pool = std::make_unique<ThreadPool>(jobs);
+	}
+
+	std::mutex outputMutex;
+	bool failed = false;
+
+	ThreadPool::forEach(pool.get(), commands.size(), [&](size_t index) {
+		std::ostringstream commandOut;
+		std::ostringstream commandErr;
+		int status;
+
+		try {
+			status = runBuildCommand(commands[index], resources, commandOut, commandErr);
+		}
+		catch (const std::exception& e) {
+			commandErr << "fatbuilder: " << e.what() << std::endl;
+			status = 1;
+		}
+
+		std::unique_lock<std::mutex> locker(outputMutex);
+
+		out << commandOut.str() << std::flush;
+		err << commandErr.str() << std::flush;
+
+		if (status != 0) {
+			err << "fatbuilder: batch command " << (index + 1) << " failed with status " << status << std::endl;
+			failed = true;
+		}
+	});
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,101 @@
+#ifndef BUILD_COMMAND_H
+#define BUILD_COMMAND_H
+
+#include "Inode.h"
+
+#include <stdint.h>
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class FilesystemTree;
+class ImageCache;
+class SourceCache;
+class ThreadPool;
+
+/*
+ * One run of the fatbuilder command line, in its own process or on a build
+ * server: the arguments after the program name, the directory relative
+ * paths are taken from, and the environment the build depends on.
+ */
+struct BuildCommand {
+	std::vector<std::string> arguments;
+	std::filesystem::path workingDirectory;
+	std::optional<std::string> sourceDateEpoch;
+};
+
+/*
+ * What a build server or a batch keeps between the commands it runs: one pool
+ * examining and reading sources for all of them, the contents of the sources
+ * when given a source cache size, the manifests it parsed, and the image
+ * caches it opened. A manifest is parsed again once its file changes.
+ */
+class BuildResources {
+public:
+	explicit BuildResources(unsigned int readThreads, size_t sourceCacheSize = 0);
+	~BuildResources();
+
+	BuildResources(const BuildResources& other) = delete;
+	BuildResources &operator =(const BuildResources& other) = delete;
+
+	inline ThreadPool* readPool() const {
+		return m_readPool.get();
+	}
+
+	inline SourceCache* sourceCache() const {
+		return m_sourceCache.get();
+	}
+
+	/*
+	 * A copy of the tree the manifest describes, for the caller to examine
+	 * and build.
+	 */
+	std::unique_ptr<FilesystemTree> parseManifest(const std::filesystem::path& path);
+
+	ImageCache* imageCache(const std::filesystem::path& directory);
+
+private:
+	struct ParsedManifest {
+		SourceInformation file;
+		std::shared_ptr<const FilesystemTree> tree;
+		uint64_t lastUsed;
+	};
+
+	static constexpr size_t MaxManifests = 64;
+
+	std::unique_ptr<ThreadPool> m_readPool;
+	std::unique_ptr<SourceCache> m_sourceCache;
+	std::mutex m_mutex;
+	uint64_t m_uses;
+	std::unordered_map<std::string, ParsedManifest> m_manifests;
+	std::map<std::filesystem::path, std::unique_ptr<ImageCache>> m_imageCaches;
+};
+
+/*
+ * Runs the command, printing to out and err, and returns its exit status.
+ * resources is null outside a build server. Failures of the build itself
+ * are thrown.
+ */
+int runBuildCommand(const BuildCommand& command, BuildResources* resources, std::ostream& out, std::ostream& err);
+
+/*
+ * Reads a batch file: one command per line, given as its arguments in the
+ * syntax of a manifest, with the working directory and environment of base.
+ */
+std::vector<BuildCommand> parseBuildBatch(const std::filesystem::path& path, const BuildCommand& base);
+
+/*
+ * Runs the commands, jobs of them at once, and prints the output of each as
+ * it finishes. Every command is run even when others fail; the exit status
+ * is 0 only when all of them succeed.
+ */
+int runBuildBatch(const std::vector<BuildCommand>& commands, BuildResources* resources, unsigned int jobs, std::ostream& out, std::ostream& err);
+
+#endif
@@ -0,0 +1,320 @@
+#include "BuildServer.h"
+#include "TextRecords.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+static const char CommandSignature[] = "fatbuilder-command 1";
+static const char ResultSignature[] = "fatbuilder-result 1";
+
+struct SocketHandle {
+	~SocketHandle() {
+		if (fd >= 0)
+			close(fd);
+	}
+
+	int fd;
+};
+
+static bool socketAddress(const std::filesystem::path& path, sockaddr_un& address) {
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+
+	const auto& name = path.native();
+	if (name.size() >= sizeof(address.sun_path))
+		return false;
+
+	memcpy(address.sun_path, name.c_str(), name.size() + 1);
+
+	return true;
+}
+
+static bool connectSocket(int fd, const std::filesystem::path& path) {
+	sockaddr_un address;
+	if (!socketAddress(path, address))
+		return false;
+
+	return connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+}
+
+static bool peerIsSameUser(int fd) {
+#if defined(SO_PEERCRED)
+	ucred credentials;
+	socklen_t length = sizeof(credentials);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) < 0)
+		return false;
+
+	return credentials.uid == getuid();
+#else
+	uid_t user;
+	gid_t group;
+	if (getpeereid(fd, &user, &group) < 0)
+		return false;
+
+	return user == getuid();
+#endif
+}
+
+/*
+ * Throws once the other side is gone, without raising SIGPIPE where the
+ * platform allows.
+ */
+static void sendMessage(int fd, const std::string& message) {
+#if defined(MSG_NOSIGNAL)
+	static constexpr int Flags = MSG_NOSIGNAL;
+#else
+	static constexpr int Flags = 0;
+#endif
+
+	for (size_t done = 0; done < message.size(); ) {
+		auto result = send(fd, message.data() + done, message.size() - done, Flags);
+		if (result < 0 && errno == EINTR)
+			continue;
+		else if (result < 0)
+			throw std::system_error(errno, std::generic_category());
+
+		done += static_cast<size_t>(result);
+	}
+}
+
+/*
+ * The lines of a message, as they arrive.
+ */
+class MessageReader {
+public:
+	explicit MessageReader(int fd) : m_fd(fd), m_position(0) {
+
+	}
+
+	/*
+	 * Returns false at the end of the stream, or when it breaks off.
+	 */
+	bool nextLine(std::string& line) {
+		while (true) {
+			auto newline = m_buffer.find('\n', m_position);
+			if (newline != std::string::npos) {
+				line.assign(m_buffer, m_position, newline - m_position);
+				m_position = newline + 1;
+				return true;
+			}
+
+			m_buffer.erase(0, m_position);
+			m_position = 0;
+
+			char chunk[65536];
+			auto result = recv(m_fd, chunk, sizeof(chunk), 0);
+			if (result < 0 && errno == EINTR)
+				continue;
+			else if (result <= 0)
+				return false;
+
+			m_buffer.append(chunk, static_cast<size_t>(result));
+		}
+	}
+
+private:
+	int m_fd;
+	std::string m_buffer;
+	size_t m_position;
+};
+
+BuildServer::BuildServer(std::filesystem::path socketPath, unsigned int jobs, unsigned int readThreads, size_t sourceCacheSize) :
+	m_socketPath(std::move(socketPath)), m_socket(-1), m_resources(readThreads, sourceCacheSize), m_jobs(jobs) {
+
+	sockaddr_un address;
+	if (!socketAddress(m_socketPath, address))
+		throw std::runtime_error("socket path is too long: " + m_socketPath.u8string());
+
+	/*
+	 * A socket left behind by a server that is gone is replaced, one that
+	 * still answers is not.
+	 */
+	{
+		SocketHandle probe{ socket(AF_UNIX, SOCK_STREAM, 0) };
+		if (probe.fd >= 0 && connectSocket(probe.fd, m_socketPath))
+			throw std::runtime_error("a build server is already listening on " + m_socketPath.u8string());
+	}
+
+	if (unlink(m_socketPath.c_str()) < 0 && errno != ENOENT)
+		throw std::system_error(errno, std::generic_category());
+
+	m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (m_socket < 0)
+		throw std::system_error(errno, std::generic_category());
+
+	if (bind(m_socket, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0 ||
+		chmod(m_socketPath.c_str(), S_IRUSR | S_IWUSR) < 0 ||
+		listen(m_socket, SOMAXCONN) < 0) {
+		auto error = errno;
+		close(m_socket);
+		throw std::system_error(error, std::generic_category());
+	}
+}
+
+BuildServer::~BuildServer() {
+	close(m_socket);
+	unlink(m_socketPath.c_str());
+}
+
+void BuildServer::run() {
+	while (true) {
+		int connection = accept(m_socket, nullptr, nullptr);
+		if (connection < 0 && (errno == EINTR || errno == ECONNABORTED))
+			continue;
+		else if (connection < 0)
+			throw std::system_error(errno, std::generic_category());
+
+		m_jobs.submit([this, connection]() {
+			serve(connection);
+		});
+	}
+}
+
+void BuildServer::serve(int connection) {
+	SocketHandle handle{ connection };
+
+	try {
+		if (!peerIsSameUser(connection))
+			return;
+
+		MessageReader reader(connection);
+		std::string line;
+		std::vector<std::string> fields;
+
+		if (!reader.nextLine(line) || line != CommandSignature)
+			return;
+
+		BuildCommand command;
+		bool complete = false;
+
+		while (!complete && reader.nextLine(line)) {
+			if (!splitRecordFields(line, fields))
+				return;
+
+			if (fields[0] == "directory" && fields.size() == 2)
+				command.workingDirectory = std::filesystem::u8path(fields[1]);
+			else if (fields[0] == "source-date-epoch" && fields.size() == 2)
+				command.sourceDateEpoch = fields[1];
+			else if (fields[0] == "argument" && fields.size() == 2)
+				command.arguments.push_back(fields[1]);
+			else if (fields[0] == "end" && fields.size() == 1)
+				complete = true;
+			else
+				return;
+		}
+
+		if (!complete || !command.workingDirectory.is_absolute())
+			return;
+
+		std::ostringstream out;
+		std::ostringstream err;
+		int status;
+
+		try {
+			status = runBuildCommand(command, &m_resources, out, err);
+		}
+		catch (const std::exception& e) {
+			err << "fatbuilder: " << e.what() << std::endl;
+			status = 1;
+		}
+
+		std::ostringstream result;
+		result << ResultSignature << '\n';
+		result << "out\t" << escapeRecordField(out.str()) << '\n';
+		result << "err\t" << escapeRecordField(err.str()) << '\n';
+		result << "status\t" << status << '\n';
+
+		sendMessage(connection, result.str());
+	}
+	catch (...) {
+		/*
+		 * The client went away; it is left to build on its own.
+		 */
+	}
+}
+
+std::optional<std::filesystem::path> BuildServer::socketPath() {
+	auto configured = getenv("FATBUILDER_SOCKET");
+	if (configured && *configured == 0)
+		return std::nullopt;
+	else if (configured)
+		return std::filesystem::path(configured);
+
+	auto runtimeDirectory = getenv("XDG_RUNTIME_DIR");
+	if (runtimeDirectory && *runtimeDirectory != 0)
+		return std::filesystem::path(runtimeDirectory) / "fatbuilder.socket";
+
+	return std::filesystem::path("/tmp/fatbuilder-" + std::to_string(getuid()) + ".socket");
+}
+
+std::optional<int> BuildServer::runRemotely(const std::filesystem::path& socketPath, const BuildCommand& command, std::ostream& out, std::ostream& err) {
+	SocketHandle handle{ socket(AF_UNIX, SOCK_STREAM, 0) };
+	if (handle.fd < 0 || !connectSocket(handle.fd, socketPath) || !peerIsSameUser(handle.fd))
+		return std::nullopt;
+
+	std::ostringstream request;
+	request << CommandSignature << '\n';
+	request << "directory\t" << escapeRecordField(command.workingDirectory.u8string()) << '\n';
+
+	if (command.sourceDateEpoch)
+		request << "source-date-epoch\t" << escapeRecordField(*command.sourceDateEpoch) << '\n';
+
+	for (const auto& argument : command.arguments) {
+		request << "argument\t" << escapeRecordField(argument) << '\n';
+	}
+
+	request << "end\n";
+
+	try {
+		sendMessage(handle.fd, request.str());
+	}
+	catch (const std::system_error&) {
+		return std::nullopt;
+	}
+
+	/*
+	 * Nothing is printed until the whole result is in, so that a client
+	 * building on its own after all does not repeat any of it.
+	 */
+	MessageReader reader(handle.fd);
+	std::string line;
+	std::vector<std::string> fields;
+	std::string printed[2];
+
+	if (!reader.nextLine(line) || line != ResultSignature)
+		return std::nullopt;
+
+	while (reader.nextLine(line)) {
+		if (!splitRecordFields(line, fields) || fields.size() != 2)
+			return std::nullopt;
+
+		int status;
+
+		if (fields[0] == "out") {
+			printed[0] = std::move(fields[1]);
+		}
+		else if (fields[0] == "err") {
+			printed[1] = std::move(fields[1]);
+		}
+		else if (fields[0] == "status" && parseRecordNumber(fields[1], status)) {
+			out << printed[0] << std::flush;
+			err << printed[1] << std::flush;
+			return status;
+		}
+		else {
+			return std::nullopt;
+		}
+	}
+
+	return std::nullopt;
+}
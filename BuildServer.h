@@ -0,0 +1,54 @@
+#ifndef BUILD_SERVER_H
+#define BUILD_SERVER_H
+
+#include "BuildCommand.h"
+#include "ThreadPool.h"
+
+#include <filesystem>
+#include <optional>
+#include <ostream>
+
+/*
+ * Runs the commands thin clients send over a Unix socket, several at once,
+ * with the resources kept warm between them. Only processes of the user
+ * running the server are served, and clients only talk to a server of their
+ * own user.
+ */
+class BuildServer {
+public:
+	BuildServer(std::filesystem::path socketPath, unsigned int jobs, unsigned int readThreads, size_t sourceCacheSize);
+	~BuildServer();
+
+	BuildServer(const BuildServer& other) = delete;
+	BuildServer &operator =(const BuildServer& other) = delete;
+
+	/*
+	 * Serves until the process is terminated.
+	 */
+	void run();
+
+	/*
+	 * Where servers listen and clients connect: FATBUILDER_SOCKET, or the
+	 * user's own socket in XDG_RUNTIME_DIR or /tmp. Nothing when
+	 * FATBUILDER_SOCKET is set but empty, which keeps clients from looking
+	 * for a server.
+	 */
+	static std::optional<std::filesystem::path> socketPath();
+
+	/*
+	 * Has the server listening on socketPath run the command, and relays
+	 * what it printed. Returns the exit status, or nothing when no server
+	 * answers there or it went away before finishing the command.
+	 */
+	static std::optional<int> runRemotely(const std::filesystem::path& socketPath, const BuildCommand& command, std::ostream& out, std::ostream& err);
+
+private:
+	void serve(int connection);
+
+	std::filesystem::path m_socketPath;
+	int m_socket;
+	BuildResources m_resources;
+	ThreadPool m_jobs;
+};
+
+#endif
@@ -0,0 +1,139 @@
+#include "BuildState.h"
+#include "TextRecords.h"
+
+#include <fstream>
+#include <vector>
+
+static const char StateFileSignature[] = "fatbuilder-state 1";
+
+static void writeSource(std::ostream& stream, const SourceInformation& source) {
+	stream << source.size << '\t' << source.modificationTime << '\t' << source.device << '\t' << source.inode << '\t' << escapeRecordField(source.absolutePath.u8string());
+}
+
+static bool readSource(const std::vector<std::string>& fields, size_t first, SourceInformation& source) {
+	if (fields.size() < first + 5)
+		return false;
+
+	if (!parseRecordNumber(fields[first], source.size) ||
+		!parseRecordNumber(fields[first + 1], source.modificationTime) ||
+		!parseRecordNumber(fields[first + 2], source.device) ||
+		!parseRecordNumber(fields[first + 3], source.inode))
+		return false;
+
+	source.absolutePath = std::filesystem::u8path(fields[first + 4]);
+
+	return true;
+}
+
+std::optional<BuildState> BuildState::load(const std::filesystem::path& path) {
+	std::ifstream stream(path, std::ios::in | std::ios::binary);
+	if (!stream)
+		return std::nullopt;
+
+	std::string line;
+	if (!std::getline(stream, line) || line != StateFileSignature)
+		return std::nullopt;
+
+	BuildState state;
+	std::vector<std::string> fields;
+
+	while (std::getline(stream, line)) {
+		if (!splitRecordFields(line, fields))
+			return std::nullopt;
+
+		const auto& kind = fields.front();
+
+		if (kind == "format" && fields.size() == 2) {
+			state.format = fields[1];
+		}
+		else if (kind == "image") {
+			if (!readSource(fields, 1, state.image))
+				return std::nullopt;
+		}
+		else if (kind == "directory" || kind == "file") {
+			Entry entry;
+			entry.type = kind == "file" ? InodeType::File : InodeType::Directory;
+
+			size_t pathField = 2;
+			if (entry.type == InodeType::File) {
+				if (!readSource(fields, 2, entry.source))
+					return std::nullopt;
+
+				pathField = 7;
+			}
+
+			if (fields.size() != pathField + 1)
+				return std::nullopt;
+
+			if (!parseRecordNumber(fields[1], entry.attributes))
+				return std::nullopt;
+
+			state.entries.emplace_hint(state.entries.end(), fields[pathField], std::move(entry));
+		}
+		else {
+			return std::nullopt;
+		}
+	}
+
+	if (!stream.eof())
+		return std::nullopt;
+
+	return state;
+}
+
+void BuildState::save(const std::filesystem::path& path) const {
+	auto temporaryPath = path;
+	temporaryPath += ".tmp";
+
+	{
+		std::ofstream stream;
+		stream.exceptions(std::ios::failbit | std::ios::badbit);
+		stream.open(temporaryPath, std::ios::out | std::ios::trunc | std::ios::binary);
+
+		stream << StateFileSignature << '\n';
+		stream << "format\t" << escapeRecordField(format) << '\n';
+		stream << "image\t";
+		writeSource(stream, image);
+		stream << '\n';
+
+		for (const auto& entry : entries) {
+			if (entry.second.type == InodeType::File) {
+				stream << "file\t" << entry.second.attributes << '\t';
+				writeSource(stream, entry.second.source);
+			}
+			else {
+				stream << "directory\t" << entry.second.attributes;
+			}
+
+			stream << '\t' << escapeRecordField(entry.first) << '\n';
+		}
+	}
+
+	std::filesystem::rename(temporaryPath, path);
+}
+
+bool BuildState::describesImage(const std::filesystem::path& path) const {
+	SourceInformation current;
+
+	try {
+		current = examineFile(path, std::filesystem::current_path());
+	}
+	catch (const std::filesystem::filesystem_error&) {
+		return false;
+	}
+
+	return sameSource(current, image);
+}
+
+void BuildState::recordImage(const std::filesystem::path& path) {
+	image = examineFile(path, std::filesystem::current_path());
+}
+
+bool BuildState::sameSource(const SourceInformation& a, const SourceInformation& b) {
+	return
+		a.absolutePath == b.absolutePath &&
+		a.size == b.size &&
+		a.modificationTime == b.modificationTime &&
+		a.device == b.device &&
+		a.inode == b.inode;
+}
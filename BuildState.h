@@ -0,0 +1,49 @@
+#ifndef BUILD_STATE_H
+#define BUILD_STATE_H
+
+#include "Inode.h"
+
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <string>
+
+/*
+ * What a build put into an image, kept in a file next to it so that the next
+ * build can update the image in place: the image file as the build left it,
+ * a description of the options the volume was formatted with, and every
+ * directory and file by its path in the image, with the source each file was
+ * copied from. Parents sort before their children.
+ */
+struct BuildState {
+	struct Entry {
+		InodeType type;
+		Attributes attributes;
+		SourceInformation source;
+	};
+
+	std::string format;
+	SourceInformation image;
+	std::map<std::string, Entry> entries;
+
+	/*
+	 * Returns nothing when there is no state file, or one this version does
+	 * not understand.
+	 */
+	static std::optional<BuildState> load(const std::filesystem::path& path);
+
+	/*
+	 * Replaces the state file atomically.
+	 */
+	void save(const std::filesystem::path& path) const;
+
+	/*
+	 * Whether the image file is still the one recorded.
+	 */
+	bool describesImage(const std::filesystem::path& path) const;
+	void recordImage(const std::filesystem::path& path);
+
+	static bool sameSource(const SourceInformation& a, const SourceInformation& b);
+};
+
+#endif
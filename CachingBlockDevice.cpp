@@ -0,0 +1,384 @@
+#include "CachingBlockDevice.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+CachingBlockDevice::CachingBlockDevice(std::unique_ptr<IBlockDevice>&& storage, size_t capacitySectors, size_t bypassSectors) :
+	m_storage(std::move(storage)),
+	m_capacity(capacitySectors),
+	m_bypassSectors(std::max<size_t>(bypassSectors, 1)),
+	m_lruHead(NoSlot),
+	m_lruTail(NoSlot),
+	m_dirtyCount(0) {
+
+	/*
+	 * A single cached access touches at most m_bypassSectors + 1 sectors,
+	 * all of which must stay resident until it completes.
+	 */
+	m_capacity = std::max(m_capacity, 2 * (m_bypassSectors + 1));
+
+	m_slots.reserve(m_capacity);
+	m_data = std::make_unique<unsigned char[]>(m_capacity * SectorSize);
+	m_staging.resize((m_bypassSectors + 1) * SectorSize);
+	m_index.reserve(m_capacity);
+}
+
+CachingBlockDevice::~CachingBlockDevice() {
+	try {
+		writeBackAll();
+	}
+	catch (...) {
+
+	}
+}
+
+void CachingBlockDevice::checkBounds(uint64_t offset, size_t size) const {
+	if (offset + size > m_storage->mediaSize() || offset + size < offset)
+		throw std::runtime_error("the access requested is out of the media bounds");
+}
+
+void CachingBlockDevice::read(uint64_t offset, void* buffer, size_t size) {
+	checkBounds(offset, size);
+
+	auto out = static_cast<unsigned char*>(buffer);
+
+	while (size > 0) {
+		auto skip = static_cast<size_t>(offset % SectorSize);
+
+		if (skip == 0 && size >= m_bypassSectors * SectorSize) {
+			auto bytes = size - size % SectorSize;
+
+			m_storage->read(offset, out, bytes);
+			overlayDirtySectors(offset / SectorSize, bytes / SectorSize, out);
+
+			offset += bytes;
+			out += bytes;
+			size -= bytes;
+		}
+		else {
+			auto chunk = skip != 0 ? std::min<size_t>(size, SectorSize - skip) : size;
+			auto firstSector = offset / SectorSize;
+			auto count = static_cast<size_t>((offset + chunk - 1) / SectorSize - firstSector + 1);
+
+			loadSectors(firstSector, count);
+
+			auto remaining = chunk;
+			for (auto sector = firstSector; remaining > 0; sector++) {
+				auto piece = std::min<size_t>(remaining, SectorSize - skip);
+
+				memcpy(out, slotData(findSlot(sector)) + skip, piece);
+
+				out += piece;
+				remaining -= piece;
+				skip = 0;
+			}
+
+			offset += chunk;
+			size -= chunk;
+		}
+	}
+}
+
+void CachingBlockDevice::write(uint64_t offset, const void* buffer, size_t size) {
+	checkBounds(offset, size);
+
+	auto in = static_cast<const unsigned char*>(buffer);
+
+	while (size > 0) {
+		auto skip = static_cast<size_t>(offset % SectorSize);
+
+		if (skip == 0 && size >= m_bypassSectors * SectorSize) {
+			auto bytes = size - size % SectorSize;
+
+			invalidateSectors(offset / SectorSize, bytes / SectorSize);
+			m_storage->write(offset, in, bytes);
+
+			offset += bytes;
+			in += bytes;
+			size -= bytes;
+		}
+		else {
+			auto piece = std::min<size_t>(size, SectorSize - skip);
+			auto sector = offset / SectorSize;
+
+			auto slot = findSlot(sector);
+			if (slot == NoSlot) {
+				if (piece == SectorSize) {
+					slot = allocateSlot(sector);
+				}
+				else {
+					loadSectors(sector, 1);
+					slot = findSlot(sector);
+				}
+			}
+
+			memcpy(slotData(slot) + skip, in, piece);
+
+			if (!m_slots[slot].dirty) {
+				m_slots[slot].dirty = true;
+				m_dirtyCount++;
+			}
+
+			offset += piece;
+			in += piece;
+			size -= piece;
+		}
+	}
+}
+
+void CachingBlockDevice::flush() {
+	writeBackAll();
+
+	m_storage->flush();
+}
+
+#if !defined(_WIN32)
+void CachingBlockDevice::copyFrom(int sourceFd, uint64_t sourceOffset, uint64_t offset, uint64_t size) {
+	checkBounds(offset, size);
+
+	if (size == 0)
+		return;
+
+	auto firstSector = offset / SectorSize;
+	auto endSector = (offset + size + SectorSize - 1) / SectorSize;
+
+	/*
+	 * The rest of a partially overwritten sector may only exist in the
+	 * cache, so it has to reach the device before the copy does.
+	 */
+	std::vector<size_t> partial;
+
+	for (auto sector : { firstSector, endSector - 1 }) {
+		auto slot = findSlot(sector);
+		if (slot != NoSlot && m_slots[slot].dirty && std::find(partial.begin(), partial.end(), slot) == partial.end())
+			partial.push_back(slot);
+	}
+
+	if (!partial.empty())
+		writeBackSlots(partial);
+
+	invalidateSectors(firstSector, endSector - firstSector);
+
+	m_storage->copyFrom(sourceFd, sourceOffset, offset, size);
+}
+#endif
+
+IBlockDevice* CachingBlockDevice::concurrentWriter() {
+	return m_storage->concurrentWriter();
+}
+
+uint64_t CachingBlockDevice::mediaSize() const {
+	return m_storage->mediaSize();
+}
+
+unsigned int CachingBlockDevice::allocationUnit() const {
+	return m_storage->allocationUnit();
+}
+
+size_t CachingBlockDevice::findSlot(uint64_t sector) {
+	auto it = m_index.find(sector);
+	if (it == m_index.end())
+		return NoSlot;
+
+	auto slot = it->second;
+	if (slot != m_lruHead) {
+		unlinkSlot(slot);
+		linkSlotFront(slot);
+	}
+
+	return slot;
+}
+
+size_t CachingBlockDevice::allocateSlot(uint64_t sector) {
+	size_t slot;
+
+	if (!m_freeSlots.empty()) {
+		slot = m_freeSlots.back();
+		m_freeSlots.pop_back();
+	}
+	else if (m_slots.size() < m_capacity) {
+		slot = m_slots.size();
+		m_slots.emplace_back();
+	}
+	else {
+		slot = m_lruTail;
+
+		auto& victim = m_slots[slot];
+		if (victim.dirty) {
+			m_storage->write(victim.sector * SectorSize, slotData(slot), SectorSize);
+			victim.dirty = false;
+			m_dirtyCount--;
+		}
+
+		m_index.erase(victim.sector);
+		unlinkSlot(slot);
+	}
+
+	auto& entry = m_slots[slot];
+	entry.sector = sector;
+	entry.dirty = false;
+
+	m_index.emplace(sector, slot);
+	linkSlotFront(slot);
+
+	return slot;
+}
+
+void CachingBlockDevice::loadSectors(uint64_t firstSector, size_t count) {
+	size_t index = 0;
+
+	while (index < count) {
+		if (findSlot(firstSector + index) != NoSlot) {
+			index++;
+			continue;
+		}
+
+		auto runStart = index;
+		while (index < count && m_index.find(firstSector + index) == m_index.end())
+			index++;
+
+		auto runLength = index - runStart;
+
+		m_storage->read((firstSector + runStart) * SectorSize, m_staging.data(), runLength * SectorSize);
+
+		for (size_t sector = 0; sector < runLength; sector++) {
+			auto slot = allocateSlot(firstSector + runStart + sector);
+			memcpy(slotData(slot), m_staging.data() + sector * SectorSize, SectorSize);
+		}
+	}
+}
+
+void CachingBlockDevice::invalidateSectors(uint64_t firstSector, uint64_t count) {
+	auto dropSlot = [this](size_t slot) {
+		if (m_slots[slot].dirty) {
+			m_slots[slot].dirty = false;
+			m_dirtyCount--;
+		}
+
+		unlinkSlot(slot);
+		m_freeSlots.push_back(slot);
+	};
+
+	if (count > m_index.size()) {
+		for (auto it = m_index.begin(); it != m_index.end(); ) {
+			if (it->first >= firstSector && it->first - firstSector < count) {
+				dropSlot(it->second);
+				it = m_index.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+	}
+	else {
+		for (uint64_t sector = firstSector; sector < firstSector + count; sector++) {
+			auto it = m_index.find(sector);
+			if (it != m_index.end()) {
+				dropSlot(it->second);
+				m_index.erase(it);
+			}
+		}
+	}
+}
+
+void CachingBlockDevice::overlayDirtySectors(uint64_t firstSector, uint64_t count, unsigned char* buffer) {
+	if (m_dirtyCount == 0)
+		return;
+
+	if (count > m_index.size()) {
+		for (const auto& entry : m_index) {
+			if (entry.first >= firstSector && entry.first - firstSector < count && m_slots[entry.second].dirty)
+				memcpy(buffer + (entry.first - firstSector) * SectorSize, slotData(entry.second), SectorSize);
+		}
+	}
+	else {
+		for (uint64_t sector = 0; sector < count; sector++) {
+			auto it = m_index.find(firstSector + sector);
+			if (it != m_index.end() && m_slots[it->second].dirty)
+				memcpy(buffer + sector * SectorSize, slotData(it->second), SectorSize);
+		}
+	}
+}
+
+void CachingBlockDevice::unlinkSlot(size_t slot) {
+	auto& entry = m_slots[slot];
+
+	if (entry.prev != NoSlot)
+		m_slots[entry.prev].next = entry.next;
+	else
+		m_lruHead = entry.next;
+
+	if (entry.next != NoSlot)
+		m_slots[entry.next].prev = entry.prev;
+	else
+		m_lruTail = entry.prev;
+
+	entry.prev = NoSlot;
+	entry.next = NoSlot;
+}
+
+void CachingBlockDevice::linkSlotFront(size_t slot) {
+	auto& entry = m_slots[slot];
+
+	entry.prev = NoSlot;
+	entry.next = m_lruHead;
+
+	if (m_lruHead != NoSlot)
+		m_slots[m_lruHead].prev = slot;
+	else
+		m_lruTail = slot;
+
+	m_lruHead = slot;
+}
+
+void CachingBlockDevice::writeBackSlots(std::vector<size_t>& slots) {
+	std::sort(slots.begin(), slots.end(), [this](size_t a, size_t b) {
+		return m_slots[a].sector < m_slots[b].sector;
+	});
+
+	std::vector<WriteSegment> segments;
+	size_t index = 0;
+
+	while (index < slots.size()) {
+		auto runStart = index;
+		auto firstSector = m_slots[slots[index]].sector;
+
+		do {
+			index++;
+		} while (index < slots.size() && m_slots[slots[index]].sector == firstSector + (index - runStart));
+
+		auto runLength = index - runStart;
+
+		if (runLength == 1) {
+			m_storage->write(firstSector * SectorSize, slotData(slots[runStart]), SectorSize);
+		}
+		else {
+			segments.clear();
+			for (size_t sector = runStart; sector < index; sector++) {
+				segments.push_back({ slotData(slots[sector]), SectorSize });
+			}
+
+			m_storage->writeGather(firstSector * SectorSize, segments.data(), segments.size());
+		}
+
+		for (size_t sector = runStart; sector < index; sector++) {
+			m_slots[slots[sector]].dirty = false;
+			m_dirtyCount--;
+		}
+	}
+}
+
+void CachingBlockDevice::writeBackAll() {
+	if (m_dirtyCount == 0)
+		return;
+
+	std::vector<size_t> dirty;
+	dirty.reserve(m_dirtyCount);
+
+	for (const auto& entry : m_index) {
+		if (m_slots[entry.second].dirty)
+			dirty.push_back(entry.second);
+	}
+
+	writeBackSlots(dirty);
+}
@@ -0,0 +1,80 @@
+#ifndef FILESYSTEM_CACHING_BLOCK_DEVICE_H
+#define FILESYSTEM_CACHING_BLOCK_DEVICE_H
+
+#include "IBlockDevice.h"
+
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <limits>
+
+/*
+ * Write-back sector cache in front of another block device. Small accesses
+ * (FAT, directory and partial data sectors) are served from a bounded LRU
+ * set of sectors; dirty sectors are written back, merged into runs, on
+ * flush() or when evicted. Large sector-aligned accesses bypass the cache.
+ */
+class CachingBlockDevice final : public IBlockDevice {
+public:
+	static constexpr unsigned int SectorSize = 512;
+	static constexpr size_t DefaultCapacitySectors = 32768;
+	static constexpr size_t DefaultBypassSectors = 16;
+
+	explicit CachingBlockDevice(std::unique_ptr<IBlockDevice>&& storage,
+		size_t capacitySectors = DefaultCapacitySectors,
+		size_t bypassSectors = DefaultBypassSectors);
+	~CachingBlockDevice() override;
+
+	void read(uint64_t offset, void* buffer, size_t size) override;
+	void write(uint64_t offset, const void* buffer, size_t size) override;
+	void flush() override;
+#if !defined(_WIN32)
+	void copyFrom(int sourceFd, uint64_t sourceOffset, uint64_t offset, uint64_t size) override;
+#endif
+	IBlockDevice* concurrentWriter() override;
+
+	uint64_t mediaSize() const override;
+	unsigned int allocationUnit() const override;
+
+private:
+	static constexpr size_t NoSlot = std::numeric_limits<size_t>::max();
+
+	struct Slot {
+		uint64_t sector;
+		size_t prev;
+		size_t next;
+		bool dirty;
+	};
+
+	inline unsigned char* slotData(size_t slot) {
+		return m_data.get() + slot * SectorSize;
+	}
+
+	void checkBounds(uint64_t offset, size_t size) const;
+
+	size_t findSlot(uint64_t sector);
+	size_t allocateSlot(uint64_t sector);
+	void loadSectors(uint64_t firstSector, size_t count);
+	void invalidateSectors(uint64_t firstSector, uint64_t count);
+	void overlayDirtySectors(uint64_t firstSector, uint64_t count, unsigned char* buffer);
+
+	void unlinkSlot(size_t slot);
+	void linkSlotFront(size_t slot);
+
+	void writeBackSlots(std::vector<size_t>& slots);
+	void writeBackAll();
+
+	std::unique_ptr<IBlockDevice> m_storage;
+	size_t m_capacity;
+	size_t m_bypassSectors;
+	std::vector<Slot> m_slots;
+	std::vector<size_t> m_freeSlots;
+	std::unique_ptr<unsigned char[]> m_data;
+	std::vector<unsigned char> m_staging;
+	std::unordered_map<uint64_t, size_t> m_index;
+	size_t m_lruHead;
+	size_t m_lruTail;
+	size_t m_dirtyCount;
+};
+
+#endif
@@ -0,0 +1,241 @@
+#include "CompiledManifest.h"
+#include "BuildState.h"
+
+#include <stdint.h>
+
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+static const char CompiledManifestSignature[24] = "fatbuilder-manifest 1";
+static const uint32_t ByteOrderMark = 0x01020304;
+
+struct CompiledManifestHeader {
+	char signature[24];
+	uint32_t byteOrder;
+	uint32_t reserved;
+	uint64_t manifestSize;
+	int64_t manifestModificationTime;
+	uint64_t manifestDevice;
+	uint64_t manifestInode;
+	uint64_t manifestPathOffset;
+	uint64_t manifestPathSize;
+	uint64_t recordCount;
+	uint64_t stringsSize;
+};
+
+/*
+ * An inode, followed by the records of its children and their subtrees.
+ * The first record is the root.
+ */
+struct CompiledManifestRecord {
+	uint64_t nameOffset;
+	uint64_t sourceOffset;
+	uint32_t nameSize;
+	uint32_t sourceSize;
+	uint32_t childCount;
+	uint8_t type;
+	uint8_t attributes;
+	uint8_t reserved[2];
+};
+
+static_assert(sizeof(CompiledManifestHeader) == 96, "the compiled manifest header is expected to be packed");
+static_assert(sizeof(CompiledManifestRecord) == 32, "compiled manifest records are expected to be packed");
+
+namespace {
+	class StringTable {
+	public:
+		/*
+		 * Where the string is in the table, adding it on first use.
+		 */
+		uint64_t intern(const std::string& string) {
+			auto result = m_offsets.try_emplace(string, m_strings.size());
+			if (result.second)
+				m_strings += string;
+
+			return result.first->second;
+		}
+
+		inline const std::string& strings() const {
+			return m_strings;
+		}
+
+	private:
+		std::string m_strings;
+		std::unordered_map<std::string, uint64_t> m_offsets;
+	};
+}
+
+static void compileInode(const Inode& inode, StringTable& strings, std::vector<CompiledManifestRecord>& records) {
+	CompiledManifestRecord record{};
+	record.nameOffset = strings.intern(inode.name());
+	record.nameSize = static_cast<uint32_t>(inode.name().size());
+	record.childCount = static_cast<uint32_t>(inode.childCount());
+	record.type = inode.type() == InodeType::Directory ? 1 : 0;
+	record.attributes = static_cast<uint8_t>(inode.attributes());
+
+	if (inode.type() == InodeType::File) {
+		auto source = inode.sourceFileName().string();
+		record.sourceOffset = strings.intern(source);
+		record.sourceSize = static_cast<uint32_t>(source.size());
+	}
+
+	records.push_back(record);
+
+	inode.enumerateChildren([&strings, &records](const Inode& child) {
+		compileInode(child, strings, records);
+	});
+}
+
+bool CompiledManifest::identify(std::string_view contents) {
+	return contents.size() >= sizeof(CompiledManifestSignature) && memcmp(contents.data(), CompiledManifestSignature, sizeof(CompiledManifestSignature)) == 0;
+}
+
+void CompiledManifest::save(const std::filesystem::path& path, const Inode& root, const SourceInformation& manifest) {
+	StringTable strings;
+	std::vector<CompiledManifestRecord> records;
+	compileInode(root, strings, records);
+
+	auto manifestPath = manifest.absolutePath.string();
+
+	CompiledManifestHeader header{};
+	memcpy(header.signature, CompiledManifestSignature, sizeof(header.signature));
+	header.byteOrder = ByteOrderMark;
+	header.manifestSize = manifest.size;
+	header.manifestModificationTime = manifest.modificationTime;
+	header.manifestDevice = manifest.device;
+	header.manifestInode = manifest.inode;
+	header.manifestPathOffset = strings.intern(manifestPath);
+	header.manifestPathSize = manifestPath.size();
+	header.recordCount = records.size();
+	header.stringsSize = strings.strings().size();
+
+	/*
+	 * Builds from the same manifest may be compiling it side by side.
+	 */
+	std::ostringstream suffix;
+	suffix << '.' << std::hex << std::random_device()() << ".tmp";
+
+	auto temporaryPath = path;
+	temporaryPath += suffix.str();
+
+	try {
+		std::ofstream stream;
+		stream.exceptions(std::ios::failbit | std::ios::badbit);
+		stream.open(temporaryPath, std::ios::out | std::ios::trunc | std::ios::binary);
+
+		stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		stream.write(reinterpret_cast<const char*>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(CompiledManifestRecord)));
+		stream.write(strings.strings().data(), static_cast<std::streamsize>(strings.strings().size()));
+		stream.close();
+
+		std::filesystem::rename(temporaryPath, path);
+	}
+	catch (...) {
+		std::error_code error;
+		std::filesystem::remove(temporaryPath, error);
+		throw;
+	}
+}
+
+std::shared_ptr<Inode> CompiledManifest::load(std::string_view contents, const SourceInformation* manifest) {
+	auto corrupt = []() {
+		return std::runtime_error("the compiled manifest is corrupt");
+	};
+
+	if (!identify(contents) || contents.size() < sizeof(CompiledManifestHeader))
+		throw corrupt();
+
+	CompiledManifestHeader header;
+	memcpy(&header, contents.data(), sizeof(header));
+
+	if (header.byteOrder != ByteOrderMark || header.recordCount == 0)
+		throw corrupt();
+
+	auto recordsSpace = contents.size() - sizeof(CompiledManifestHeader);
+	if (header.recordCount > recordsSpace / sizeof(CompiledManifestRecord) ||
+		header.stringsSize != recordsSpace - header.recordCount * sizeof(CompiledManifestRecord))
+		throw corrupt();
+
+	auto records = contents.data() + sizeof(CompiledManifestHeader);
+	auto strings = contents.substr(sizeof(CompiledManifestHeader) + header.recordCount * sizeof(CompiledManifestRecord));
+
+	auto string = [&strings, &corrupt](uint64_t offset, uint64_t size) {
+		if (offset > strings.size() || size > strings.size() - offset)
+			throw corrupt();
+
+		return strings.substr(static_cast<size_t>(offset), static_cast<size_t>(size));
+	};
+
+	if (manifest) {
+		SourceInformation compiledFrom;
+		compiledFrom.absolutePath = std::filesystem::path(std::string(string(header.manifestPathOffset, header.manifestPathSize)));
+		compiledFrom.size = header.manifestSize;
+		compiledFrom.modificationTime = header.manifestModificationTime;
+		compiledFrom.device = header.manifestDevice;
+		compiledFrom.inode = header.manifestInode;
+
+		if (!BuildState::sameSource(compiledFrom, *manifest))
+			return nullptr;
+	}
+
+	/*
+	 * The directories still expecting children, innermost last.
+	 */
+	std::vector<std::pair<Inode*, uint32_t>> open;
+	std::shared_ptr<Inode> root;
+
+	for (uint64_t index = 0; index < header.recordCount; index++) {
+		CompiledManifestRecord record;
+		memcpy(&record, records + index * sizeof(CompiledManifestRecord), sizeof(record));
+
+		if (record.type > 1 || (record.attributes & ~AttributeMask) != 0 || (record.type == 0 && record.childCount != 0))
+			throw corrupt();
+
+		auto type = record.type == 1 ? InodeType::Directory : InodeType::File;
+		auto inode = std::make_shared<Inode>(type, std::string(string(record.nameOffset, record.nameSize)), record.attributes);
+
+		if (type == InodeType::File) {
+			inode->setSourceFileName(std::filesystem::path(std::string(string(record.sourceOffset, record.sourceSize))));
+		}
+
+		if (index == 0) {
+			if (type != InodeType::Directory || !inode->name().empty())
+				throw corrupt();
+
+			root = inode;
+		}
+		else {
+			while (!open.empty() && open.back().second == 0)
+				open.pop_back();
+
+			if (open.empty())
+				throw corrupt();
+
+			open.back().second--;
+
+			try {
+				open.back().first->addChild(inode);
+			}
+			catch (const std::runtime_error&) {
+				throw corrupt();
+			}
+		}
+
+		if (type == InodeType::Directory)
+			open.emplace_back(inode.get(), record.childCount);
+	}
+
+	for (const auto& directory : open) {
+		if (directory.second != 0)
+			throw corrupt();
+	}
+
+	return root;
+}
@@ -0,0 +1,40 @@
+#ifndef COMPILED_MANIFEST_H
+#define COMPILED_MANIFEST_H
+
+#include "Inode.h"
+
+#include <filesystem>
+#include <memory>
+#include <string_view>
+
+/*
+ * A manifest compiled into a file that loads without lexing it or looking up
+ * any paths: the inodes of the tree in the order of a walk through it, each
+ * with the number of its children, and a table of their names and sources in
+ * which every string is stored once. It also records the text manifest it
+ * was compiled from, by its size, modification time and identity, so that it
+ * can stand in for that manifest until it changes.
+ *
+ * The file is in the byte order of the machine that wrote it, and taken for
+ * corrupt elsewhere.
+ */
+struct CompiledManifest {
+	/*
+	 * Whether contents start like a compiled manifest.
+	 */
+	static bool identify(std::string_view contents);
+
+	/*
+	 * Writes the tree under root, replacing path atomically.
+	 */
+	static void save(const std::filesystem::path& path, const Inode& root, const SourceInformation& manifest);
+
+	/*
+	 * The root of the tree in contents. With manifest given, returns nothing
+	 * when contents were compiled from another version of that manifest,
+	 * before loading anything. Anything wrong with contents is thrown.
+	 */
+	static std::shared_ptr<Inode> load(std::string_view contents, const SourceInformation* manifest = nullptr);
+};
+
+#endif
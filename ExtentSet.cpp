@@ -0,0 +1,62 @@
+#include "ExtentSet.h"
+
+#include <algorithm>
+
+ExtentSet::ExtentSet() = default;
+
+ExtentSet::~ExtentSet() = default;
+
+void ExtentSet::add(uint64_t begin, uint64_t end) {
+	if (begin >= end)
+		return;
+
+	auto it = m_extents.upper_bound(begin);
+
+	if (it != m_extents.begin()) {
+		auto previous = std::prev(it);
+		if (previous->second >= begin) {
+			if (previous->second >= end)
+				return;
+
+			begin = previous->first;
+			it = previous;
+		}
+	}
+
+	while (it != m_extents.end() && it->first <= end) {
+		end = std::max(end, it->second);
+		it = m_extents.erase(it);
+	}
+
+	m_extents.emplace_hint(it, begin, end);
+}
+
+void ExtentSet::clear() {
+	m_extents.clear();
+}
+
+bool ExtentSet::contains(uint64_t begin, uint64_t end) const {
+	if (begin >= end)
+		return true;
+
+	auto it = m_extents.upper_bound(begin);
+	if (it == m_extents.begin())
+		return false;
+
+	--it;
+
+	return it->second >= end;
+}
+
+bool ExtentSet::intersects(uint64_t begin, uint64_t end) const {
+	if (begin >= end)
+		return false;
+
+	auto it = m_extents.lower_bound(end);
+	if (it == m_extents.begin())
+		return false;
+
+	--it;
+
+	return it->second > begin;
+}
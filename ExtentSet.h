@@ -0,0 +1,45 @@
+#ifndef UTILITY_EXTENT_SET_H
+#define UTILITY_EXTENT_SET_H
+
+#include <map>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Set of disjoint, non-adjacent half-open byte ranges [begin, end).
+ */
+class ExtentSet {
+public:
+	using Storage = std::map<uint64_t, uint64_t>;
+	using const_iterator = Storage::const_iterator;
+
+	ExtentSet();
+	~ExtentSet();
+
+	void add(uint64_t begin, uint64_t end);
+	void clear();
+
+	bool contains(uint64_t begin, uint64_t end) const;
+	bool intersects(uint64_t begin, uint64_t end) const;
+
+	inline bool empty() const {
+		return m_extents.empty();
+	}
+
+	inline size_t size() const {
+		return m_extents.size();
+	}
+
+	inline const_iterator begin() const {
+		return m_extents.begin();
+	}
+
+	inline const_iterator end() const {
+		return m_extents.end();
+	}
+
+private:
+	Storage m_extents;
+};
+
+#endif
@@ -0,0 +1,86 @@
+#include "FATClock.h"
+
+#include <time.h>
+
+#include <algorithm>
+
+#include <ff.h>
+
+static thread_local FATClock* currentClock = nullptr;
+
+static uint32_t packFATTime(const tm& parts) {
+	return
+		(((parts.tm_year - 80) & 127) << 25) |
+		(((parts.tm_mon + 1) & 15) << 21) |
+		((parts.tm_mday & 31) << 16) |
+		((parts.tm_hour & 31) << 11) |
+		((parts.tm_min & 63) << 5) |
+		((parts.tm_sec / 2) & 31);
+}
+
+FATClock::FATClock(int64_t time, bool sourceTimes) : m_time(time), m_sourceTimes(sourceTimes), m_now(fromUnixTime(time)), m_previous(currentClock) {
+	currentClock = this;
+}
+
+FATClock::~FATClock() {
+	currentClock = m_previous;
+}
+
+uint32_t FATClock::fileTime(int64_t sourceModificationTime) const {
+	if (!m_sourceTimes)
+		return fromUnixTime(m_time);
+
+	/*
+	 * Rounded down to whole seconds, also before the epoch.
+	 */
+	auto seconds = sourceModificationTime / 1000000000;
+	if (sourceModificationTime % 1000000000 < 0)
+		seconds--;
+
+	return fromUnixTime(std::min(seconds, m_time));
+}
+
+void FATClock::leaveFile() {
+	m_now = fromUnixTime(m_time);
+}
+
+FATClock* FATClock::current() {
+	return currentClock;
+}
+
+uint32_t FATClock::fromUnixTime(int64_t time) {
+	/*
+	 * 1980-01-01 00:00:00 and 2107-12-31 23:59:59.
+	 */
+	static constexpr int64_t Earliest = INT64_C(315532800);
+	static constexpr int64_t Latest = INT64_C(4354819199);
+
+	if (time < Earliest)
+		time = Earliest;
+	else if (time > Latest)
+		time = Latest;
+
+	auto timestamp = static_cast<time_t>(time);
+	tm parts;
+#if defined(_WIN32)
+	gmtime_s(&parts, &timestamp);
+#else
+	gmtime_r(&timestamp, &parts);
+#endif
+
+	return packFATTime(parts);
+}
+
+DWORD get_fattime(void) {
+	if (currentClock)
+		return currentClock->now();
+
+	auto timestamp = time(nullptr);
+	tm parts;
+#if defined(_WIN32)
+	localtime_s(&parts, &timestamp);
+#else
+	localtime_r(&timestamp, &parts);
+#endif
+	return packFATTime(parts);
+}
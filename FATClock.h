@@ -0,0 +1,59 @@
+#ifndef FILESYSTEM_FAT_CLOCK_H
+#define FILESYSTEM_FAT_CLOCK_H
+
+#include <stdint.h>
+
+/*
+ * Where the timestamps of a build come from. Both writers stamp new entries,
+ * and the volume serial number, with get_fattime(), which asks the clock
+ * created last on the calling thread and still alive, and reads the wall
+ * clock when there is none.
+ */
+class FATClock {
+public:
+	/*
+	 * A clock standing still at time, in seconds since the Unix epoch. With
+	 * sourceTimes, files take the modification time of their source instead
+	 * where it is earlier.
+	 */
+	FATClock(int64_t time, bool sourceTimes);
+	~FATClock();
+
+	FATClock(const FATClock& other) = delete;
+	FATClock &operator =(const FATClock& other) = delete;
+
+	inline uint32_t now() const {
+		return m_now;
+	}
+
+	/*
+	 * What a file whose source was last modified at sourceModificationTime,
+	 * in nanoseconds since the Unix epoch, is stamped with.
+	 */
+	uint32_t fileTime(int64_t sourceModificationTime) const;
+
+	/*
+	 * Bracket the creation and writing of such a file.
+	 */
+	inline void enterFile(int64_t sourceModificationTime) {
+		m_now = fileTime(sourceModificationTime);
+	}
+
+	void leaveFile();
+
+	static FATClock* current();
+
+	/*
+	 * FAT date and time of the UTC time given in seconds since the Unix
+	 * epoch, clamped to the years FAT can store.
+	 */
+	static uint32_t fromUnixTime(int64_t time);
+
+private:
+	int64_t m_time;
+	bool m_sourceTimes;
+	uint32_t m_now;
+	FATClock* m_previous;
+};
+
+#endif
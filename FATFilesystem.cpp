@@ -1,98 +1,197 @@
 #include "FATFilesystem.h"
 #include "IBlockDevice.h"
 #include "FATFilesystemLayout.h"
-#include <time.h>
 
 #include <string>
-#include <sstream>
 #include <unordered_map>
 #include <stdexcept>
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <utility>
+
+std::atomic<unsigned int> FATFilesystem::AllocatedDriveNumber::m_nextDrive;
+std::atomic<unsigned int> FATFilesystem::AllocatedDriveNumber::m_waiting;
+std::mutex FATFilesystem::AllocatedDriveNumber::m_mutex;
+std::condition_variable FATFilesystem::AllocatedDriveNumber::m_released;
+std::array<std::atomic<FATFilesystem *>, FF_VOLUMES> FATFilesystem::AllocatedDriveNumber::m_allocatedDrives;
+std::array<std::atomic<std::thread::id>, FF_VOLUMES> FATFilesystem::AllocatedDriveNumber::m_owners;
+
+/*
+ * fatfs formats and mounts volumes through shared state, even with
+ * FF_FS_REENTRANT, which only guards the access to a mounted volume.
+ */
+static std::mutex volumeControlMutex;
+
+/*
+ * What the storage threw while fatfs was calling into it on this thread.
+ * Unwinding through fatfs would leave the volume locked, so the exception
+ * is held here and rethrown once the fatfs call has returned.
+ */
+static thread_local std::exception_ptr storageError;
+
+/*
+ * Drives are claimed without a lock, starting from a different drive each
+ * time so that concurrent volumes do not all compete for the first one. Only
+ * once all FF_VOLUMES drives are in use does a volume wait for one to be
+ * released. A thread that holds drives itself could be waiting for one of
+ * its own, so it fails instead.
+ */
+FATFilesystem::AllocatedDriveNumber::AllocatedDriveNumber(FATFilesystem *owner) {
+	if (tryAllocate(owner))
+		return;
 
-std::array<FATFilesystem *, 10> FATFilesystem::AllocatedDriveNumber::m_allocatedDrives;
+	auto self = std::this_thread::get_id();
+	for (const auto& drive : m_owners) {
+		if (drive.load(std::memory_order_relaxed) == self)
+			throw std::runtime_error("all " + std::to_string(FF_VOLUMES) + " fatfs drives are in use, and this thread already has a volume open");
+	}
 
-FATFilesystem::AllocatedDriveNumber::AllocatedDriveNumber(FATFilesystem *owner) {
-	for (size_t index = 0; index < m_allocatedDrives.size(); index++) {
-		if (!m_allocatedDrives[index]) {
-			m_allocatedDrives[index] = owner;
+	std::unique_lock<std::mutex> locker(m_mutex);
+
+	m_waiting++;
+	m_released.wait(locker, [this, owner]() { return tryAllocate(owner); });
+	m_waiting--;
+}
+
+FATFilesystem::AllocatedDriveNumber::~AllocatedDriveNumber() {
+	m_owners[m_driveNumber].store(std::thread::id(), std::memory_order_relaxed);
+	m_allocatedDrives[m_driveNumber].store(nullptr);
+
+	/*
+	 * A volume that started waiting after this check finds the drive free
+	 * when it tries again under the lock.
+	 */
+	if (m_waiting.load() != 0) {
+		std::unique_lock<std::mutex> locker(m_mutex);
+		m_released.notify_one();
+	}
+}
+
+bool FATFilesystem::AllocatedDriveNumber::tryAllocate(FATFilesystem *owner) {
+	auto first = m_nextDrive.fetch_add(1, std::memory_order_relaxed);
+
+	for (size_t offset = 0; offset < m_allocatedDrives.size(); offset++) {
+		auto index = static_cast<unsigned int>((first + offset) % m_allocatedDrives.size());
+
+		FATFilesystem* expected = nullptr;
+		if (m_allocatedDrives[index].compare_exchange_strong(expected, owner)) {
+			m_owners[index].store(std::this_thread::get_id(), std::memory_order_relaxed);
 			m_driveNumber = index;
-			return;
+			return true;
 		}
 	}
 
-	throw std::runtime_error("too many FAT drives");
+	return false;
 }
 
-FATFilesystem::AllocatedDriveNumber::~AllocatedDriveNumber() {
-	m_allocatedDrives[m_driveNumber] = nullptr;
+/*
+ * The drive prefix of a volume, as fatfs takes it in front of every path.
+ */
+static FatfsString drivePrefix(unsigned int driveNumber) {
+	FatfsString prefix;
+
+	for (auto character : std::to_string(driveNumber) + ":/") {
+		prefix.push_back(static_cast<FatfsCharacter>(character));
+	}
+
+	return prefix;
 }
 
-FATFilesystem::FATFilesystem(std::unique_ptr<IBlockDevice>&& storage, const FATFilesystemLayout &layout) : m_driveNumber(this), m_storage(std::move(storage)) {
-	static const LBA_t plist[2] = { 100, 0 };
+FATFilesystem::FATFilesystem(std::unique_ptr<IBlockDevice>&& storage, const FATFilesystemLayout &layout, const FATVolumeParameters& parameters) : m_driveNumber(this), m_drivePrefix(drivePrefix(m_driveNumber)), m_storage(std::move(storage)) {
+	static const BYTE formats[] = { FM_ANY, FM_FAT, FM_FAT32 };
+
+	MKFS_PARM options = {
+		formats[static_cast<size_t>(parameters.types)],
+		static_cast<BYTE>(parameters.fatCount),
+		0,
+		parameters.rootEntries,
+		parameters.clusterSize
+	};
+
+	std::unique_lock<std::mutex> locker(volumeControlMutex);
+
+	translateError(f_mkfs(pathToPartition().c_str(), &options, m_workArea, sizeof(m_workArea)));
+
+	/*
+	 * f_mkfs aligns the data area to the allocation unit of the storage, but
+	 * only clusters of at least that size keep every file aligned to it too.
+	 */
+	auto allocationUnit = m_storage->allocationUnit();
+	if (parameters.clusterSize == 0 && allocationUnit > FF_MAX_SS) {
+		translateError(f_mount(&m_fs, pathToPartition().c_str(), 1));
+		auto formattedClusterSize = clusterSize();
+		f_mount(nullptr, pathToPartition().c_str(), 0);
 
-	translateError(f_mkfs(pathToPartition().c_str(), nullptr, m_workArea, sizeof(m_workArea)));
+		if (formattedClusterSize < allocationUnit) {
+			auto aligned = options;
+			aligned.au_size = allocationUnit;
+
+			auto result = f_mkfs(pathToPartition().c_str(), &aligned, m_workArea, sizeof(m_workArea));
+			if (result != FR_OK && result != FR_DISK_ERR)
+				result = f_mkfs(pathToPartition().c_str(), &options, m_workArea, sizeof(m_workArea));
+
+			translateError(result);
+		}
+	}
 
 	installBootCode(layout);
 
 	translateError(f_mount(&m_fs, pathToPartition().c_str(), 1));
 }
 
+FATFilesystem::FATFilesystem(std::unique_ptr<IBlockDevice>&& storage, MountExisting) : m_driveNumber(this), m_drivePrefix(drivePrefix(m_driveNumber)), m_storage(std::move(storage)) {
+	std::unique_lock<std::mutex> locker(volumeControlMutex);
+
+	translateError(f_mount(&m_fs, pathToPartition().c_str(), 1));
+}
+
 FATFilesystem::~FATFilesystem() {
+	std::unique_lock<std::mutex> locker(volumeControlMutex);
+
 	f_mount(nullptr, pathToPartition().c_str(), 0);
 }
 
 void FATFilesystem::translateError(FRESULT result) {
+	auto error = std::exchange(storageError, nullptr);
+	if (error)
+		std::rethrow_exception(error);
+
 	if (result != FR_OK)
 		throw std::runtime_error("fatfs call failed with status " + std::to_string(result));
 }
 
 void FATFilesystem::installBootCode(const FATFilesystemLayout &layout) {
-	if (disk_read(m_driveNumber, m_workArea, 0, 1) != RES_OK)
-		throw std::runtime_error("failed to read MBR");
-
-	memcpy(m_workArea, layout.mbrCode, 446);
+	m_storage->read(0, m_workArea, 512);
 
-	m_workArea[446] = 0x80; // Mark partition as active
-	m_workArea[450] = 0x0E; // Set partition type as FAT16-LBA
+	layout.installMBRCode(m_workArea);
 
 	auto firstBlock = *reinterpret_cast<const uint32_t*>(&m_workArea[446 + 8]);
 
-	if (disk_write(m_driveNumber, m_workArea, 0, 1) != RES_OK)
-		throw std::runtime_error("failed to rewrite MBR");
+	m_storage->write(0, m_workArea, 512);
 
-	if (disk_read(m_driveNumber, m_workArea, firstBlock, 1) != RES_OK)
-		throw std::runtime_error("failed to read PBR");
+	m_storage->read(static_cast<uint64_t>(firstBlock) * 512, m_workArea, 512);
 
-	auto signature = reinterpret_cast<const char*>(&m_workArea[0x36]);
+	layout.installPBRCode(m_workArea);
 
-	if (strncmp(signature, "FAT32   ", 8) == 0) {
-		throw std::runtime_error("FAT32 boot is not implemented yet");
-	}
-	else {
-		auto bootCode = static_cast<const uint8_t*>(layout.pbrCode12_16);
+	m_storage->write(static_cast<uint64_t>(firstBlock) * 512, m_workArea, 512);
 
-		memcpy(&m_workArea[0], &bootCode[0], 3 + 8);
-		memcpy(&m_workArea[0x3E], &bootCode[0x3E], 448);
+	if (FATFilesystemLayout::isFAT32BootSector(m_workArea)) {
+		layout.installPBRCode32Continuation(m_workArea);
 
-		if (disk_write(m_driveNumber, m_workArea, firstBlock, 1) != RES_OK)
-			throw std::runtime_error("failed to rewrite PBR");
+		m_storage->write(static_cast<uint64_t>(firstBlock + 2) * 512, m_workArea, 512);
 	}
-
 }
 
-FatfsString FATFilesystem::pathToPartition(const FatfsString & path) {
-	using ch = std::remove_reference<decltype(path)>::type::value_type;
-
-	std::basic_stringstream<ch> stream;
-	stream << m_driveNumber << static_cast<ch>(':') << static_cast<ch>('/');
-	if (!path.empty())
-		stream << path;
+FatfsString FATFilesystem::pathToPartition(const FatfsString & path) const {
+	auto fpath = m_drivePrefix;
+	fpath.append(path);
 
-	auto fpath = stream.str();
-
-	for (auto& ch : fpath) {
-		if (ch == '\\')
-			ch = '/';
-	}
+	std::replace(fpath.begin() + m_drivePrefix.size(), fpath.end(), static_cast<FatfsCharacter>('\\'), static_cast<FatfsCharacter>('/'));
 
 	return fpath;
 }
@@ -114,7 +213,45 @@ std::unique_ptr<IFile> FATFilesystem::open(const FatfsString& name, const FatfsS
 }
 
 void FATFilesystem::setAttributes(const FatfsString& name, unsigned int attributes, unsigned int attributeMask) {
-	translateError(f_chmod(name.c_str(), attributes, attributeMask));
+	translateError(f_chmod(pathToPartition(name).c_str(), attributes, attributeMask));
+}
+
+void FATFilesystem::remove(const FatfsString& name) {
+	translateError(f_unlink(pathToPartition(name).c_str()));
+}
+
+void FATFilesystem::flush() {
+	m_storage->flush();
+}
+
+std::vector<FILINFO> FATFilesystem::listDirectory(const FatfsString& name) {
+	DIR directory;
+	translateError(f_opendir(&directory, pathToPartition(name).c_str()));
+
+	std::vector<FILINFO> entries;
+
+	while (true) {
+		FILINFO information;
+
+		auto result = f_readdir(&directory, &information);
+		if (result != FR_OK || information.fname[0] == 0) {
+			f_closedir(&directory);
+			translateError(result);
+			break;
+		}
+
+		entries.push_back(information);
+	}
+
+	return entries;
+}
+
+size_t FATFilesystem::clusterSize() const {
+	return static_cast<size_t>(m_fs.csize) * FF_MAX_SS;
+}
+
+IBlockDevice* FATFilesystem::storage() {
+	return m_storage.get();
 }
 
 FATFilesystem::FATFile::FATFile(FATFilesystem* parent, const FatfsString& name, const FatfsString & mode) : m_parent(parent) {
@@ -139,6 +276,11 @@ FATFilesystem::FATFile::FATFile(FATFilesystem* parent, const FatfsString& name,
 
 FATFilesystem::FATFile::~FATFile() {
 	f_close(&m_file);
+
+	/*
+	 * There is nowhere to report a failure to write the entry back to.
+	 */
+	storageError = nullptr;
 }		
 
 int64_t FATFilesystem::FATFile::seek(int64_t offset, SeekWhence whence) {
@@ -182,24 +324,83 @@ size_t FATFilesystem::FATFile::write(const void* data, size_t size) {
 	auto result = f_write(&m_file, data, static_cast<UINT>(size), &written);
 	m_parent->translateError(result);
 
+	/*
+	 * fatfs reports a full volume only through a short write.
+	 */
+	if (written != size)
+		throw std::runtime_error("not enough free space in the image");
+
 	return written;
 }
 
-DWORD get_fattime(void) {
-	auto timestamp = time(nullptr);
-	tm parts;
-#if defined(_WIN32)
-	localtime_s(&parts, &timestamp);
-#else
-	localtime_r(&timestamp, &parts);
-#endif
-	return
-		(((parts.tm_year - 80) & 127) << 25) |
-		(((parts.tm_mon + 1) & 15) << 21) |
-		((parts.tm_mday & 31) << 16) |
-		((parts.tm_hour & 31) << 11) |
-		((parts.tm_min & 63) << 5) |
-		((parts.tm_sec / 2) & 31);
+void FATFilesystem::FATFile::preallocate(uint64_t size) {
+	if (size == 0)
+		return;
+
+	if (size > std::numeric_limits<FSIZE_t>::max())
+		throw std::runtime_error("file is too large");
+
+	auto result = f_expand(&m_file, static_cast<FSIZE_t>(size), 1);
+	if (result == FR_DENIED && f_size(&m_file) == 0) {
+		/*
+		 * No contiguous free space is left: extend the file by seeking past its
+		 * end instead, which allocates the clusters one by one.
+		 */
+		m_parent->translateError(f_lseek(&m_file, static_cast<FSIZE_t>(size)));
+
+		if (f_tell(&m_file) != size)
+			throw std::runtime_error("not enough free space for the file");
+
+		m_parent->translateError(f_lseek(&m_file, 0));
+	}
+	else {
+		m_parent->translateError(result);
+	}
+}
+
+std::vector<IFile::Extent> FATFilesystem::FATFile::extents() {
+	std::vector<Extent> extents;
+
+	uint64_t remaining = f_size(&m_file);
+	if (remaining == 0)
+		return extents;
+
+	/*
+	 * The cluster link map of the fast seek feature lists the contiguous
+	 * fragments of the chain as (length, first cluster) pairs.
+	 */
+	std::vector<DWORD> linkMap(32);
+
+	while (true) {
+		linkMap[0] = static_cast<DWORD>(linkMap.size());
+		m_file.cltbl = linkMap.data();
+		auto result = f_lseek(&m_file, CREATE_LINKMAP);
+		m_file.cltbl = nullptr;
+
+		if (result == FR_NOT_ENOUGH_CORE) {
+			linkMap.resize(linkMap[0]);
+			continue;
+		}
+
+		m_parent->translateError(result);
+		break;
+	}
+
+	const auto& fs = m_parent->m_fs;
+	uint64_t clusterSize = static_cast<uint64_t>(fs.csize) * FF_MAX_SS;
+
+	for (size_t index = 1; linkMap[index] != 0 && remaining != 0; index += 2) {
+		auto length = std::min<uint64_t>(linkMap[index] * clusterSize, remaining);
+		auto sector = fs.database + static_cast<uint64_t>(linkMap[index + 1] - 2) * fs.csize;
+
+		extents.push_back({ sector * FF_MAX_SS, length });
+		remaining -= length;
+	}
+
+	if (remaining != 0)
+		throw std::runtime_error("cluster chain is shorter than the file");
+
+	return extents;
 }
 
 void* ff_memalloc(UINT msize) {
@@ -210,6 +411,32 @@ void ff_memfree(void* mblock) {
 	free(mblock);
 }
 
+/*
+ * fatfs holds the sync object of a volume for the duration of each call on
+ * it, giving up after FF_FS_TIMEOUT milliseconds.
+ */
+int ff_cre_syncobj(BYTE vol, FF_SYNC_t* sobj) {
+	(void)vol;
+
+	*sobj = new(std::nothrow) std::timed_mutex();
+
+	return *sobj != nullptr;
+}
+
+int ff_req_grant(FF_SYNC_t sobj) {
+	return static_cast<std::timed_mutex*>(sobj)->try_lock_for(std::chrono::milliseconds(FF_FS_TIMEOUT));
+}
+
+void ff_rel_grant(FF_SYNC_t sobj) {
+	static_cast<std::timed_mutex*>(sobj)->unlock();
+}
+
+int ff_del_syncobj(FF_SYNC_t sobj) {
+	delete static_cast<std::timed_mutex*>(sobj);
+
+	return 1;
+}
+
 
 DSTATUS disk_initialize(BYTE pdrv) {
 	return disk_status(pdrv);
@@ -230,7 +457,13 @@ DRESULT disk_read(BYTE pdrv, BYTE* buff, LBA_t sector, UINT count) {
 	if (fs == nullptr)
 		return RES_NOTRDY;
 
-	fs->m_storage->read(static_cast<uint64_t>(sector) * 512, buff, static_cast<size_t>(count) * 512);
+	try {
+		fs->m_storage->read(static_cast<uint64_t>(sector) * 512, buff, static_cast<size_t>(count) * 512);
+	}
+	catch (...) {
+		storageError = std::current_exception();
+		return RES_ERROR;
+	}
 
 	return RES_OK;
 }
@@ -241,7 +474,13 @@ DRESULT disk_write(BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count) {
 	if (fs == nullptr)
 		return RES_NOTRDY;
 
-	fs->m_storage->write(static_cast<uint64_t>(sector) * 512, buff, static_cast<size_t>(count) * 512);
+	try {
+		fs->m_storage->write(static_cast<uint64_t>(sector) * 512, buff, static_cast<size_t>(count) * 512);
+	}
+	catch (...) {
+		storageError = std::current_exception();
+		return RES_ERROR;
+	}
 
 	return RES_OK;
 }
@@ -254,7 +493,11 @@ DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void* buff) {
 
 	switch (cmd) {
 	case CTRL_SYNC:
-		fs->m_storage->flush();
+		/*
+		 * fatfs requests a sync after every f_close, f_mkdir and f_chmod.
+		 * Pending writes stay visible through the storage stack, so the
+		 * image is made durable only once, by FATFilesystem::flush().
+		 */
 		return RES_OK;
 
 	case GET_SECTOR_COUNT:
@@ -5,24 +5,55 @@
 #include "IFile.h"
 #include "StringUtils.h"
 #include "FATFilesystemLayout.h"
+#include "FATVolumeGeometry.h"
 
 #include <memory>
 #include <array>
+#include <vector>
+#include <atomic>
+#include <condition_variable>
 #include <filesystem>
+#include <mutex>
+#include <thread>
 
 #include <ff.h>
 #include <diskio.h>
 
 class IBlockDevice;
 
+/*
+ * A volume formatted or mounted through fatfs. Each open volume takes one of
+ * the FF_VOLUMES (256) fatfs drives, shared by every thread of the process.
+ * Once all of them are taken, opening a volume waits for another one to be
+ * closed, or throws if the thread has a volume open itself and might be the
+ * one it waits for.
+ */
 class FATFilesystem final : public IFilesystem {
 public:
-	explicit FATFilesystem(std::unique_ptr<IBlockDevice>&& storage, const FATFilesystemLayout &layout = FATFilesystemLayout());
+	struct MountExisting {};
+
+	explicit FATFilesystem(std::unique_ptr<IBlockDevice>&& storage, const FATFilesystemLayout &layout = FATFilesystemLayout(), const FATVolumeParameters& parameters = FATVolumeParameters());
+
+	/*
+	 * Mounts the volume already on the storage instead of formatting it.
+	 */
+	FATFilesystem(std::unique_ptr<IBlockDevice>&& storage, MountExisting);
 	~FATFilesystem() override;
 
 	bool createDirectory(const FatfsString& name) override;
 	std::unique_ptr<IFile> open(const FatfsString& name, const FatfsString& mode) override;
 	virtual void setAttributes(const FatfsString& name, unsigned int attributes, unsigned int attributeMask) override;
+	void remove(const FatfsString& name) override;
+	void flush() override;
+
+	/*
+	 * The entries of a directory, without the dot entries, in the order
+	 * they are stored in.
+	 */
+	std::vector<FILINFO> listDirectory(const FatfsString& name);
+
+	size_t clusterSize() const override;
+	IBlockDevice* storage() override;
 
 private:
 	class AllocatedDriveNumber {
@@ -37,10 +68,17 @@ private:
 			return m_driveNumber;
 		}
 
-		static inline FATFilesystem* getFS(unsigned int number) { return m_allocatedDrives[number]; }
+		static inline FATFilesystem* getFS(unsigned int number) { return m_allocatedDrives[number].load(std::memory_order_acquire); }
 
 	private:
-		static std::array<FATFilesystem *, 10> m_allocatedDrives;
+		bool tryAllocate(FATFilesystem *owner);
+
+		static std::atomic<unsigned int> m_nextDrive;
+		static std::atomic<unsigned int> m_waiting;
+		static std::mutex m_mutex;
+		static std::condition_variable m_released;
+		static std::array<std::atomic<FATFilesystem *>, FF_VOLUMES> m_allocatedDrives;
+		static std::array<std::atomic<std::thread::id>, FF_VOLUMES> m_owners;
 		unsigned int m_driveNumber;
 	};
 
@@ -52,6 +90,8 @@ private:
 		int64_t seek(int64_t offset, SeekWhence whence) override;
 		size_t read(void* data, size_t size) override;
 		size_t write(const void* data, size_t size) override;
+		void preallocate(uint64_t size) override;
+		std::vector<Extent> extents() override;
 
 	private:
 		FATFilesystem* m_parent;
@@ -67,9 +107,10 @@ private:
 	friend DRESULT disk_write(BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count);
 	friend DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void* buff);
 
-	FatfsString pathToPartition(const FatfsString &path = FatfsString());
+	FatfsString pathToPartition(const FatfsString &path = FatfsString()) const;
 
 	AllocatedDriveNumber m_driveNumber;
+	FatfsString m_drivePrefix;
 	std::unique_ptr<IBlockDevice> m_storage;
 	unsigned char m_workArea[128 * FF_MAX_SS];
 	FATFS m_fs;
@@ -170,3 +170,29 @@ const unsigned char FATFilesystemLayout::m_pbrCode_32[1536]{
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x55, 0xaa
 };
 
+
+void FATFilesystemLayout::installMBRCode(unsigned char *mbr) const {
+    memcpy(mbr, mbrCode, 446);
+
+    mbr[446] = 0x80; // Mark partition as active
+    mbr[450] = 0x0E; // Set partition type as FAT16-LBA
+}
+
+void FATFilesystemLayout::installPBRCode(unsigned char *pbr) const {
+    if (isFAT32BootSector(pbr)) {
+        memcpy(&pbr[0], &pbrCode32[0], 3 + 8);
+        memcpy(&pbr[0x5A], &pbrCode32[0x5A], 420);
+    }
+    else {
+        memcpy(&pbr[0], &pbrCode12_16[0], 3 + 8);
+        memcpy(&pbr[0x3E], &pbrCode12_16[0x3E], 448);
+    }
+}
+
+void FATFilesystemLayout::installPBRCode32Continuation(unsigned char *sector) const {
+    memcpy(sector, &pbrCode32[2 * 512], 512);
+}
+
+bool FATFilesystemLayout::isFAT32BootSector(const unsigned char *pbr) {
+    return strncmp(reinterpret_cast<const char*>(&pbr[0x52]), "FAT32   ", 8) == 0;
+}
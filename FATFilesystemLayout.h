@@ -7,6 +7,17 @@ struct FATFilesystemLayout {
     const unsigned char *mbrCode = m_mbrCode;
     const unsigned char *pbrCode12_16 = m_pbrCode_12_16;
     const unsigned char *pbrCode32 = m_pbrCode_32;
+
+    /*
+     * Patch the boot code into a freshly formatted MBR or volume boot sector.
+     * FAT32 boot code goes on in a second sector, the third of the volume.
+     */
+    void installMBRCode(unsigned char *mbr) const;
+    void installPBRCode(unsigned char *pbr) const;
+    void installPBRCode32Continuation(unsigned char *sector) const;
+
+    static bool isFAT32BootSector(const unsigned char *pbr);
+
 private:
 
     static const unsigned char m_mbrCode[512];
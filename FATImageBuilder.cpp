@@ -0,0 +1,89 @@
+#include "FATImageBuilder.h"
+#include "BuildState.h"
+#include "FATFilesystem.h"
+#include "IBlockDevice.h"
+#include "NativeFATFilesystem.h"
+
+#include <stdexcept>
+
+FATImageBuilder::FATImageBuilder(FilesystemTree& tree, const Options& options) : m_tree(tree), m_options(options), m_mediaSize(0) {
+	auto contents = m_tree.volumeContents(m_options.additionalFreeSpace);
+
+	if (m_options.layoutPolicy == LayoutPolicy::Size) {
+		m_parameters = FATVolumeGeometry::optimize(contents, m_options.allocationUnit, FATVolumeGeometry::Objective::Size);
+	}
+	else if (m_options.layoutPolicy == LayoutPolicy::Metadata) {
+		m_parameters = FATVolumeGeometry::optimize(contents, m_options.allocationUnit, FATVolumeGeometry::Objective::Metadata);
+	}
+
+	/*
+	 * Keeping the cluster size and FAT type keeps the previous clusters
+	 * meaningful, and keeping the whole volume keeps them in place.
+	 */
+	if (m_options.previousLayout) {
+		if (m_options.writer != Writer::Native)
+			throw std::logic_error("previous layouts are kept by the native writer only");
+
+		m_previousLayout = *m_options.previousLayout;
+		m_options.previousLayout = nullptr;
+
+		/*
+		 * What is no longer in the tree leaves its space free from the
+		 * start.
+		 */
+		BuildState state;
+		m_tree.collectBuildState(state);
+
+		m_previousLayout->retain([&state](const std::string& path, bool directory) {
+			auto entry = state.entries.find(path);
+			return entry != state.entries.end() && (entry->second.type == InodeType::Directory) == directory;
+		});
+
+		try {
+			if (FATVolumeGeometry::planForDevice(m_previousLayout->mediaSize, m_options.allocationUnit, m_previousLayout->parameters).holds(contents))
+				m_mediaSize = m_previousLayout->mediaSize;
+			else
+				m_mediaSize = FATVolumeGeometry::minimumMediaSize(contents, m_options.allocationUnit, m_previousLayout->parameters);
+
+			m_parameters = m_previousLayout->parameters;
+		}
+		catch (const std::runtime_error&) {
+			m_mediaSize = 0;
+		}
+	}
+
+	if (m_mediaSize == 0)
+		m_mediaSize = FATVolumeGeometry::minimumMediaSize(contents, m_options.allocationUnit, m_parameters);
+}
+
+bool FATImageBuilder::build(std::unique_ptr<IBlockDevice>&& device, const FilesystemBuildOptions& buildOptions, FATLayoutMap* layoutMap) {
+	std::unique_ptr<IFilesystem> fs;
+	NativeFATFilesystem* native = nullptr;
+
+	if (m_options.writer == Writer::Fatfs) {
+		if (layoutMap)
+			throw std::logic_error("layout maps are kept by the native writer only");
+
+		fs = std::make_unique<FATFilesystem>(std::move(device), m_options.bootCode, m_parameters);
+	}
+	else {
+		auto nativeFs = std::make_unique<NativeFATFilesystem>(std::move(device), m_options.bootCode, m_parameters);
+		native = nativeFs.get();
+		fs = std::move(nativeFs);
+	}
+
+	bool keptPreviousLayout = true;
+	if (m_previousLayout) {
+		keptPreviousLayout = native->pinLayout(*m_previousLayout);
+	}
+
+	m_tree.buildFilesystem(fs.get(), buildOptions);
+
+	fs->flush();
+
+	if (layoutMap) {
+		*layoutMap = native->layoutMap();
+	}
+
+	return keptPreviousLayout;
+}
@@ -0,0 +1,114 @@
+#ifndef FAT_IMAGE_BUILDER_H
+#define FAT_IMAGE_BUILDER_H
+
+#include "FATFilesystemLayout.h"
+#include "FATLayoutMap.h"
+#include "FATVolumeGeometry.h"
+#include "FilesystemTree.h"
+
+#include <stdint.h>
+
+#include <memory>
+#include <optional>
+
+class IBlockDevice;
+
+/*
+ * Turns a tree into a FAT volume on a block device, which is what the
+ * fatbuilder command does between reading its manifest and writing its
+ * files: the volume is planned for the tree on construction, and written
+ * to whatever device is given to build().
+ */
+class FATImageBuilder {
+public:
+	enum class Writer {
+		/*
+		 * Lays the volume out itself, in a single pass over the tree.
+		 */
+		Native,
+
+		/*
+		 * Formats and fills the volume through fatfs.
+		 */
+		Fatfs
+	};
+
+	enum class LayoutPolicy {
+		/*
+		 * The cluster size and FAT type f_mkfs would pick for the size.
+		 */
+		Mkfs,
+
+		/*
+		 * The smallest image.
+		 */
+		Size,
+
+		/*
+		 * The fewest metadata sectors.
+		 */
+		Metadata
+	};
+
+	struct Options {
+		Writer writer = Writer::Native;
+		LayoutPolicy layoutPolicy = LayoutPolicy::Mkfs;
+		FATFilesystemLayout bootCode;
+
+		/*
+		 * Free space the volume is planned with beyond what the tree takes.
+		 */
+		uint64_t additionalFreeSpace = 1024 * 1024;
+
+		/*
+		 * The volume is aligned to the allocation unit of the device it
+		 * goes to.
+		 */
+		unsigned int allocationUnit = 512;
+
+		/*
+		 * Layout map of an earlier image of the tree, whose cluster size and
+		 * FAT type are kept, and whose files keep their clusters where they
+		 * can. Native writer only.
+		 */
+		const FATLayoutMap* previousLayout = nullptr;
+	};
+
+	/*
+	 * Plans the volume for tree, whose inputs must have been examined with
+	 * statInputs(). The tree is built from in build(), and has to stay
+	 * around until then.
+	 */
+	FATImageBuilder(FilesystemTree& tree, const Options& options);
+
+	FATImageBuilder(const FATImageBuilder& other) = delete;
+	FATImageBuilder &operator =(const FATImageBuilder& other) = delete;
+
+	/*
+	 * Size of the image; the device given to build() must be this large.
+	 */
+	inline uint64_t mediaSize() const {
+		return m_mediaSize;
+	}
+
+	inline const FATVolumeParameters& parameters() const {
+		return m_parameters;
+	}
+
+	/*
+	 * Formats the volume on device, writes the tree into it and flushes
+	 * it. With the native writer, stores the layout of the volume into
+	 * layoutMap when given. Returns false when the previous layout could
+	 * not be kept, and everything was placed anew.
+	 */
+	bool build(std::unique_ptr<IBlockDevice>&& device, const FilesystemBuildOptions& buildOptions = FilesystemBuildOptions(), FATLayoutMap* layoutMap = nullptr);
+
+private:
+	FilesystemTree& m_tree;
+	Options m_options;
+	std::optional<FATLayoutMap> m_previousLayout;
+	FATVolumeParameters m_parameters;
+	uint64_t m_mediaSize;
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include "FATLayoutMap.h"
+#include "TextRecords.h"
+
+#include <fstream>
+#include <stdexcept>
+
+static const char LayoutMapSignature[] = "fatbuilder-layout 1";
+
+static bool parseRuns(const std::string& field, std::vector<std::pair<uint32_t, uint32_t>>& runs) {
+	runs.clear();
+
+	if (field.empty())
+		return true;
+
+	size_t position = 0;
+
+	while (true) {
+		auto comma = field.find(',', position);
+		auto run = field.substr(position, comma - position);
+
+		auto plus = run.find('+');
+		if (plus == std::string::npos)
+			return false;
+
+		std::pair<uint32_t, uint32_t> parsed;
+		if (!parseRecordNumber(run.substr(0, plus), parsed.first) || !parseRecordNumber(run.substr(plus + 1), parsed.second) || parsed.second == 0)
+			return false;
+
+		runs.push_back(parsed);
+
+		if (comma == std::string::npos)
+			return true;
+
+		position = comma + 1;
+	}
+}
+
+FATLayoutMap FATLayoutMap::load(const std::filesystem::path& path) {
+	std::ifstream stream;
+	stream.exceptions(std::ios::failbit | std::ios::eofbit | std::ios::badbit);
+	stream.open(path, std::ios::in | std::ios::binary);
+	stream.exceptions(std::ios::badbit);
+
+	auto fail = [&path]() {
+		throw std::runtime_error("malformed layout map: " + path.u8string());
+	};
+
+	std::string line;
+	if (!std::getline(stream, line) || line != LayoutMapSignature)
+		fail();
+
+	FATLayoutMap map;
+	std::vector<std::string> fields;
+	bool haveVolume = false;
+
+	while (std::getline(stream, line)) {
+		if (!splitRecordFields(line, fields))
+			fail();
+
+		const auto& kind = fields.front();
+
+		if (kind == "volume" && fields.size() == 6) {
+			if (fields[2] == "fat")
+				map.parameters.types = FATVolumeParameters::Types::FAT;
+			else if (fields[2] == "fat32")
+				map.parameters.types = FATVolumeParameters::Types::FAT32;
+			else
+				fail();
+
+			if (!parseRecordNumber(fields[1], map.mediaSize) ||
+				!parseRecordNumber(fields[3], map.parameters.fatCount) ||
+				!parseRecordNumber(fields[4], map.parameters.rootEntries) ||
+				!parseRecordNumber(fields[5], map.parameters.clusterSize))
+				fail();
+
+			haveVolume = true;
+		}
+		else if ((kind == "directory" || kind == "file") && fields.size() == 4) {
+			Entry entry;
+			entry.directory = kind == "directory";
+
+			if (!parseRecordNumber(fields[1], entry.order) || !parseRuns(fields[2], entry.runs))
+				fail();
+
+			map.entries.emplace_hint(map.entries.end(), fields[3], std::move(entry));
+		}
+		else {
+			fail();
+		}
+	}
+
+	if (!haveVolume)
+		fail();
+
+	return map;
+}
+
+void FATLayoutMap::retain(const std::function<bool(const std::string& path, bool directory)>& keep) {
+	for (auto entry = entries.begin(); entry != entries.end(); ) {
+		if (entry->first == "/" || keep(entry->first, entry->second.directory))
+			++entry;
+		else
+			entry = entries.erase(entry);
+	}
+}
+
+void FATLayoutMap::save(const std::filesystem::path& path) const {
+	std::ofstream stream;
+	stream.exceptions(std::ios::failbit | std::ios::badbit);
+	stream.open(path, std::ios::out | std::ios::trunc | std::ios::binary);
+
+	stream << LayoutMapSignature << '\n';
+	stream << "volume\t" << mediaSize << '\t' << (parameters.types == FATVolumeParameters::Types::FAT32 ? "fat32" : "fat") << '\t' <<
+		parameters.fatCount << '\t' << parameters.rootEntries << '\t' << parameters.clusterSize << '\n';
+
+	for (const auto& entry : entries) {
+		stream << (entry.second.directory ? "directory" : "file") << '\t' << entry.second.order << '\t';
+
+		for (size_t index = 0; index < entry.second.runs.size(); index++) {
+			if (index != 0)
+				stream << ',';
+
+			stream << entry.second.runs[index].first << '+' << entry.second.runs[index].second;
+		}
+
+		stream << '\t' << escapeRecordField(entry.first) << '\n';
+	}
+}
@@ -0,0 +1,44 @@
+#ifndef FILESYSTEM_FAT_LAYOUT_MAP_H
+#define FILESYSTEM_FAT_LAYOUT_MAP_H
+
+#include "FATVolumeGeometry.h"
+
+#include <stdint.h>
+
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Where a volume keeps its directories and files: the clusters of each, as
+ * runs of first cluster and count in chain order, and its position among
+ * the entries of its directory. Paths are the ones the tree passes to the
+ * filesystem, with "/" for the root directory. The media size and the
+ * format parameters give the same volume again.
+ */
+struct FATLayoutMap {
+	struct Entry {
+		bool directory = false;
+		uint32_t order = 0;
+		std::vector<std::pair<uint32_t, uint32_t>> runs;
+	};
+
+	uint64_t mediaSize = 0;
+	FATVolumeParameters parameters;
+	std::map<std::string, Entry> entries;
+
+	static FATLayoutMap load(const std::filesystem::path& path);
+
+	/*
+	 * Drops the directories and files keep rejects; the root directory
+	 * stays.
+	 */
+	void retain(const std::function<bool(const std::string& path, bool directory)>& keep);
+
+	void save(const std::filesystem::path& path) const;
+};
+
+#endif
@@ -0,0 +1,284 @@
+#include "FATNames.h"
+
+#include <stdexcept>
+#include <string.h>
+
+#include <ff.h>
+
+static_assert(FF_CODE_PAGE == 437, "short names are generated for code page 437 only");
+
+/*
+ * Upper case conversion of the extended characters of code page 437, as
+ * used by fatfs for short names.
+ */
+static const unsigned char cp437UpperCase[128] = {
+	0x80, 0x9A, 0x45, 0x41, 0x8E, 0x41, 0x8F, 0x80, 0x45, 0x45, 0x45, 0x49, 0x49, 0x49, 0x8E, 0x8F,
+	0x90, 0x92, 0x92, 0x4F, 0x99, 0x4F, 0x55, 0x55, 0x59, 0x99, 0x9A, 0x9B, 0x9C, 0x9D, 0x9E, 0x9F,
+	0x41, 0x49, 0x4F, 0x55, 0xA5, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xAB, 0xAC, 0xAD, 0xAE, 0xAF,
+	0xB0, 0xB1, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xBB, 0xBC, 0xBD, 0xBE, 0xBF,
+	0xC0, 0xC1, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xCB, 0xCC, 0xCD, 0xCE, 0xCF,
+	0xD0, 0xD1, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xDB, 0xDC, 0xDD, 0xDE, 0xDF,
+	0xE0, 0xE1, 0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xEB, 0xEC, 0xED, 0xEE, 0xEF,
+	0xF0, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA, 0xFB, 0xFC, 0xFD, 0xFE, 0xFF
+};
+
+static std::u16string toUtf16(const FatfsString& string) {
+#if defined(_WIN32)
+	return std::u16string(string.begin(), string.end());
+#else
+	std::u16string result;
+
+	for (size_t index = 0; index < string.size(); ) {
+		uint32_t codePoint = static_cast<unsigned char>(string[index++]);
+		size_t trailing;
+		uint32_t minimum;
+
+		if (codePoint < 0x80) {
+			trailing = 0;
+			minimum = 0;
+		}
+		else if ((codePoint & 0xE0) == 0xC0) {
+			codePoint &= 0x1F;
+			trailing = 1;
+			minimum = 0x80;
+		}
+		else if ((codePoint & 0xF0) == 0xE0) {
+			codePoint &= 0x0F;
+			trailing = 2;
+			minimum = 0x800;
+		}
+		else if ((codePoint & 0xF8) == 0xF0) {
+			codePoint &= 0x07;
+			trailing = 3;
+			minimum = 0x10000;
+		}
+		else {
+			throw std::runtime_error("invalid UTF-8 in file name");
+		}
+
+		for (; trailing != 0; trailing--) {
+			if (index == string.size() || (static_cast<unsigned char>(string[index]) & 0xC0) != 0x80)
+				throw std::runtime_error("invalid UTF-8 in file name");
+
+			codePoint = codePoint << 6 | (static_cast<unsigned char>(string[index++]) & 0x3F);
+		}
+
+		if (codePoint < minimum || codePoint > 0x10FFFF || (codePoint >= 0xD800 && codePoint < 0xE000))
+			throw std::runtime_error("invalid UTF-8 in file name");
+
+		if (codePoint >= 0x10000) {
+			codePoint -= 0x10000;
+			result.push_back(static_cast<char16_t>(0xD800 | (codePoint >> 10)));
+			result.push_back(static_cast<char16_t>(0xDC00 | (codePoint & 0x3FF)));
+		}
+		else {
+			result.push_back(static_cast<char16_t>(codePoint));
+		}
+	}
+
+	return result;
+#endif
+}
+
+std::vector<std::u16string> splitFATPath(const FatfsString& path) {
+	auto unicodePath = toUtf16(path);
+	std::vector<std::u16string> names;
+
+	size_t position = 0;
+	while (position < unicodePath.size()) {
+		auto end = unicodePath.find_first_of(u"/\\", position);
+		if (end == std::u16string::npos)
+			end = unicodePath.size();
+
+		if (end != position) {
+			auto name = unicodePath.substr(position, end - position);
+
+			if (name.size() > FF_MAX_LFN)
+				throw std::runtime_error("file name is too long");
+
+			for (auto character : name) {
+				if (character < u' ' || (character < 0x80 && std::char_traits<char16_t>::find(u"\"*:<>?|\x7F", 8, character)))
+					throw std::runtime_error("invalid character in file name");
+			}
+
+			while (!name.empty() && (name.back() == u' ' || name.back() == u'.'))
+				name.pop_back();
+
+			if (name.empty())
+				throw std::runtime_error("invalid file name");
+
+			names.push_back(std::move(name));
+		}
+
+		position = end + 1;
+	}
+
+	return names;
+}
+
+std::u16string foldFATName(const std::u16string& name) {
+	std::u16string folded(name);
+
+	for (auto& character : folded)
+		character = static_cast<char16_t>(ff_wtoupper(character));
+
+	return folded;
+}
+
+void makeFATShortName(const std::u16string& name, unsigned char* shortName, unsigned char& flags) {
+	memset(shortName, ' ', 11);
+	flags = 0;
+
+	size_t next = 0;
+	while (name[next] == u' ')
+		next++;
+
+	if (next > 0 || name[next] == u'.')
+		flags |= FATNameLossy | FATNameNeedsLong;
+
+	/*
+	 * extensionStart is one past the last dot, 0 without a dot.
+	 */
+	auto extensionStart = name.size();
+	while (extensionStart > 0 && name[extensionStart - 1] != u'.')
+		extensionStart--;
+
+	size_t index = 0;
+	size_t fieldEnd = 8;
+	unsigned int caseBits = 0;
+
+	while (next < name.size()) {
+		uint32_t character = name[next++];
+
+		if (character == u' ' || (character == u'.' && next != extensionStart)) {
+			flags |= FATNameLossy | FATNameNeedsLong;
+			continue;
+		}
+
+		if (index >= fieldEnd || next == extensionStart) {
+			if (fieldEnd == 11) {
+				flags |= FATNameLossy | FATNameNeedsLong;
+				break;
+			}
+
+			if (next != extensionStart)
+				flags |= FATNameLossy | FATNameNeedsLong;
+
+			if (next > extensionStart)
+				break;
+
+			next = extensionStart;
+			index = 8;
+			fieldEnd = 11;
+			caseBits <<= 2;
+			continue;
+		}
+
+		if (character >= 0x80) {
+			flags |= FATNameNeedsLong;
+
+			character = ff_uni2oem(character, FF_CODE_PAGE);
+			if (character & 0x80)
+				character = cp437UpperCase[character & 0x7F];
+		}
+
+		if (character == 0 || strchr("+,;=[]", static_cast<int>(character))) {
+			character = '_';
+			flags |= FATNameLossy | FATNameNeedsLong;
+		}
+		else if (character >= 'A' && character <= 'Z') {
+			caseBits |= 2;
+		}
+		else if (character >= 'a' && character <= 'z') {
+			caseBits |= 1;
+			character -= 0x20;
+		}
+
+		shortName[index++] = static_cast<unsigned char>(character);
+	}
+
+	if (shortName[0] == 0xE5)
+		shortName[0] = 0x05;
+
+	if (fieldEnd == 8)
+		caseBits <<= 2;
+
+	if ((caseBits & 0x0C) == 0x0C || (caseBits & 0x03) == 0x03)
+		flags |= FATNameNeedsLong;
+
+	if (!(flags & FATNameNeedsLong)) {
+		if (caseBits & 0x01)
+			flags |= FATNameLowerExtension;
+
+		if (caseBits & 0x04)
+			flags |= FATNameLowerBody;
+	}
+}
+
+void numberFATShortName(unsigned char* destination, const unsigned char* source, const std::u16string& longName, unsigned int sequence) {
+	memcpy(destination, source, 11);
+
+	if (sequence > 5) {
+		uint32_t hash = sequence;
+
+		for (auto character : longName) {
+			uint32_t bits = character;
+
+			for (int bit = 0; bit < 16; bit++) {
+				hash = (hash << 1) + (bits & 1);
+				bits >>= 1;
+
+				if (hash & 0x10000)
+					hash ^= 0x11021;
+			}
+		}
+
+		sequence = hash;
+	}
+
+	/*
+	 * At most seven digits, as gen_numname() has it, leaving the first
+	 * place for the tilde.
+	 */
+	unsigned char digits[8];
+	unsigned int position = 7;
+
+	do {
+		auto digit = static_cast<unsigned char>(sequence % 16 + '0');
+		if (digit > '9')
+			digit += 7;
+
+		digits[position--] = digit;
+		sequence /= 16;
+	} while (position > 0 && sequence != 0);
+
+	digits[position] = '~';
+
+	unsigned int index = 0;
+	while (index < position && destination[index] != ' ')
+		index++;
+
+	do {
+		destination[index++] = position < 8 ? digits[position++] : ' ';
+	} while (index < 8);
+}
+
+unsigned char fatShortNameChecksum(const unsigned char* shortName) {
+	unsigned char sum = 0;
+
+	for (size_t index = 0; index < 11; index++)
+		sum = static_cast<unsigned char>((sum >> 1) + (sum << 7) + shortName[index]);
+
+	return sum;
+}
+
+unsigned int fatNameEntryCount(const std::u16string& name) {
+	unsigned char shortName[11];
+	unsigned char flags;
+	makeFATShortName(name, shortName, flags);
+
+	if (!(flags & FATNameNeedsLong))
+		return 1;
+
+	return static_cast<unsigned int>(1 + (name.size() + 12) / 13);
+}
@@ -0,0 +1,47 @@
+#ifndef FILESYSTEM_FAT_NAMES_H
+#define FILESYSTEM_FAT_NAMES_H
+
+#include "StringUtils.h"
+
+#include <string>
+#include <vector>
+
+/*
+ * Short name flags, with the same meaning as the NS_* flags of fatfs.
+ */
+static constexpr unsigned char FATNameLossy = 0x01;
+static constexpr unsigned char FATNameNeedsLong = 0x02;
+static constexpr unsigned char FATNameLowerBody = 0x08;
+static constexpr unsigned char FATNameLowerExtension = 0x10;
+
+
+/*
+ * Splits a path into names, validated and trimmed the way fatfs does it.
+ */
+std::vector<std::u16string> splitFATPath(const FatfsString& path);
+
+/*
+ * Upper-cases a long name for case-insensitive comparisons.
+ */
+std::u16string foldFATName(const std::u16string& name);
+
+/*
+ * Port of the short name generation in create_name() of fatfs.
+ */
+void makeFATShortName(const std::u16string& name, unsigned char* shortName, unsigned char& flags);
+
+/*
+ * Port of gen_numname() of fatfs: appends ~sequence to the body, or a hash
+ * of the long name once the first few sequence numbers collided.
+ */
+void numberFATShortName(unsigned char* destination, const unsigned char* source, const std::u16string& longName, unsigned int sequence);
+
+unsigned char fatShortNameChecksum(const unsigned char* shortName);
+
+/*
+ * Number of directory entries taken by a name: the short name entry, and
+ * the long name entries where the name needs them.
+ */
+unsigned int fatNameEntryCount(const std::u16string& name);
+
+#endif
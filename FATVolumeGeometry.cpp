@@ -0,0 +1,467 @@
+#include "FATVolumeGeometry.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string.h>
+
+static constexpr uint32_t SectorsPerTrack = 63;
+static constexpr uint32_t MaxFAT12Clusters = 0xFF5;
+static constexpr uint32_t MaxFAT16Clusters = 0xFFF5;
+static constexpr uint32_t MaxFAT32Clusters = 0x0FFFFFF5;
+
+/*
+ * Volume size steps at which the automatic cluster size doubles, in units
+ * of 4K sectors for FAT12/16 and of 128K sectors for FAT32.
+ */
+static const uint32_t fatSteps[] = { 1, 4, 16, 64, 256, 512, 0 };
+static const uint32_t fat32Steps[] = { 1, 2, 4, 8, 16, 32, 0 };
+
+static void storeWord(unsigned char* destination, uint16_t value) {
+	destination[0] = static_cast<unsigned char>(value);
+	destination[1] = static_cast<unsigned char>(value >> 8);
+}
+
+static void storeDword(unsigned char* destination, uint32_t value) {
+	storeWord(destination, static_cast<uint16_t>(value));
+	storeWord(destination + 2, static_cast<uint16_t>(value >> 16));
+}
+
+FATVolumeGeometry FATVolumeGeometry::plan(uint64_t mediaSize, unsigned int allocationUnit, const FATVolumeParameters& parameters) {
+	static constexpr uint32_t DefaultRootEntries = 512;
+
+	if (mediaSize / SectorSize > UINT32_MAX)
+		throw std::runtime_error("the image is too large for a FAT volume");
+
+	FATVolumeGeometry geometry;
+	geometry.mediaSectors = static_cast<uint32_t>(mediaSize / SectorSize);
+	geometry.fatCount = parameters.fatCount >= 1 && parameters.fatCount <= 2 ? parameters.fatCount : 1;
+
+	auto requestedRootEntries = parameters.rootEntries;
+	if (requestedRootEntries < 1 || requestedRootEntries > 32768 || requestedRootEntries % (SectorSize / EntrySize) != 0)
+		requestedRootEntries = DefaultRootEntries;
+
+	uint32_t alignment = allocationUnit / SectorSize;
+	if (alignment == 0 || alignment > 0x8000 || (alignment & (alignment - 1)) != 0)
+		alignment = 1;
+
+	auto clusterSize = parameters.clusterSize;
+	uint32_t requestedClusterSectors = 0;
+	if (clusterSize <= 0x1000000 && (clusterSize & (clusterSize - 1)) == 0)
+		requestedClusterSectors = std::min<uint32_t>(clusterSize / SectorSize, 128);
+
+	geometry.volumeStart = 0;
+	geometry.volumeSectors = geometry.mediaSectors;
+	if (geometry.volumeSectors > SectorsPerTrack) {
+		geometry.volumeStart = SectorsPerTrack;
+		geometry.volumeSectors -= SectorsPerTrack;
+	}
+
+	if (geometry.volumeSectors < 128)
+		throw std::runtime_error("the image is too small for a FAT volume");
+
+	auto volumeSectors = geometry.volumeSectors;
+	auto type = parameters.types == FATVolumeParameters::Types::FAT32 ? Type::FAT32 : Type::FAT16;
+
+	while (true) {
+		auto clusterSectors = requestedClusterSectors;
+		uint32_t clusterCount, fatSectors, reservedSectors, rootSectors, rootEntries;
+
+		if (type == Type::FAT32) {
+			if (clusterSectors == 0) {
+				clusterSectors = 1;
+				for (size_t index = 0; fat32Steps[index] != 0 && fat32Steps[index] <= volumeSectors / 0x20000; index++)
+					clusterSectors <<= 1;
+			}
+
+			clusterCount = volumeSectors / clusterSectors;
+			fatSectors = (clusterCount * 4 + 8 + SectorSize - 1) / SectorSize;
+			reservedSectors = 32;
+			rootEntries = 0;
+			rootSectors = 0;
+
+			if (clusterCount <= MaxFAT16Clusters || clusterCount > MaxFAT32Clusters)
+				throw std::runtime_error("no valid FAT32 cluster size for the image");
+		}
+		else {
+			if (clusterSectors == 0) {
+				clusterSectors = 1;
+				for (size_t index = 0; fatSteps[index] != 0 && fatSteps[index] <= volumeSectors / 0x1000; index++)
+					clusterSectors <<= 1;
+			}
+
+			clusterCount = volumeSectors / clusterSectors;
+
+			uint32_t fatBytes;
+			if (clusterCount > MaxFAT12Clusters) {
+				fatBytes = clusterCount * 2 + 4;
+			}
+			else {
+				type = Type::FAT12;
+				fatBytes = (clusterCount * 3 + 1) / 2 + 3;
+			}
+
+			fatSectors = (fatBytes + SectorSize - 1) / SectorSize;
+			reservedSectors = 1;
+			rootEntries = requestedRootEntries;
+			rootSectors = rootEntries * EntrySize / SectorSize;
+		}
+
+		auto dataStart = geometry.volumeStart + reservedSectors + fatSectors * geometry.fatCount + rootSectors;
+
+		/*
+		 * Align the data area: FAT32 moves the FATs, FAT12/16 grows them.
+		 */
+		auto padding = ((dataStart + alignment - 1) & ~(alignment - 1)) - dataStart;
+		if (type == Type::FAT32) {
+			reservedSectors += padding;
+		}
+		else {
+			if (padding % geometry.fatCount != 0) {
+				padding--;
+				reservedSectors++;
+			}
+
+			fatSectors += padding / geometry.fatCount;
+		}
+
+		if (volumeSectors < dataStart + clusterSectors * 16 - geometry.volumeStart)
+			throw std::runtime_error("the image is too small for a FAT volume");
+
+		clusterCount = (volumeSectors - reservedSectors - fatSectors * geometry.fatCount - rootSectors) / clusterSectors;
+
+		if (type == Type::FAT32 && clusterCount <= MaxFAT16Clusters) {
+			if (requestedClusterSectors == 0 && (requestedClusterSectors = clusterSectors / 2) != 0)
+				continue;
+
+			throw std::runtime_error("no valid FAT32 cluster size for the image");
+		}
+
+		if (type == Type::FAT16) {
+			if (clusterCount > MaxFAT16Clusters) {
+				if (requestedClusterSectors == 0 && clusterSectors * 2 <= 64) {
+					requestedClusterSectors = clusterSectors * 2;
+					continue;
+				}
+
+				if (parameters.types != FATVolumeParameters::Types::FAT) {
+					type = Type::FAT32;
+					continue;
+				}
+
+				if (requestedClusterSectors == 0 && (requestedClusterSectors = clusterSectors * 2) <= 128)
+					continue;
+
+				throw std::runtime_error("no valid FAT16 cluster size for the image");
+			}
+
+			if (clusterCount <= MaxFAT12Clusters) {
+				if (requestedClusterSectors == 0 && (requestedClusterSectors = clusterSectors * 2) <= 128)
+					continue;
+
+				throw std::runtime_error("no valid FAT16 cluster size for the image");
+			}
+		}
+
+		if (type == Type::FAT12 && clusterCount > MaxFAT12Clusters)
+			throw std::runtime_error("no valid FAT12 cluster size for the image");
+
+		geometry.type = type;
+		geometry.reservedSectors = reservedSectors;
+		geometry.fatSectors = fatSectors;
+		geometry.rootEntries = rootEntries;
+		geometry.rootSectors = rootSectors;
+		geometry.sectorsPerCluster = clusterSectors;
+		geometry.clusterCount = clusterCount;
+
+		return geometry;
+	}
+}
+
+FATVolumeGeometry FATVolumeGeometry::planForDevice(uint64_t mediaSize, unsigned int allocationUnit, const FATVolumeParameters& parameters) {
+	auto geometry = plan(mediaSize, allocationUnit, parameters);
+
+	if (parameters.clusterSize == 0 && allocationUnit > SectorSize && geometry.clusterSize() < allocationUnit) {
+		auto aligned = parameters;
+		aligned.clusterSize = allocationUnit;
+
+		try {
+			geometry = plan(mediaSize, allocationUnit, aligned);
+		}
+		catch (const std::runtime_error&) {
+
+		}
+	}
+
+	return geometry;
+}
+
+uint64_t FATVolumeGeometry::minimumMediaSize(const FATVolumeContents& contents, unsigned int allocationUnit, const FATVolumeParameters& parameters) {
+	static constexpr uint64_t MaxMediaSectors = UINT32_MAX;
+
+	std::vector<std::pair<uint32_t, uint64_t>> neededByClusterSize;
+
+	auto fits = [&](uint64_t mediaSectors) {
+		FATVolumeGeometry geometry;
+
+		try {
+			geometry = planForDevice(mediaSectors * SectorSize, allocationUnit, parameters);
+		}
+		catch (const std::runtime_error&) {
+			return false;
+		}
+
+		auto fat32 = geometry.type == Type::FAT32;
+		if (!fat32 && contents.rootEntries > geometry.rootEntries)
+			return false;
+
+		auto key = geometry.clusterSize() | (fat32 ? 1u : 0u);
+		auto cached = std::find_if(neededByClusterSize.begin(), neededByClusterSize.end(), [key](const auto& entry) { return entry.first == key; });
+		if (cached == neededByClusterSize.end())
+			cached = neededByClusterSize.insert(neededByClusterSize.end(), { key, contents.clustersNeeded(geometry.clusterSize(), fat32) });
+
+		return cached->second <= geometry.clusterCount;
+	};
+
+	/*
+	 * Within a range of volume sizes that keeps the automatic cluster size,
+	 * a larger volume has at least as many clusters, so the smallest fitting
+	 * size of each range is found by bisection; the first range that fits at
+	 * all has the answer. Crossing into the next range doubles the clusters,
+	 * which may need fewer of them but also has fewer.
+	 */
+	std::vector<uint64_t> boundaries{ SectorsPerTrack + 128, MaxMediaSectors + 1 };
+	for (size_t index = 0; fatSteps[index] != 0; index++)
+		boundaries.push_back(SectorsPerTrack + fatSteps[index] * 0x1000ull);
+	for (size_t index = 0; fat32Steps[index] != 0; index++)
+		boundaries.push_back(SectorsPerTrack + fat32Steps[index] * 0x20000ull);
+
+	/*
+	 * A fixed cluster size does not double, but moves to FAT16 at these
+	 * sizes, leaving a gap of invalid volumes above the FAT12 ones, and has
+	 * no valid FAT16 volumes above the FAT16 limit.
+	 */
+	for (uint32_t clusterSectors = 1; clusterSectors <= 128; clusterSectors *= 2) {
+		boundaries.push_back(SectorsPerTrack + (MaxFAT12Clusters + 1ull) * clusterSectors);
+		boundaries.push_back(SectorsPerTrack + (MaxFAT16Clusters + 1ull) * clusterSectors);
+	}
+
+	std::sort(boundaries.begin(), boundaries.end());
+	boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+
+	for (size_t index = 0; index + 1 < boundaries.size(); index++) {
+		auto low = boundaries[index];
+		auto high = boundaries[index + 1] - 1;
+
+		if (!fits(high))
+			continue;
+
+		while (low < high) {
+			auto middle = low + (high - low) / 2;
+
+			if (fits(middle))
+				high = middle;
+			else
+				low = middle + 1;
+		}
+
+		return high * SectorSize;
+	}
+
+	throw std::runtime_error("the contents do not fit into a FAT volume");
+}
+
+FATVolumeParameters FATVolumeGeometry::optimize(const FATVolumeContents& contents, unsigned int allocationUnit, Objective objective) {
+	static constexpr uint32_t EntriesPerSector = SectorSize / EntrySize;
+	static constexpr uint32_t MaxRootEntries = 32768;
+	static constexpr unsigned int MaxClusterSize = 128 * SectorSize;
+
+	/*
+	 * Clusters smaller than the allocation unit would leave the files out
+	 * of line with it, as planForDevice() avoids, so they are only
+	 * considered when no larger cluster gives a volume.
+	 */
+	unsigned int alignedClusterSize = SectorSize;
+	while (alignedClusterSize < allocationUnit && alignedClusterSize < MaxClusterSize)
+		alignedClusterSize *= 2;
+
+	FATVolumeParameters best;
+	uint64_t bestCost = UINT64_MAX;
+	uint64_t bestSize = UINT64_MAX;
+
+	for (auto smallestClusterSize : { alignedClusterSize, static_cast<unsigned int>(SectorSize) }) {
+		for (auto types : { FATVolumeParameters::Types::FAT, FATVolumeParameters::Types::FAT32 }) {
+			if (types == FATVolumeParameters::Types::FAT && contents.rootEntries > MaxRootEntries)
+				continue;
+
+			for (unsigned int clusterSize = smallestClusterSize; clusterSize <= MaxClusterSize; clusterSize *= 2) {
+				FATVolumeParameters candidate;
+				candidate.types = types;
+				candidate.fatCount = 1;
+				candidate.clusterSize = clusterSize;
+
+				if (types == FATVolumeParameters::Types::FAT)
+					candidate.rootEntries = std::max((contents.rootEntries + EntriesPerSector - 1) / EntriesPerSector, 1u) * EntriesPerSector;
+
+				uint64_t size;
+				try {
+					size = minimumMediaSize(contents, allocationUnit, candidate);
+				}
+				catch (const std::runtime_error&) {
+					continue;
+				}
+
+				uint64_t cost = size;
+				if (objective == Objective::Metadata)
+					cost = planForDevice(size, allocationUnit, candidate).metadataSectors(contents);
+
+				if (cost < bestCost || (cost == bestCost && size < bestSize)) {
+					best = candidate;
+					bestCost = cost;
+					bestSize = size;
+				}
+			}
+		}
+
+		if (bestSize != UINT64_MAX)
+			return best;
+	}
+
+	throw std::runtime_error("the contents do not fit into a FAT volume");
+}
+
+bool FATVolumeGeometry::holds(const FATVolumeContents& contents) const {
+	auto fat32 = type == Type::FAT32;
+	if (!fat32 && contents.rootEntries > rootEntries)
+		return false;
+
+	return contents.clustersNeeded(clusterSize(), fat32) <= clusterCount;
+}
+
+uint64_t FATVolumeGeometry::metadataSectors(const FATVolumeContents& contents) const {
+	auto fat32 = type == Type::FAT32;
+	auto clusters = contents.clustersNeeded(clusterSize(), fat32) - (contents.freeSpace + clusterSize() - 1) / clusterSize();
+
+	uint64_t fatBytes;
+	if (type == Type::FAT12)
+		fatBytes = ((clusters + 2) * 3 + 1) / 2;
+	else if (type == Type::FAT16)
+		fatBytes = (clusters + 2) * 2;
+	else
+		fatBytes = (clusters + 2) * 4;
+
+	return fatCount * ((fatBytes + SectorSize - 1) / SectorSize) + rootSectors + contents.directoryClusters(clusterSize(), fat32) * sectorsPerCluster;
+}
+
+uint64_t FATVolumeContents::clustersNeeded(uint32_t clusterSize, bool rootInDataArea) const {
+	auto clusters = (freeSpace + clusterSize - 1) / clusterSize + directoryClusters(clusterSize, rootInDataArea);
+
+	for (auto size : fileSizes)
+		clusters += (size + clusterSize - 1) / clusterSize;
+
+	return clusters;
+}
+
+uint64_t FATVolumeContents::directoryClusters(uint32_t clusterSize, bool rootInDataArea) const {
+	auto clustersFor = [clusterSize](uint64_t bytes) {
+		return (bytes + clusterSize - 1) / clusterSize;
+	};
+
+	uint64_t clusters = 0;
+
+	/*
+	 * A directory always has a cluster, even when empty.
+	 */
+	for (auto entries : directoryEntries)
+		clusters += std::max<uint64_t>(clustersFor(static_cast<uint64_t>(entries) * FATVolumeGeometry::EntrySize), 1);
+
+	if (rootInDataArea)
+		clusters += std::max<uint64_t>(clustersFor(static_cast<uint64_t>(rootEntries) * FATVolumeGeometry::EntrySize), 1);
+
+	return clusters;
+}
+
+void FATVolumeGeometry::formatMBR(unsigned char* sector) const {
+	/*
+	 * The CHS values are made up from the drive size alone, as fatfs does.
+	 */
+	uint32_t heads = 8;
+	while (heads < 256 && mediaSectors / heads / SectorsPerTrack > 1024)
+		heads *= 2;
+	if (heads >= 256)
+		heads = 255;
+
+	memset(sector, 0, SectorSize);
+
+	unsigned char systemType;
+	if (type == Type::FAT32)
+		systemType = 0x0C;
+	else if (volumeSectors >= 0x10000)
+		systemType = 0x06;
+	else
+		systemType = type == Type::FAT16 ? 0x04 : 0x01;
+
+	auto entry = sector + 446;
+	auto encodeCHS = [heads](unsigned char* destination, uint32_t lba) {
+		auto cylinder = lba / SectorsPerTrack / heads;
+		destination[0] = static_cast<unsigned char>(lba / SectorsPerTrack % heads);
+		destination[1] = static_cast<unsigned char>((cylinder >> 2 & 0xC0) | (lba % SectorsPerTrack + 1));
+		destination[2] = static_cast<unsigned char>(cylinder);
+	};
+
+	encodeCHS(entry + 1, volumeStart);
+	entry[4] = systemType;
+	encodeCHS(entry + 5, volumeStart + volumeSectors - 1);
+	storeDword(entry + 8, volumeStart);
+	storeDword(entry + 12, volumeSectors);
+
+	storeWord(sector + 510, 0xAA55);
+}
+
+void FATVolumeGeometry::formatBootSector(unsigned char* sector, uint32_t serial, uint32_t rootCluster) const {
+	memset(sector, 0, SectorSize);
+	memcpy(sector, "\xEB\xFE\x90" "MSDOS5.0", 11);
+	storeWord(sector + 11, SectorSize);
+	sector[13] = static_cast<unsigned char>(sectorsPerCluster);
+	storeWord(sector + 14, static_cast<uint16_t>(reservedSectors));
+	sector[16] = static_cast<unsigned char>(fatCount);
+	storeWord(sector + 17, static_cast<uint16_t>(rootEntries));
+
+	if (volumeSectors < 0x10000)
+		storeWord(sector + 19, static_cast<uint16_t>(volumeSectors));
+	else
+		storeDword(sector + 32, volumeSectors);
+
+	sector[21] = 0xF8;
+	storeWord(sector + 24, 63);
+	storeWord(sector + 26, 255);
+	storeDword(sector + 28, volumeStart);
+
+	if (type == Type::FAT32) {
+		storeDword(sector + 67, serial);
+		storeDword(sector + 36, fatSectors);
+		storeDword(sector + 44, rootCluster);
+		storeWord(sector + 48, 1);
+		storeWord(sector + 50, 6);
+		sector[64] = 0x80;
+		sector[66] = 0x29;
+		memcpy(sector + 71, "NO NAME    " "FAT32   ", 19);
+	}
+	else {
+		storeDword(sector + 39, serial);
+		storeWord(sector + 22, static_cast<uint16_t>(fatSectors));
+		sector[36] = 0x80;
+		sector[38] = 0x29;
+		memcpy(sector + 43, "NO NAME    " "FAT     ", 19);
+	}
+
+	storeWord(sector + 510, 0xAA55);
+}
+
+void FATVolumeGeometry::formatFSInfo(unsigned char* sector, uint32_t freeClusters, uint32_t lastAllocated) const {
+	memset(sector, 0, SectorSize);
+	storeDword(sector + 0, 0x41615252);
+	storeDword(sector + 484, 0x61417272);
+	storeDword(sector + 488, freeClusters);
+	storeDword(sector + 492, lastAllocated);
+	storeWord(sector + 510, 0xAA55);
+}
@@ -0,0 +1,139 @@
+#ifndef FILESYSTEM_FAT_VOLUME_GEOMETRY_H
+#define FILESYSTEM_FAT_VOLUME_GEOMETRY_H
+
+#include <stdint.h>
+
+#include <vector>
+
+/*
+ * What a volume has to hold, for sizing it: the sizes of the files, the
+ * number of entries in each subdirectory (including the dot entries) and in
+ * the root directory, and the space to be left free, in bytes.
+ */
+struct FATVolumeContents {
+	std::vector<uint64_t> fileSizes;
+	std::vector<uint32_t> directoryEntries;
+	uint32_t rootEntries = 0;
+	uint64_t freeSpace = 0;
+
+	/*
+	 * Clusters taken with clusters of clusterSize bytes; a root directory in
+	 * the data area (as on FAT32) adds its own.
+	 */
+	uint64_t clustersNeeded(uint32_t clusterSize, bool rootInDataArea) const;
+
+	/*
+	 * The part of clustersNeeded() taken by directories.
+	 */
+	uint64_t directoryClusters(uint32_t clusterSize, bool rootInDataArea) const;
+};
+
+/*
+ * Format options, with the meaning of the MKFS_PARM fields of f_mkfs: the
+ * FAT types allowed, the number of FATs, the number of root directory
+ * entries on FAT12/16 and the cluster size in bytes. Values f_mkfs would
+ * not accept, such as the zeroes of the defaults, select its own choices.
+ */
+struct FATVolumeParameters {
+	enum class Types {
+		Any,
+		FAT,
+		FAT32
+	};
+
+	Types types = Types::Any;
+	unsigned int fatCount = 0;
+	unsigned int rootEntries = 0;
+	unsigned int clusterSize = 0;
+};
+
+/*
+ * Placement of a FAT volume in a single MBR partition. plan() makes the same
+ * choices as f_mkfs with the same options, so a volume composed from a
+ * geometry matches one formatted by fatfs on the same device.
+ */
+struct FATVolumeGeometry {
+	enum class Type {
+		FAT12,
+		FAT16,
+		FAT32
+	};
+
+	/*
+	 * What optimize() minimizes: the size of the image, or the sectors of
+	 * FATs and directories written into it.
+	 */
+	enum class Objective {
+		Size,
+		Metadata
+	};
+
+	static constexpr unsigned int SectorSize = 512;
+	static constexpr unsigned int EntrySize = 32;
+
+	Type type;
+	uint32_t mediaSectors;
+	uint32_t volumeStart;
+	uint32_t volumeSectors;
+	uint32_t reservedSectors;
+	uint32_t fatCount;
+	uint32_t fatSectors;
+	uint32_t rootEntries;
+	uint32_t rootSectors;
+	uint32_t sectorsPerCluster;
+	uint32_t clusterCount;
+
+	inline uint32_t fatStart() const { return volumeStart + reservedSectors; }
+	inline uint32_t rootStart() const { return fatStart() + fatCount * fatSectors; }
+	inline uint32_t dataStart() const { return rootStart() + rootSectors; }
+	inline uint32_t clusterSize() const { return sectorsPerCluster * SectorSize; }
+
+	inline uint64_t clusterOffset(uint32_t cluster) const {
+		return (dataStart() + static_cast<uint64_t>(cluster - 2) * sectorsPerCluster) * SectorSize;
+	}
+
+	/*
+	 * mediaSize and allocationUnit are in bytes. Throws if no valid volume
+	 * fits.
+	 */
+	static FATVolumeGeometry plan(uint64_t mediaSize, unsigned int allocationUnit, const FATVolumeParameters& parameters = FATVolumeParameters());
+
+	/*
+	 * The geometry both writers use on a device: as plan(), but when the
+	 * cluster size is left to f_mkfs, with clusters of at least the
+	 * allocation unit where that gives a valid volume, so that every file
+	 * stays aligned to it.
+	 */
+	static FATVolumeGeometry planForDevice(uint64_t mediaSize, unsigned int allocationUnit, const FATVolumeParameters& parameters = FATVolumeParameters());
+
+	/*
+	 * Smallest media size, in bytes, whose planForDevice() volume holds the
+	 * contents. Throws if no FAT volume can hold them.
+	 */
+	static uint64_t minimumMediaSize(const FATVolumeContents& contents, unsigned int allocationUnit, const FATVolumeParameters& parameters = FATVolumeParameters());
+
+	/*
+	 * Parameters giving the volume for the contents with the least of the
+	 * objective, from every cluster size of at least the allocation unit
+	 * and FAT type, one FAT and a root directory just large enough; ties go
+	 * to the smaller image. Smaller clusters are only used when no volume
+	 * has clusters that large.
+	 */
+	static FATVolumeParameters optimize(const FATVolumeContents& contents, unsigned int allocationUnit, Objective objective);
+
+	/*
+	 * Whether the volume has room for the contents.
+	 */
+	bool holds(const FATVolumeContents& contents) const;
+
+	/*
+	 * Sectors of the FATs and of the directories that hold the contents.
+	 */
+	uint64_t metadataSectors(const FATVolumeContents& contents) const;
+
+	void formatMBR(unsigned char* sector) const;
+	void formatBootSector(unsigned char* sector, uint32_t serial, uint32_t rootCluster) const;
+	void formatFSInfo(unsigned char* sector, uint32_t freeClusters, uint32_t lastAllocated) const;
+};
+
+#endif
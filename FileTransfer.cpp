@@ -0,0 +1,118 @@
+#include "FileTransfer.h"
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+
+unsigned int hostBlockSize(int fd) {
+	struct stat information;
+	if (fstat(fd, &information) < 0)
+		throw std::system_error(errno, std::generic_category());
+
+	unsigned int blockSize = 512;
+	while (blockSize < static_cast<unsigned long>(information.st_blksize) && blockSize < 65536)
+		blockSize <<= 1;
+
+	return blockSize;
+}
+
+uint64_t transferFileRange(int sourceFd, uint64_t sourceOffset, int destinationFd, uint64_t destinationOffset, uint64_t size, bool allowSendfile) {
+	uint64_t done = 0;
+
+#if defined(FICLONERANGE)
+	auto blockSize = hostBlockSize(destinationFd);
+	auto clonable = size - size % blockSize;
+
+	if (clonable != 0 && sourceOffset % blockSize == 0 && destinationOffset % blockSize == 0) {
+		file_clone_range range;
+		range.src_fd = sourceFd;
+		range.src_offset = sourceOffset;
+		range.src_length = clonable;
+		range.dest_offset = destinationOffset;
+
+		/*
+		 * Any failure (another filesystem, no reflink support, a source that
+		 * shrank) leaves the range to be copied below.
+		 */
+		if (ioctl(destinationFd, FICLONERANGE, &range) == 0)
+			done = clonable;
+	}
+#endif
+
+#if defined(__linux__)
+	static constexpr uint64_t MaxTransfer = 0x7ffff000;
+
+	bool useCopyFileRange = true;
+	bool positioned = false;
+
+	while (done < size) {
+		auto chunk = static_cast<size_t>(std::min(size - done, MaxTransfer));
+		ssize_t result;
+
+		if (useCopyFileRange) {
+			loff_t in = static_cast<loff_t>(sourceOffset + done);
+			loff_t out = static_cast<loff_t>(destinationOffset + done);
+
+			result = copy_file_range(sourceFd, &in, destinationFd, &out, chunk, 0);
+
+			/*
+			 * Older kernels only copy within one filesystem, and some
+			 * filesystems do not implement it at all.
+			 */
+			if (result < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+				if (!allowSendfile)
+					return done;
+
+				useCopyFileRange = false;
+				continue;
+			}
+		}
+		else {
+			if (!positioned) {
+				if (lseek(destinationFd, static_cast<off_t>(destinationOffset + done), SEEK_SET) < 0)
+					throw std::system_error(errno, std::generic_category());
+
+				positioned = true;
+			}
+
+			off_t in = static_cast<off_t>(sourceOffset + done);
+
+			result = sendfile(destinationFd, sourceFd, &in, chunk);
+
+			if (result < 0 && (errno == EINVAL || errno == ENOSYS))
+				return done;
+		}
+
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+
+			throw std::system_error(errno, std::generic_category());
+		}
+
+		if (result == 0)
+			throw std::runtime_error("source file was truncated while copying");
+
+		done += static_cast<uint64_t>(result);
+	}
+#else
+	(void)sourceFd;
+	(void)sourceOffset;
+	(void)destinationFd;
+	(void)destinationOffset;
+	(void)size;
+	(void)allowSendfile;
+#endif
+
+	return done;
+}
@@ -0,0 +1,28 @@
+#ifndef FILE_TRANSFER_H
+#define FILE_TRANSFER_H
+
+#include <cstdint>
+
+/*
+ * Block size of the filesystem holding the file, as a power of two between
+ * 512 bytes and 64 KiB, for use as the allocation unit of an image.
+ */
+unsigned int hostBlockSize(int fd);
+
+/*
+ * Copies size bytes between two files inside the kernel. Where both offsets
+ * are aligned to the block size of the filesystem and it supports reflinks,
+ * the whole blocks are shared with FICLONERANGE instead of copied. The rest
+ * is copied with copy_file_range where the kernel supports it for this pair
+ * of files, and with sendfile otherwise. Returns the number of bytes copied,
+ * which is less than size only if none of these works for these files; the
+ * caller has to copy the rest itself. Fails if the source ends before size
+ * bytes.
+ *
+ * sendfile writes at the file position of destinationFd, which is moved.
+ * Callers writing to destinationFd from several threads pass false for
+ * allowSendfile, which leaves what copy_file_range cannot do to them.
+ */
+uint64_t transferFileRange(int sourceFd, uint64_t sourceOffset, int destinationFd, uint64_t destinationOffset, uint64_t size, bool allowSendfile = true);
+
+#endif
@@ -1,116 +1,184 @@
 #include "FilesystemTree.h"
-
+#include "IFilesystem.h"
+#include "IFile.h"
+#include "IBlockDevice.h"
+#include "ThreadPool.h"
+#include "FATVolumeGeometry.h"
+#include "BuildState.h"
+#include "FATClock.h"
+#include "CompiledManifest.h"
+#include "ManifestLexer.h"
+#include "MappedFile.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <system_error>
+#endif
+
+#include <deque>
 #include <fstream>
+#include <iterator>
 #include <unordered_map>
 #include <string_view>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <optional>
 
-FilesystemTree::FilesystemTree() : m_root(std::make_shared<Inode>(InodeType::Directory, "", AttributeDefault)) {
+FilesystemTree::FilesystemTree() : m_root(std::make_shared<Inode>(InodeType::Directory, "", AttributeDefault)), m_inputsExamined(false) {
 
 }
 
 FilesystemTree::~FilesystemTree() = default;
 
-void FilesystemTree::parse(const std::filesystem::path & path) {
-	std::ifstream stream;
-	stream.exceptions(std::ios::failbit | std::ios::eofbit | std::ios::badbit);
-	stream.open(path, std::ios::in | std::ios::binary);
-	stream.exceptions(std::ios::badbit);
+/*
+ * A line of a manifest, checked and made into its inode, waiting to go
+ * into the tree.
+ */
+struct FilesystemTree::ParsedLine {
+	size_t number;
+	std::string_view name;
+	std::shared_ptr<Inode> inode;
+};
+
+struct FilesystemTree::ParsedChunk {
+	std::vector<ParsedLine> lines;
+
+	/*
+	 * Names that had quotes or escapes taken out, which the lines point to.
+	 */
+	std::deque<std::string> names;
+
+	/*
+	 * What stopped the chunk, after the lines before it.
+	 */
+	std::exception_ptr error;
+};
+
+void FilesystemTree::parse(const std::filesystem::path & path, ThreadPool* pool) {
+	bool empty = m_root->childCount() == 0;
+
+	/*
+	 * The manifest is examined before it is read, so that a compiled copy
+	 * never records a manifest older than what it was compiled from.
+	 */
+	std::optional<SourceInformation> information;
+	std::filesystem::path compiledPath;
+
+	if (empty) {
+		try {
+			information = examineFile(path, std::filesystem::current_path());
+		}
+		catch (const std::filesystem::filesystem_error&) {
+		}
+	}
 
-	parse(stream);
-}
+	if (information && information->size >= CompiledCacheThreshold) {
+		compiledPath = path;
+		compiledPath += ".compiled";
 
-void FilesystemTree::parse(std::istream& stream) {
-	enum {
-		Normal,
-		String,
-		Escaped,
-		Comment
-	} lexerState = Normal;
-	std::vector<std::string> tokens;
-	std::string tokenBuffer;
+		try {
+			MappedFile compiled(compiledPath);
 
-	char character;
-	bool tokenBufferActive = false;
+			auto root = CompiledManifest::load(compiled.text(), &*information);
+			if (root) {
+				m_root = std::move(root);
+				m_inputsExamined = false;
+				return;
+			}
+		}
+		catch (const std::exception&) {
+		}
+	}
+	else {
+		information.reset();
+	}
 
-	while (true) {
-		stream.get(character);
+	MappedFile manifest(path);
 
-		if (stream.fail())
-			break;
+	if (CompiledManifest::identify(manifest.text())) {
+		if (!empty)
+			throw std::logic_error("compiled manifests only load into an empty tree");
 
-		switch (lexerState) {
-		case Normal:
-			if (character == '"') {
-				tokenBufferActive = true;
-				lexerState = String;
-			}
-			else if (character == ';') {
-				lexerState = Comment;
-			}
-			else if (isspace((unsigned char)character)) {
-				if (tokenBufferActive) {
-					tokens.push_back(tokenBuffer);
-					tokenBuffer.clear();
-					tokenBufferActive = false;
-				}
+		m_root = CompiledManifest::load(manifest.text());
+		m_inputsExamined = false;
+		return;
+	}
 
-				if (character == '\n' && tokens.size() != 0) {
-					processLine(tokens);
-					tokens.clear();
-				}
-			}
-			else {
-				tokenBuffer.push_back(character);
-				tokenBufferActive = true;
-			}
+	parseText(manifest.text(), pool);
 
-			break;
+	/*
+	 * Not being able to keep the compiled copy only costs the next parse
+	 * its time.
+	 */
+	if (information) {
+		try {
+			compile(compiledPath, *information);
+		}
+		catch (const std::exception&) {
+		}
+	}
+}
 
-		case String:
-			if (character == '\\')
-				lexerState = Escaped;
-			else if (character == '"')
-				lexerState = Normal;
-			else
-				tokenBuffer.push_back(character);
+void FilesystemTree::parse(std::istream& stream, ThreadPool* pool) {
+	std::string text(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>{});
 
-			break;
+	parseText(text, pool);
+}
 
-		case Escaped:
-			tokenBuffer.push_back(character);
-			lexerState = String;
+void FilesystemTree::compile(const std::filesystem::path& path, const SourceInformation& manifest) const {
+	CompiledManifest::save(path, *m_root, manifest);
+}
 
-			break;
+void FilesystemTree::parseText(std::string_view text, ThreadPool* pool) {
+	m_inputsExamined = false;
 
-		case Comment:
-			if (character == '\n') {
-				if (tokenBufferActive) {
-					tokens.push_back(tokenBuffer);
-					tokenBuffer.clear();
-					tokenBufferActive = false;
-				}
+	/*
+	 * Chunks are lexed and their inodes made on the pool a wave at a time,
+	 * and put into the tree in order, which keeps the lines waiting for
+	 * that few. Without a pool, a wave is a single chunk.
+	 */
+	auto chunks = splitManifest(text, ManifestChunkSize);
+	size_t waveSize = pool ? std::max<size_t>(pool->threadCount(), 1) * 4 : 1;
 
-				if (tokens.size() != 0) {
-					processLine(tokens);
-					tokens.clear();
-				}
+	for (size_t wave = 0; wave < chunks.size(); wave += waveSize) {
+		std::vector<ParsedChunk> parsed(std::min(waveSize, chunks.size() - wave));
 
-				lexerState = Normal;
-			}
+		ThreadPool::forEach(pool, parsed.size(), [&chunks, &parsed, wave](size_t index) {
+			parseChunk(chunks[wave + index], parsed[index]);
+		});
 
-			break;
+		for (auto& chunk : parsed) {
+			mergeChunk(chunk);
 		}
 	}
+}
 
-	if (lexerState != Normal)
-		throw std::runtime_error("End of file reached before closing quote");
-
-	if (tokenBufferActive || !tokens.empty())
-		throw std::runtime_error("No newline at the end of file");
+void FilesystemTree::parseChunk(const ManifestChunk& chunk, ParsedChunk& parsed) {
+	try {
+		lexManifest(chunk.text, [&chunk, &parsed](size_t number, const std::vector<std::string_view>& tokens) {
+			try {
+				parseLine(chunk, number, tokens, parsed);
+			}
+			catch (const ManifestError&) {
+				throw;
+			}
+			catch (const std::runtime_error& e) {
+				throw ManifestError(number, e.what());
+			}
+		}, chunk.firstLine);
+	}
+	catch (...) {
+		parsed.error = std::current_exception();
+	}
 }
 
-void FilesystemTree::processLine(const std::vector<std::string>& line) {
-	static const std::unordered_map<std::string, InodeType> inodeTypes{
+void FilesystemTree::parseLine(const ManifestChunk& chunk, size_t number, const std::vector<std::string_view>& line, ParsedChunk& parsed) {
+	static const std::unordered_map<std::string_view, InodeType> inodeTypes{
 		{ "file", InodeType::File },
 		{ "dir",  InodeType::Directory }
 	};
@@ -125,7 +193,7 @@ void FilesystemTree::processLine(const std::vector<std::string>& line) {
 
 	auto inodeIt = inodeTypes.find(*it);
 	if (inodeIt == inodeTypes.end()) {
-		throw std::runtime_error("unsupported inode type: " + *it);
+		throw std::runtime_error("unsupported inode type: " + std::string(*it));
 	}
 	type = inodeIt->second;
 
@@ -157,14 +225,61 @@ void FilesystemTree::processLine(const std::vector<std::string>& line) {
 		++it;
 	}
 
-	auto inode = createInode(type, name, attributes);
+	auto inode = std::make_shared<Inode>(type, std::string(name.substr(name.rfind('/') + 1)), attributes);
 
 	if (type == InodeType::File) {
 		inode->setSourceFileName(std::move(sourceFileName));
 	}
+
+	if (name.data() < chunk.text.data() || name.data() >= chunk.text.data() + chunk.text.size()) {
+		name = parsed.names.emplace_back(name);
+	}
+
+	parsed.lines.push_back(ParsedLine{ number, name, std::move(inode) });
+}
+
+void FilesystemTree::mergeChunk(ParsedChunk& chunk) {
+	/*
+	 * Lines tend to come grouped by directory, which is then looked up once
+	 * for the group.
+	 */
+	std::string_view parentPath;
+	Inode* parent = nullptr;
+
+	for (auto& line : chunk.lines) {
+		try {
+			auto separator = line.name.rfind('/');
+			auto path = separator == std::string_view::npos ? std::string_view() : line.name.substr(0, separator);
+
+			if (!parent || path != parentPath) {
+				auto leafName = line.name;
+				parent = findParent(leafName);
+				parentPath = path;
+			}
+
+			parent->addChild(std::move(line.inode));
+		}
+		catch (const std::runtime_error& e) {
+			throw ManifestError(line.number, e.what());
+		}
+	}
+
+	if (chunk.error)
+		std::rethrow_exception(chunk.error);
+}
+
+void FilesystemTree::addDirectory(std::string_view name, Attributes attributes) {
+	createInode(InodeType::Directory, name, attributes);
+}
+
+void FilesystemTree::addFile(std::string_view name, std::filesystem::path sourceFileName, Attributes attributes) {
+	auto inode = createInode(InodeType::File, name, attributes);
+	inode->setSourceFileName(std::move(sourceFileName));
+
+	m_inputsExamined = false;
 }
 
-Attributes FilesystemTree::parseAttributes(const std::string& attrs) {
+Attributes FilesystemTree::parseAttributes(std::string_view attrs) {
 	Attributes attributes = 0;
 
 	for (auto attribute : attrs) {
@@ -186,59 +301,374 @@ Attributes FilesystemTree::parseAttributes(const std::string& attrs) {
 			break;
 
 		default:
-			throw std::runtime_error("unsupported attributes: " + attrs);
+			throw std::runtime_error("unsupported attributes: " + std::string(attrs));
 		}
 	}
 
 	return attributes;
 }
 
-std::shared_ptr<Inode> FilesystemTree::createInode(InodeType type, const std::string& name, Attributes attributes) {
-	auto directory = m_root;
-	size_t pos = 0;
+std::shared_ptr<Inode> FilesystemTree::createInode(InodeType type, std::string_view name, Attributes attributes) {
+	auto leafName = name;
+
+	return findParent(leafName)->createNewChild(type, std::string(leafName), attributes);
+}
+
+Inode* FilesystemTree::findParent(std::string_view& name) const {
+	auto directory = m_root.get();
+	auto path = name;
 
 	while (true) {
 		if (directory->type() != InodeType::Directory)
-			throw std::runtime_error("not a directory in path: " + name);
+			throw std::runtime_error("not a directory in path: " + std::string(path));
+
+		auto terminator = name.find('/');
+		if (terminator == std::string_view::npos)
+			return directory;
+
+		directory = directory->findExistingChildByName(name.substr(0, terminator)).get();
+		name.remove_prefix(terminator + 1);
+	}
+}
+
+std::unique_ptr<FilesystemTree> FilesystemTree::clone() const {
+	auto copy = std::make_unique<FilesystemTree>();
+	copy->m_root = m_root->clone();
+	copy->m_inputsExamined = m_inputsExamined;
+
+	return copy;
+}
+
+void FilesystemTree::statInputs(ThreadPool* pool, const std::filesystem::path& workingDirectory) {
+	std::vector<Inode*> inputs;
+	m_root->collectInputs(inputs);
+
+	auto base = workingDirectory.empty() ? std::filesystem::current_path() : workingDirectory;
+
+	ThreadPool::forEach(pool, inputs.size(), [&inputs, &base](size_t index) {
+		inputs[index]->setSourceInformation(examineFile(inputs[index]->sourceFileName(), base));
+	});
+
+	m_inputsExamined = true;
+}
+
+void FilesystemTree::requireInputInformation() const {
+	if (!m_inputsExamined)
+		throw std::logic_error("the inputs have not been examined");
+}
+
+FATVolumeContents FilesystemTree::volumeContents(uint64_t additionalFreeSpace) const {
+	requireInputInformation();
 
-		auto terminator = name.find('/', pos);
+	FATVolumeContents contents;
+	contents.freeSpace = additionalFreeSpace;
 
-		auto thisName = name.substr(pos, terminator - pos);
+	m_root->collectVolumeContents(contents);
 
-		if (terminator == std::string::npos) {
-			return directory->createNewChild(type, thisName, attributes);
+	return contents;
+}
+
+#if !defined(_WIN32)
+/*
+ * Has the image device copy the source into the extents allocated for it
+ * on its own.
+ */
+static void copyToExtents(IBlockDevice* storage, const std::filesystem::path& source, const std::vector<IFile::Extent>& extents) {
+	struct ManagedHandle {
+		~ManagedHandle() {
+			if (fd >= 0)
+				close(fd);
 		}
-		else {
-			directory = directory->findExistingChildByName(thisName);
 
-			pos = terminator + 1;
+		int fd;
+	} handle{ open(source.c_str(), O_RDONLY) };
+
+	if (handle.fd < 0)
+		throw std::system_error(errno, std::generic_category());
+
+	uint64_t sourceOffset = 0;
+	for (const auto& extent : extents) {
+		storage->copyFrom(handle.fd, sourceOffset, extent.offset, extent.size);
+		sourceOffset += extent.size;
+	}
+}
+#endif
+
+/*
+ * Reads the source in chunks and writes them to the extents allocated for it.
+ */
+static void writeToExtents(IBlockDevice* storage, const SourceReader::Source& source, const std::vector<IFile::Extent>& extents, const FilesystemBuildOptions& options) {
+	SourceReader reader(std::vector<SourceReader::Source>{ source }, nullptr, options.readMode, 0, options.chunkSize, options.sourceCache);
+
+	auto extent = extents.begin();
+	uint64_t extentOffset = 0;
+
+	while (true) {
+		const auto& chunk = reader.next();
+		auto data = chunk.data;
+		auto remaining = chunk.size;
+
+		while (remaining != 0) {
+			if (extent == extents.end())
+				throw std::logic_error("source data does not fit its extents");
+
+			auto piece = static_cast<size_t>(std::min(remaining, extent->size - extentOffset));
+			storage->write(extent->offset + extentOffset, data, piece);
+
+			data += piece;
+			remaining -= piece;
+			extentOffset += piece;
+
+			if (extentOffset == extent->size) {
+				++extent;
+				extentOffset = 0;
+			}
 		}
+
+		if (chunk.last)
+			break;
 	}
 }
 
-size_t FilesystemTree::calculateSize(size_t clusterSizeBytes, size_t additionalFreeSpace) const {
-	auto size = m_root->calculateSize(clusterSizeBytes) + ((additionalFreeSpace + (clusterSizeBytes - 1)) & ~(clusterSizeBytes - 1));
+void FilesystemTree::buildFilesystem(IFilesystem* fs, const FilesystemBuildOptions& options) {
+	requireInputInformation();
 
-	auto clusters = size / clusterSizeBytes;
+	IBlockDevice* concurrentStorage = nullptr;
+	if (options.payloadPool)
+		concurrentStorage = fs->storage()->concurrentWriter();
 
-	bool isFat32 = clusters > 65525;
-	size_t fatEntrySize;
+	if (concurrentStorage)
+		buildFilesystemConcurrently(fs, concurrentStorage, options);
+	else
+		buildFilesystemSequentially(fs, options);
+}
 
-	if (isFat32) {
-		fatEntrySize = 4;
+/*
+ * A source as the sequential writers read it: files from the direct copy
+ * threshold up are not read, but copied by the image device.
+ */
+static SourceReader::Source sequentialSource(const SourceInformation& information, const FilesystemBuildOptions& options) {
+#if defined(_WIN32)
+	(void)options;
+
+	return { information.absolutePath, information.size, false, &information };
+#else
+	return { information.absolutePath, information.size, options.directCopyThreshold != 0 && information.size >= options.directCopyThreshold, &information };
+#endif
+}
+
+/*
+ * Chunks that are whole clusters start every write on a cluster boundary, so
+ * fatfs passes them to the disk directly instead of through its sector
+ * buffer.
+ */
+static size_t sequentialChunkSize(IFilesystem* fs, const FilesystemBuildOptions& options) {
+	auto clusterSize = fs->clusterSize();
+
+	return std::max<size_t>((options.chunkSize + clusterSize - 1) / clusterSize * clusterSize, clusterSize);
+}
+
+/*
+ * Writes the next source handed out by the reader, which must be path, into
+ * the file.
+ */
+static void writeNextSource(IFilesystem* fs, SourceReader& reader, IFile* file, const std::filesystem::path& path) {
+	while (true) {
+		const auto& chunk = reader.next();
+		if (*chunk.path != path)
+			throw std::logic_error("source data is out of order");
+
+		if (chunk.direct) {
+#if defined(_WIN32)
+			throw std::logic_error("direct copies are not supported");
+#else
+			file->preallocate(chunk.size);
+			copyToExtents(fs->storage(), path, file->extents());
+#endif
+		}
+		else {
+			file->write(chunk.data, static_cast<size_t>(chunk.size));
+		}
+
+		if (chunk.last)
+			break;
 	}
-	else {
-		fatEntrySize = 2;
+}
+
+void FilesystemTree::buildFilesystemSequentially(IFilesystem* fs, const FilesystemBuildOptions& options) {
+	/*
+	 * enumerateInputs visits the files in the same order as buildFilesystem,
+	 * so the reader can fetch them ahead of the writer.
+	 */
+	std::vector<SourceReader::Source> sources;
+	m_root->enumerateInputs([&sources, &options](const Inode& inode) {
+		sources.push_back(sequentialSource(inode.sourceInformation(), options));
+	});
+
+	SourceReader reader(std::move(sources), options.readPool, options.readMode, options.readAhead, sequentialChunkSize(fs, options), options.sourceCache);
+
+	m_root->buildFilesystem(fs, "", [fs, &reader](IFile* file, const Inode& inode) {
+		writeNextSource(fs, reader, file, inode.sourceInformation().absolutePath);
+	});
+}
+
+void FilesystemTree::collectBuildState(BuildState& state) const {
+	requireInputInformation();
+
+	m_root->collectBuildState("", state);
+}
+
+void FilesystemTree::updateFilesystem(IFilesystem* fs, const BuildState& previous, const BuildState& current, const FilesystemBuildOptions& options) {
+	auto previousEntry = [&previous](const std::string& path, InodeType type) -> const BuildState::Entry* {
+		auto entry = previous.entries.find(path);
+		if (entry == previous.entries.end() || entry->second.type != type)
+			return nullptr;
+
+		return &entry->second;
+	};
+
+	/*
+	 * Remove what is gone first, children before their directories, which
+	 * also makes room for what is added.
+	 */
+	for (auto entry = previous.entries.rbegin(); entry != previous.entries.rend(); ++entry) {
+		auto currentEntry = current.entries.find(entry->first);
+		if (currentEntry != current.entries.end() && currentEntry->second.type == entry->second.type)
+			continue;
+
+		auto name = utf8StringToFatfsString(entry->first);
+		if (entry->second.attributes & AttributeReadOnly)
+			fs->setAttributes(name, 0, AttributeReadOnly);
+
+		fs->remove(name);
+	}
+
+	/*
+	 * Then create and rewrite, parents before their children, reading the
+	 * changed files ahead in the same order.
+	 */
+	std::vector<SourceReader::Source> sources;
+	for (const auto& entry : current.entries) {
+		if (entry.second.type != InodeType::File)
+			continue;
+
+		auto before = previousEntry(entry.first, InodeType::File);
+		if (!before || !BuildState::sameSource(before->source, entry.second.source))
+			sources.push_back(sequentialSource(entry.second.source, options));
 	}
 
-	auto fatSizeSectors = 2 * ((clusters * fatEntrySize + 511) / 511);
+	SourceReader reader(std::move(sources), options.readPool, options.readMode, options.readAhead, sequentialChunkSize(fs, options), options.sourceCache);
+
+	for (const auto& entry : current.entries) {
+		auto before = previousEntry(entry.first, entry.second.type);
+		auto attributes = before ? before->attributes : AttributeDefault;
+		bool rewrite = entry.second.type == InodeType::Directory ? !before : !before || !BuildState::sameSource(before->source, entry.second.source);
+
+		if (!rewrite && entry.second.attributes == attributes)
+			continue;
 
-	size_t totalSizeSectors = clusters * clusterSizeBytes / 512 + fatSizeSectors;
-	totalSizeSectors += 72;
+		auto name = utf8StringToFatfsString(entry.first);
 
-	return totalSizeSectors * 512;
+		if (rewrite && entry.second.type == InodeType::Directory) {
+			fs->createDirectory(name);
+		}
+		else if (rewrite) {
+			if (attributes & AttributeReadOnly)
+				fs->setAttributes(name, 0, AttributeReadOnly);
+
+			auto clock = FATClock::current();
+			if (clock)
+				clock->enterFile(entry.second.source.modificationTime);
+
+			{
+				auto file = fs->open(name, FF_T("w"));
+				writeNextSource(fs, reader, file.get(), entry.second.source.absolutePath);
+			}
+
+			if (clock)
+				clock->leaveFile();
+
+			attributes = AttributeDefault;
+		}
+
+		if (entry.second.attributes != attributes)
+			fs->setAttributes(name, entry.second.attributes, AttributeMask);
+	}
 }
 
-void FilesystemTree::buildFilesystem(IFilesystem* fs) {
-	m_root->buildFilesystem(fs, "");
+void FilesystemTree::buildFilesystemConcurrently(IFilesystem* fs, IBlockDevice* storage, const FilesystemBuildOptions& options) {
+#if defined(_WIN32)
+	uint64_t directCopyThreshold = 0;
+#else
+	auto directCopyThreshold = options.directCopyThreshold;
+#endif
+
+	/*
+	 * Copies still running hold on to this, so it waits for them on the way
+	 * out, whether or not building the tree succeeded.
+	 */
+	struct PendingCopies {
+		~PendingCopies() {
+			std::unique_lock<std::mutex> locker(mutex);
+			condition.wait(locker, [this]() { return count == 0; });
+		}
+
+		std::mutex mutex;
+		std::condition_variable condition;
+		size_t count = 0;
+		std::exception_ptr error;
+	} pending;
+
+	m_root->buildFilesystem(fs, "", [&pending, &options, storage, directCopyThreshold](IFile* file, const Inode& inode) {
+		auto size = inode.sourceInformation().size;
+		if (size == 0)
+			return;
+
+		file->preallocate(size);
+		auto extents = file->extents();
+
+		{
+			std::unique_lock<std::mutex> locker(pending.mutex);
+			if (pending.error)
+				std::rethrow_exception(pending.error);
+
+			pending.count++;
+		}
+
+		bool direct = directCopyThreshold != 0 && size >= directCopyThreshold;
+		SourceReader::Source source{ inode.sourceInformation().absolutePath, size, false, &inode.sourceInformation() };
+
+		options.payloadPool->submit([&pending, &options, storage, direct, source = std::move(source), extents = std::move(extents)]() {
+			std::exception_ptr error;
+
+			try {
+				if (direct) {
+#if defined(_WIN32)
+					throw std::logic_error("direct copies are not supported");
+#else
+					copyToExtents(storage, source.path, extents);
+#endif
+				}
+				else {
+					writeToExtents(storage, source, extents, options);
+				}
+			}
+			catch (...) {
+				error = std::current_exception();
+			}
+
+			std::unique_lock<std::mutex> locker(pending.mutex);
+			if (error && !pending.error)
+				pending.error = error;
+
+			pending.count--;
+			pending.condition.notify_all();
+		});
+	});
+
+	std::unique_lock<std::mutex> locker(pending.mutex);
+	pending.condition.wait(locker, [&pending]() { return pending.count == 0; });
+
+	if (pending.error)
+		std::rethrow_exception(pending.error);
 }
@@ -3,12 +3,50 @@
 
 #include <filesystem>
 #include <ios>
+#include <memory>
 #include <vector>
 #include <string>
+#include <string_view>
 
 #include "Inode.h"
+#include "FATVolumeGeometry.h"
+#include "SourceReader.h"
 
+class IBlockDevice;
 class IFilesystem;
+class ThreadPool;
+struct BuildState;
+struct ManifestChunk;
+
+struct FilesystemBuildOptions {
+	static constexpr uint64_t DefaultDirectCopyThreshold = 1024 * 1024;
+
+	ThreadPool* readPool = nullptr;
+	SourceReader::Mode readMode = SourceReader::DefaultMode;
+	size_t readAhead = SourceReader::DefaultReadAhead;
+	size_t chunkSize = SourceReader::DefaultChunkSize;
+
+	/*
+	 * Files of at least this size are preallocated and copied into their
+	 * extents by the kernel instead of being read and written through
+	 * fatfs. 0 disables this; it is not available on Windows.
+	 */
+	uint64_t directCopyThreshold = DefaultDirectCopyThreshold;
+
+	/*
+	 * When set, and the image device takes concurrent writes, each file is
+	 * allocated in full when it is created and its contents are copied to
+	 * the allocated extents on this pool, while the rest of the tree is
+	 * built. readPool and readAhead are not used then.
+	 */
+	ThreadPool* payloadPool = nullptr;
+
+	/*
+	 * When set, files read in a single chunk are taken from and kept in this
+	 * cache, shared with other builds.
+	 */
+	SourceCache* sourceCache = nullptr;
+};
 
 class FilesystemTree {
 public:
@@ -18,23 +56,105 @@ public:
 	FilesystemTree(const FilesystemTree& other) = delete;
 	FilesystemTree &operator =(const FilesystemTree& other) = delete;
 
-	void parse(const std::filesystem::path& path);
-	void parse(std::istream& stream);
+	/*
+	 * Adds what the manifest describes. Large manifests are lexed and
+	 * checked in chunks on the pool, when given, before they go into the
+	 * tree in order. Problems are thrown as ManifestError with the number
+	 * of the line at fault.
+	 *
+	 * The path may also name a compiled manifest, which only loads into an
+	 * empty tree. A text manifest of at least CompiledCacheThreshold bytes
+	 * read into an empty tree is compiled next to itself, with .compiled
+	 * appended to its name, and later parses load that instead for as long
+	 * as the manifest stays the same.
+	 */
+	void parse(const std::filesystem::path& path, ThreadPool* pool = nullptr);
+	void parse(std::istream& stream, ThreadPool* pool = nullptr);
+
+	static constexpr uint64_t CompiledCacheThreshold = 1024 * 1024;
+
+	/*
+	 * Writes the tree as a compiled manifest of the text manifest described
+	 * by manifest, replacing path.
+	 */
+	void compile(const std::filesystem::path& path, const SourceInformation& manifest = SourceInformation()) const;
+
+	/*
+	 * Put the tree together without a manifest, as its dir and file lines
+	 * do: names are '/'-separated paths whose parent directories are
+	 * already in the tree. Adding a file calls for statInputs again.
+	 */
+	void addDirectory(std::string_view name, Attributes attributes = AttributeDefault);
+	void addFile(std::string_view name, std::filesystem::path sourceFileName, Attributes attributes = AttributeDefault);
 
-	size_t calculateSize(size_t clusterSizeBytes, size_t additionalFreeSpace) const;
+	/*
+	 * A separate copy of the tree, for a build server to keep a parsed
+	 * manifest around.
+	 */
+	std::unique_ptr<FilesystemTree> clone() const;
 
-	void buildFilesystem(IFilesystem* fs);
+	/*
+	 * Examines every source file once, on the pool if given, and records
+	 * what was found in its inode. Relative source paths are taken from
+	 * workingDirectory, or the current directory when it is empty, and
+	 * everything below reads the sources by their absolute path. Must be
+	 * called after parsing and before anything below, which works from the
+	 * recorded information.
+	 */
+	void statInputs(ThreadPool* pool = nullptr, const std::filesystem::path& workingDirectory = std::filesystem::path());
 
-	inline void enumerateInputs(const std::function<void(const std::filesystem::path&)>& func) const {
+	/*
+	 * What a volume holding the tree with additionalFreeSpace bytes left
+	 * over has to hold.
+	 */
+	FATVolumeContents volumeContents(uint64_t additionalFreeSpace) const;
+
+	void buildFilesystem(IFilesystem* fs, const FilesystemBuildOptions& options = FilesystemBuildOptions());
+
+	/*
+	 * Records the tree, with the sources of its files, into state.
+	 */
+	void collectBuildState(BuildState& state) const;
+
+	/*
+	 * Turns the tree recorded in previous, which fs holds, into the one
+	 * recorded in current: removes what is gone, and creates what is new or
+	 * has a different source, reading only those sources. Other files are
+	 * left untouched.
+	 */
+	static void updateFilesystem(IFilesystem* fs, const BuildState& previous, const BuildState& current, const FilesystemBuildOptions& options = FilesystemBuildOptions());
+
+	inline void enumerateInputs(const std::function<void(const Inode&)>& func) const {
+		requireInputInformation();
 		m_root->enumerateInputs(func);
 	}
 
 private:
-	void processLine(const std::vector<std::string>& line);
-	Attributes parseAttributes(const std::string& attrs);
-	std::shared_ptr<Inode> createInode(InodeType type, const std::string& name, Attributes attributes);
+	struct ParsedLine;
+	struct ParsedChunk;
+
+	static constexpr size_t ManifestChunkSize = 1024 * 1024;
+
+	void parseText(std::string_view text, ThreadPool* pool);
+	static void parseChunk(const ManifestChunk& chunk, ParsedChunk& parsed);
+	static void parseLine(const ManifestChunk& chunk, size_t number, const std::vector<std::string_view>& line, ParsedChunk& parsed);
+	void mergeChunk(ParsedChunk& chunk);
+	static Attributes parseAttributes(std::string_view attrs);
+	std::shared_ptr<Inode> createInode(InodeType type, std::string_view name, Attributes attributes);
+
+	/*
+	 * The directory the last part of the '/'-separated name goes into,
+	 * leaving that part in name.
+	 */
+	Inode* findParent(std::string_view& name) const;
+
+	void requireInputInformation() const;
+
+	void buildFilesystemSequentially(IFilesystem* fs, const FilesystemBuildOptions& options);
+	void buildFilesystemConcurrently(IFilesystem* fs, IBlockDevice* storage, const FilesystemBuildOptions& options);
 
 	std::shared_ptr<Inode> m_root;
+	bool m_inputsExamined;
 };
 
 #endif
@@ -1,5 +1,54 @@
 #include "IBlockDevice.h"
 
+#if !defined(_WIN32)
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+#endif
+
 IBlockDevice::IBlockDevice() = default;
 
 IBlockDevice::~IBlockDevice() = default;
+
+void IBlockDevice::writeGather(uint64_t offset, const WriteSegment* segments, size_t count) {
+	for (size_t index = 0; index < count; index++) {
+		write(offset, segments[index].data, segments[index].size);
+		offset += segments[index].size;
+	}
+}
+
+IBlockDevice* IBlockDevice::concurrentWriter() {
+	return nullptr;
+}
+
+#if !defined(_WIN32)
+void IBlockDevice::copyFrom(int sourceFd, uint64_t sourceOffset, uint64_t offset, uint64_t size) {
+	static constexpr size_t BufferSize = 1024 * 1024;
+
+	auto buffer = std::make_unique<unsigned char[]>(static_cast<size_t>(std::min<uint64_t>(size, BufferSize)));
+
+	while (size > 0) {
+		auto chunk = static_cast<size_t>(std::min<uint64_t>(size, BufferSize));
+
+		auto result = pread(sourceFd, buffer.get(), chunk, static_cast<off_t>(sourceOffset));
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+
+			throw std::system_error(errno, std::generic_category());
+		}
+
+		if (result == 0)
+			throw std::runtime_error("source file was truncated while copying");
+
+		write(offset, buffer.get(), static_cast<size_t>(result));
+
+		sourceOffset += result;
+		offset += result;
+		size -= result;
+	}
+}
+#endif
@@ -14,10 +14,34 @@ public:
 	IBlockDevice(IBlockDevice& other) = delete;
 	IBlockDevice &operator =(IBlockDevice& other) = delete;
 
+	struct WriteSegment {
+		const void* data;
+		size_t size;
+	};
+
 	virtual void read(uint64_t offset, void* buffer, size_t size) = 0;
 	virtual void write(uint64_t offset, const void* buffer, size_t size) = 0;
+	virtual void writeGather(uint64_t offset, const WriteSegment* segments, size_t count);
 	virtual void flush() = 0;
 
+#if !defined(_WIN32)
+	/*
+	 * Copies size bytes at sourceOffset in the file open as sourceFd to
+	 * offset on the device. The default implementation goes through a
+	 * buffer; backends override it to keep the data inside the kernel.
+	 */
+	virtual void copyFrom(int sourceFd, uint64_t sourceOffset, uint64_t offset, uint64_t size);
+#endif
+
+	/*
+	 * Returns a device that takes write() and copyFrom() calls from several
+	 * threads at once, alongside the use of this one, as long as no two
+	 * accesses overlap; nullptr if there is none. Its writes bypass whatever
+	 * this device buffers, so the ranges they cover must not be accessed
+	 * through this device until they complete.
+	 */
+	virtual IBlockDevice* concurrentWriter();
+
 	virtual uint64_t mediaSize() const = 0;
 	virtual unsigned int allocationUnit() const = 0;
 };
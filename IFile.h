@@ -4,6 +4,8 @@
 #include <string.h>
 #include <stdint.h>
 
+#include <vector>
+
 class IFile {
 protected:
 	IFile();
@@ -23,6 +25,27 @@ public:
 	virtual int64_t seek(int64_t offset, SeekWhence whence) = 0;
 	virtual size_t read(void* data, size_t size) = 0;
 	virtual size_t write(const void* data, size_t size) = 0;
+
+	/*
+	 * Location of a piece of the file contents on the underlying block
+	 * device, in bytes.
+	 */
+	struct Extent {
+		uint64_t offset;
+		uint64_t size;
+	};
+
+	/*
+	 * Allocates the storage for an empty file and sets its size, without
+	 * writing any contents. The allocation is contiguous where possible.
+	 */
+	virtual void preallocate(uint64_t size) = 0;
+
+	/*
+	 * Returns the extents holding the file contents, in file order. The last
+	 * extent ends at the end of the file rather than of the allocation.
+	 */
+	virtual std::vector<Extent> extents() = 0;
 };
 
 #endif
@@ -6,6 +6,7 @@
 #include "StringUtils.h"
 
 class IFile;
+class IBlockDevice;
 
 class IFilesystem {
 protected:
@@ -20,6 +21,20 @@ public:
 	virtual bool createDirectory(const FatfsString& name) = 0;
 	virtual std::unique_ptr<IFile> open(const FatfsString& name, const FatfsString& mode) = 0;
 	virtual void setAttributes(const FatfsString& name, unsigned int attributes, unsigned int attributeMask) = 0;
+
+	/*
+	 * Removes a file or an empty directory.
+	 */
+	virtual void remove(const FatfsString& name) = 0;
+	virtual void flush() = 0;
+
+	virtual size_t clusterSize() const = 0;
+
+	/*
+	 * Block device holding the filesystem, for moving file contents directly
+	 * into the extents reported by IFile::extents().
+	 */
+	virtual IBlockDevice* storage() = 0;
 };
 
 #endif
@@ -0,0 +1,307 @@
+#include "ImageCache.h"
+#include "BuildState.h"
+#include "FATClock.h"
+#include "Sha256.h"
+#include "TextRecords.h"
+#include "ThreadPool.h"
+
+#if !defined(_WIN32)
+#include "FileTransfer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <system_error>
+#include <vector>
+
+static const char KnownSourcesSignature[] = "fatbuilder-sources 1";
+
+/*
+ * Builds sharing the cache write their files next to the final name under
+ * names of their own, and rename them into place.
+ */
+static std::filesystem::path temporaryPathFor(const std::filesystem::path& path) {
+	std::ostringstream suffix;
+	suffix << '.' << std::hex << std::random_device()() << ".tmp";
+
+	auto temporaryPath = path;
+	temporaryPath += suffix.str();
+
+	return temporaryPath;
+}
+
+static void copyFile(const std::filesystem::path& from, const std::filesystem::path& to) {
+#if defined(_WIN32)
+	std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing);
+#else
+	struct ManagedHandle {
+		~ManagedHandle() {
+			if (fd >= 0)
+				close(fd);
+		}
+
+		int fd;
+	};
+
+	ManagedHandle source{ open(from.c_str(), O_RDONLY) };
+	if (source.fd < 0)
+		throw std::filesystem::filesystem_error("cannot open the file", from, std::error_code(errno, std::generic_category()));
+
+	struct stat information;
+	if (fstat(source.fd, &information) < 0)
+		throw std::system_error(errno, std::generic_category());
+
+	ManagedHandle destination{ open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666) };
+	if (destination.fd < 0)
+		throw std::filesystem::filesystem_error("cannot create the file", to, std::error_code(errno, std::generic_category()));
+
+	/*
+	 * Only the data is copied, so that sparse images stay sparse. Large
+	 * regions share their blocks with the cache where the filesystem
+	 * supports reflinks; the short one images have after nearly every file
+	 * are cheaper to copy by hand.
+	 */
+	static constexpr uint64_t BufferSize = 1024 * 1024;
+
+	auto size = static_cast<uint64_t>(information.st_size);
+	std::vector<char> buffer(BufferSize);
+
+	for (uint64_t offset = 0; offset < size; ) {
+		uint64_t end = size;
+
+#if defined(SEEK_DATA)
+		auto data = lseek(source.fd, static_cast<off_t>(offset), SEEK_DATA);
+		if (data < 0 && errno == ENXIO)
+			break;
+
+		if (data >= 0) {
+			offset = static_cast<uint64_t>(data);
+
+			auto hole = lseek(source.fd, data, SEEK_HOLE);
+			if (hole >= 0)
+				end = std::min(static_cast<uint64_t>(hole), size);
+		}
+#endif
+
+		if (end - offset >= BufferSize)
+			offset += transferFileRange(source.fd, offset, destination.fd, offset, end - offset);
+
+		while (offset < end) {
+			auto result = pread(source.fd, buffer.data(), static_cast<size_t>(std::min<uint64_t>(end - offset, buffer.size())), static_cast<off_t>(offset));
+			if (result < 0 && errno == EINTR)
+				continue;
+			else if (result < 0)
+				throw std::system_error(errno, std::generic_category());
+			else if (result == 0)
+				throw std::runtime_error("file was truncated while copying");
+
+			for (ssize_t written = 0; written < result; ) {
+				auto piece = pwrite(destination.fd, buffer.data() + written, static_cast<size_t>(result - written), static_cast<off_t>(offset + written));
+				if (piece < 0 && errno != EINTR)
+					throw std::system_error(errno, std::generic_category());
+				else if (piece > 0)
+					written += piece;
+			}
+
+			offset += static_cast<uint64_t>(result);
+		}
+	}
+
+	if (ftruncate(destination.fd, static_cast<off_t>(size)) < 0)
+		throw std::system_error(errno, std::generic_category());
+#endif
+}
+
+static void copyFileAtomically(const std::filesystem::path& from, const std::filesystem::path& to) {
+	auto temporaryPath = temporaryPathFor(to);
+
+	try {
+		copyFile(from, temporaryPath);
+		std::filesystem::rename(temporaryPath, to);
+	}
+	catch (...) {
+		std::error_code error;
+		std::filesystem::remove(temporaryPath, error);
+		throw;
+	}
+}
+
+ImageCache::ImageCache(std::filesystem::path directory) : m_directory(std::move(directory)) {
+	std::filesystem::create_directories(m_directory);
+
+	loadKnownSources();
+}
+
+std::string ImageCache::key(const std::string& options, const BuildState& tree, const FATClock& clock, ThreadPool* pool) {
+	std::vector<std::pair<const SourceInformation*, std::string>> hashes;
+
+	for (const auto& entry : tree.entries) {
+		if (entry.second.type == InodeType::File)
+			hashes.emplace_back(&entry.second.source, std::string());
+	}
+
+	std::vector<size_t> unknown;
+	std::unique_lock<std::mutex> locker(m_mutex);
+
+	for (size_t index = 0; index < hashes.size(); index++) {
+		auto source = hashes[index].first;
+		auto known = m_knownSources.find(source->absolutePath.u8string());
+
+		if (known != m_knownSources.end() && BuildState::sameSource(known->second.source, *source))
+			hashes[index].second = known->second.hash;
+		else
+			unknown.push_back(index);
+	}
+
+	locker.unlock();
+
+	ThreadPool::forEach(pool, unknown.size(), [&hashes, &unknown](size_t index) {
+		auto& hash = hashes[unknown[index]];
+		hash.second = hashFile(hash.first->absolutePath);
+	});
+
+	if (!unknown.empty()) {
+		locker.lock();
+
+		for (auto index : unknown) {
+			const auto& hash = hashes[index];
+			m_knownSources[hash.first->absolutePath.u8string()] = KnownSource{ *hash.first, hash.second };
+		}
+
+		saveKnownSources();
+		locker.unlock();
+	}
+
+	/*
+	 * Directories and files by their path in the image, which is all that
+	 * matters about them besides the contents and timestamp of the files.
+	 */
+	Sha256 digest;
+	std::ostringstream description;
+	description << "fatbuilder-image 1\n" << options << "\ntime\t" << clock.now() << '\n';
+	digest.update(description.str());
+
+	auto hash = hashes.begin();
+
+	for (const auto& entry : tree.entries) {
+		description.str(std::string());
+
+		if (entry.second.type == InodeType::File) {
+			description << "file\t" << entry.second.attributes << '\t' << entry.second.source.size << '\t' << hash->second << '\t' <<
+				clock.fileTime(entry.second.source.modificationTime);
+			++hash;
+		}
+		else {
+			description << "directory\t" << entry.second.attributes;
+		}
+
+		description << '\t' << escapeRecordField(entry.first) << '\n';
+		digest.update(description.str());
+	}
+
+	return Sha256::hex(digest.finish());
+}
+
+bool ImageCache::fetch(const std::string& key, const std::filesystem::path& image, const std::filesystem::path& layoutMap) const {
+	auto cachedImage = m_directory / (key + ".img");
+	auto cachedLayoutMap = m_directory / (key + ".layout");
+
+	if (!std::filesystem::exists(cachedImage) || (!layoutMap.empty() && !std::filesystem::exists(cachedLayoutMap)))
+		return false;
+
+	copyFile(cachedImage, image);
+
+	if (!layoutMap.empty())
+		copyFile(cachedLayoutMap, layoutMap);
+
+	return true;
+}
+
+void ImageCache::store(const std::string& key, const std::filesystem::path& image, const std::filesystem::path& layoutMap) const {
+	/*
+	 * The layout map goes first, so that an image is never found without
+	 * the layout map it was stored with.
+	 */
+	if (!layoutMap.empty())
+		copyFileAtomically(layoutMap, m_directory / (key + ".layout"));
+
+	copyFileAtomically(image, m_directory / (key + ".img"));
+}
+
+std::string ImageCache::hashFile(const std::filesystem::path& path) {
+	std::ifstream stream;
+	stream.exceptions(std::ios::badbit);
+	stream.open(path, std::ios::in | std::ios::binary);
+	if (!stream)
+		throw std::filesystem::filesystem_error("cannot open the file", path, std::make_error_code(std::errc::no_such_file_or_directory));
+
+	Sha256 digest;
+	std::vector<char> buffer(1024 * 1024);
+
+	do {
+		stream.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+		digest.update(buffer.data(), static_cast<size_t>(stream.gcount()));
+	} while (stream);
+
+	return Sha256::hex(digest.finish());
+}
+
+void ImageCache::loadKnownSources() {
+	std::ifstream stream(m_directory / "sources", std::ios::in | std::ios::binary);
+	if (!stream)
+		return;
+
+	std::string line;
+	if (!std::getline(stream, line) || line != KnownSourcesSignature)
+		return;
+
+	std::vector<std::string> fields;
+
+	/*
+	 * A damaged line costs reading its source again, nothing more.
+	 */
+	while (std::getline(stream, line)) {
+		KnownSource known;
+
+		if (!splitRecordFields(line, fields) || fields.size() != 6 ||
+			!parseRecordNumber(fields[0], known.source.size) ||
+			!parseRecordNumber(fields[1], known.source.modificationTime) ||
+			!parseRecordNumber(fields[2], known.source.device) ||
+			!parseRecordNumber(fields[3], known.source.inode))
+			continue;
+
+		known.hash = std::move(fields[4]);
+		known.source.absolutePath = std::filesystem::u8path(fields[5]);
+
+		m_knownSources[fields[5]] = std::move(known);
+	}
+}
+
+void ImageCache::saveKnownSources() const {
+	auto path = m_directory / "sources";
+	auto temporaryPath = temporaryPathFor(path);
+
+	{
+		std::ofstream stream;
+		stream.exceptions(std::ios::failbit | std::ios::badbit);
+		stream.open(temporaryPath, std::ios::out | std::ios::trunc | std::ios::binary);
+
+		stream << KnownSourcesSignature << '\n';
+
+		for (const auto& known : m_knownSources) {
+			const auto& source = known.second.source;
+
+			stream << source.size << '\t' << source.modificationTime << '\t' << source.device << '\t' << source.inode << '\t' <<
+				known.second.hash << '\t' << escapeRecordField(known.first) << '\n';
+		}
+	}
+
+	std::filesystem::rename(temporaryPath, path);
+}
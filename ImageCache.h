@@ -0,0 +1,73 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include "Inode.h"
+
+#include <stdint.h>
+
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+struct BuildState;
+class FATClock;
+class ThreadPool;
+
+/*
+ * A directory of finished images, each filed under a hash of everything that
+ * decides its contents, so that a build that would produce one of them again
+ * copies it instead. Only reproducible builds can be cached.
+ *
+ * The hashes of the source contents are kept there as well, by the size,
+ * modification time and identity of the source, so that a source is only
+ * read again once it changed. Builds running side by side can share one
+ * instance.
+ */
+class ImageCache {
+public:
+	explicit ImageCache(std::filesystem::path directory);
+
+	ImageCache(const ImageCache& other) = delete;
+	ImageCache &operator =(const ImageCache& other) = delete;
+
+	/*
+	 * The key of the image built from tree with options, a description of
+	 * everything else the volume depends on, and with the timestamps of
+	 * clock. Sources without a known hash are read on pool when given.
+	 */
+	std::string key(const std::string& options, const BuildState& tree, const FATClock& clock, ThreadPool* pool);
+
+	/*
+	 * Copies the image filed under key to image, and its layout map to
+	 * layoutMap unless that is empty. Returns false, without touching
+	 * either, when the cache does not have them.
+	 */
+	bool fetch(const std::string& key, const std::filesystem::path& image, const std::filesystem::path& layoutMap) const;
+
+	/*
+	 * Files a copy of the image, and of its layout map unless that is
+	 * empty, under key.
+	 */
+	void store(const std::string& key, const std::filesystem::path& image, const std::filesystem::path& layoutMap) const;
+
+	/*
+	 * SHA-256 of the contents of the file, in hex.
+	 */
+	static std::string hashFile(const std::filesystem::path& path);
+
+private:
+	struct KnownSource {
+		SourceInformation source;
+		std::string hash;
+	};
+
+	void loadKnownSources();
+	void saveKnownSources() const;
+
+	std::filesystem::path m_directory;
+	std::mutex m_mutex;
+	std::unordered_map<std::string, KnownSource> m_knownSources;
+};
+
+#endif
@@ -2,65 +2,119 @@
 #include "IFilesystem.h"
 #include "StringUtils.h"
 #include "IFile.h"
+#include "FATNames.h"
+#include "FATVolumeGeometry.h"
+#include "BuildState.h"
+#include "FATClock.h"
 
+#if !defined(_WIN32)
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#if defined(__linux__)
+#include <sys/sysmacros.h>
+#endif
+#endif
+
+#include <chrono>
 #include <stdexcept>
-#include <fstream>
-#include <vector>
+#include <system_error>
 
-Inode::Inode(InodeType type, const std::string& name, Attributes attributes) : m_type(type), m_name(name), m_attributes(attributes) {
+Inode::Inode(InodeType type, std::string name, Attributes attributes) : m_type(type), m_name(std::move(name)), m_attributes(attributes) {
 
 }
 
 Inode::~Inode() = default;
 
-std::shared_ptr<Inode> Inode::findExistingChildByName(const std::string& name) {
+std::shared_ptr<Inode> Inode::clone() const {
+	auto copy = std::make_shared<Inode>(m_type, m_name, m_attributes);
+	copy->m_sourceFileName = m_sourceFileName;
+	copy->m_sourceInformation = m_sourceInformation;
+
+	for (const auto& child : m_children) {
+		auto childCopy = child.second->clone();
+		copy->m_children.emplace_hint(copy->m_children.end(), childCopy->name(), std::move(childCopy));
+	}
+
+	return copy;
+}
+
+std::shared_ptr<Inode> Inode::findExistingChildByName(std::string_view name) {
 	auto inode = m_children.find(name);
 	if (inode == m_children.end()) {
-		throw std::runtime_error("child not found: " + name);
+		throw std::runtime_error("child not found: " + std::string(name));
 	}
 
 	return inode->second;
 }
 
-std::shared_ptr<Inode> Inode::createNewChild(InodeType type, const std::string& name, Attributes attributes) {
-	auto inode = std::make_shared<Inode>(type, name, attributes);
-	auto result = m_children.emplace(name, inode);
-
-	if (!result.second)
-		throw std::runtime_error("child already exists: " + name);
+std::shared_ptr<Inode> Inode::createNewChild(InodeType type, std::string name, Attributes attributes) {
+	auto inode = std::make_shared<Inode>(type, std::move(name), attributes);
+	addChild(inode);
 
 	return inode;
 }
 
-size_t Inode::calculateSize(size_t clusterSizeBytes) const {
-	if (m_type == InodeType::Directory) {
-		size_t entries;
+void Inode::addChild(std::shared_ptr<Inode> child) {
+	auto inode = child.get();
 
-		if (m_name.empty()) {
-			entries = 512;
-		}
-		else {
-			entries = m_children.size();
-		}
+	/*
+	 * Children tend to come in name order, as they do from a compiled
+	 * manifest, and then go in at the end without a search.
+	 */
+	auto existing = m_children.try_emplace(m_children.end(), inode->name(), std::move(child));
 
-		auto size = entries * 32;
-		size = (size + clusterSizeBytes - 1) & ~(clusterSizeBytes - 1);
+	if (existing->second.get() != inode)
+		throw std::runtime_error("child already exists: " + inode->name());
+}
 
-		for (const auto& child : m_children) {
-			size += child.second->calculateSize(clusterSizeBytes);
-		}
+void Inode::enumerateChildren(const std::function<void(const Inode&)>& func) const {
+	for (const auto& child : m_children) {
+		func(*child.second);
+	}
+}
 
-		return size;
+void Inode::collectVolumeContents(FATVolumeContents& contents) const {
+	if (m_type == InodeType::File) {
+		contents.fileSizes.push_back(m_sourceInformation.size);
+		return;
 	}
-	else {
-		auto size = std::filesystem::file_size(m_sourceFileName);
-		size = (size + clusterSizeBytes - 1) & ~(clusterSizeBytes - 1);
 
-		return size;
+	/*
+	 * Subdirectories start with the dot and dot-dot entries.
+	 */
+	uint32_t entries = m_name.empty() ? 0 : 2;
+
+	for (const auto& child : m_children) {
+		auto names = splitFATPath(utf8StringToFatfsString(child.second->name()));
+		if (names.size() != 1)
+			throw std::runtime_error("invalid file name: " + child.second->name());
+
+		entries += fatNameEntryCount(names.front());
+
+		child.second->collectVolumeContents(contents);
+	}
+
+	if (m_name.empty())
+		contents.rootEntries = entries;
+	else
+		contents.directoryEntries.push_back(entries);
+}
+
+void Inode::collectBuildState(const std::string& pathPrefix, BuildState& state) const {
+	auto path = pathPrefix;
+
+	if (!m_name.empty()) {
+		path += "/" + m_name;
+		state.entries.emplace(path, BuildState::Entry{ m_type, m_attributes, m_sourceInformation });
+	}
+
+	for (const auto& child : m_children) {
+		child.second->collectBuildState(path, state);
 	}
 }
 
-void Inode::buildFilesystem(IFilesystem* fs, const std::string& pathPrefix) {
+void Inode::buildFilesystem(IFilesystem* fs, const std::string& pathPrefix, const std::function<void(IFile*, const Inode&)>& writeContents) {
 	auto fullPath = pathPrefix + "/" + m_name;
 	auto fullPathUnicode = utf8StringToFatfsString(fullPath);
 
@@ -69,41 +123,106 @@ void Inode::buildFilesystem(IFilesystem* fs, const std::string& pathPrefix) {
 			fs->createDirectory(fullPathUnicode);
 		}
 
+		/*
+		 * The root directory is "/", but its children are "/name".
+		 */
 		for (const auto& child : m_children) {
-			child.second->buildFilesystem(fs, fullPath);
+			child.second->buildFilesystem(fs, m_name.empty() ? pathPrefix : fullPath, writeContents);
 		}
 	}
 	else {
-		auto file = fs->open(fullPathUnicode, FF_T("w"));
-
-		std::ifstream source;
-		source.exceptions(std::ios::failbit | std::ios::badbit | std::ios::eofbit);
-		source.open(m_sourceFileName, std::ios::in | std::ios::binary);
-		source.exceptions(std::ios::badbit);
+		auto clock = FATClock::current();
+		if (clock)
+			clock->enterFile(m_sourceInformation.modificationTime);
 
-		std::vector<char> buf(8192);
-		size_t bytesTransferred;
-		do {
-			source.read(buf.data(), buf.size());
-			bytesTransferred = source.gcount();
+		{
+			auto file = fs->open(fullPathUnicode, FF_T("w"));
 
-			file->write(buf.data(), bytesTransferred);
+			writeContents(file.get(), *this);
+		}
 
-		} while (bytesTransferred == buf.size());
+		if (clock)
+			clock->leaveFile();
 	}
 
 	if (m_attributes != AttributeDefault) {
-		fs->setAttributes(fullPathUnicode, m_attributes, AttributeArchive | AttributeSystem | AttributeHidden | AttributeReadOnly);
+		fs->setAttributes(fullPathUnicode, m_attributes, AttributeMask);
 	}
 }
 
-void Inode::enumerateInputs(const std::function<void(const std::filesystem::path&)>& func) const {
+void Inode::enumerateInputs(const std::function<void(const Inode&)>& func) const {
 	if (m_type == InodeType::Directory) {
 		for (const auto& child : m_children) {
 			child.second->enumerateInputs(func);
 		}
 	}
 	else {
-		func(m_sourceFileName);
+		func(*this);
 	}
 }
+
+void Inode::collectInputs(std::vector<Inode*>& inputs) {
+	if (m_type == InodeType::Directory) {
+		for (const auto& child : m_children) {
+			child.second->collectInputs(inputs);
+		}
+	}
+	else {
+		inputs.push_back(this);
+	}
+}
+
+SourceInformation examineFile(const std::filesystem::path& path, const std::filesystem::path& workingDirectory) {
+	SourceInformation information;
+
+#if defined(_WIN32)
+	(void)workingDirectory;
+
+	information.absolutePath = std::filesystem::absolute(path);
+	information.size = std::filesystem::file_size(path);
+	/*
+	 * The file clock counts from 1601 here, like FILETIME.
+	 */
+	information.modificationTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::filesystem::last_write_time(path).time_since_epoch()).count() -
+		INT64_C(11644473600) * 1000000000;
+#else
+	/*
+	 * What std::filesystem::absolute does here, without asking for the
+	 * working directory every time.
+	 */
+	information.absolutePath = path.is_absolute() ? path : workingDirectory / path;
+
+	auto fail = [&path](std::error_code error) {
+		throw std::filesystem::filesystem_error("cannot examine the file", path, error);
+	};
+
+#if defined(STATX_BASIC_STATS)
+	struct statx status;
+	if (statx(AT_FDCWD, information.absolutePath.c_str(), 0, STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO, &status) < 0)
+		fail(std::error_code(errno, std::generic_category()));
+
+	auto mode = status.stx_mode;
+	information.size = status.stx_size;
+	information.modificationTime = static_cast<int64_t>(status.stx_mtime.tv_sec) * 1000000000 + status.stx_mtime.tv_nsec;
+	information.device = makedev(status.stx_dev_major, status.stx_dev_minor);
+	information.inode = status.stx_ino;
+#else
+	struct stat status;
+	if (stat(information.absolutePath.c_str(), &status) < 0)
+		fail(std::error_code(errno, std::generic_category()));
+
+	auto mode = status.st_mode;
+	information.size = static_cast<uint64_t>(status.st_size);
+	information.modificationTime = static_cast<int64_t>(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+	information.device = status.st_dev;
+	information.inode = status.st_ino;
+#endif
+
+	if (S_ISDIR(mode))
+		fail(std::make_error_code(std::errc::is_a_directory));
+	else if (!S_ISREG(mode))
+		fail(std::make_error_code(std::errc::not_supported));
+#endif
+
+	return information;
+}
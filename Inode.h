@@ -1,13 +1,20 @@
 #ifndef INODE_H
 #define INODE_H
 
+#include <stdint.h>
+
 #include <string>
+#include <string_view>
 #include <memory>
-#include <unordered_map>
+#include <map>
 #include <filesystem>
 #include <functional>
+#include <vector>
 
 class IFilesystem;
+class IFile;
+struct FATVolumeContents;
+struct BuildState;
 
 enum class InodeType {
 	File,
@@ -16,15 +23,35 @@ enum class InodeType {
 
 typedef unsigned int Attributes;
 
+/*
+ * What FilesystemTree::statInputs() found out about the source of a file.
+ * The modification time is in nanoseconds since the Unix epoch; the device and
+ * inode numbers stay 0 where the platform has none.
+ */
+struct SourceInformation {
+	std::filesystem::path absolutePath;
+	uint64_t size = 0;
+	int64_t modificationTime = 0;
+	uint64_t device = 0;
+	uint64_t inode = 0;
+};
+
+/*
+ * Examines a regular file with a single call where the platform has one.
+ * Relative paths are taken from workingDirectory.
+ */
+SourceInformation examineFile(const std::filesystem::path& path, const std::filesystem::path& workingDirectory);
+
 static constexpr Attributes AttributeArchive  = 1 << 5;
 static constexpr Attributes AttributeReadOnly = 1 << 0;
 static constexpr Attributes AttributeHidden  = 1 << 1;
 static constexpr Attributes AttributeSystem  = 1 << 2;
 static constexpr Attributes AttributeDefault = AttributeArchive;
+static constexpr Attributes AttributeMask = AttributeArchive | AttributeSystem | AttributeHidden | AttributeReadOnly;
 
 class Inode {
 public:
-	Inode(InodeType type, const std::string &name, Attributes attributes);
+	Inode(InodeType type, std::string name, Attributes attributes);
 	~Inode();
 	
 	Inode(const Inode& other) = delete;
@@ -42,8 +69,23 @@ public:
 		return m_attributes;
 	}
 
-	std::shared_ptr<Inode> findExistingChildByName(const std::string& name);
-	std::shared_ptr<Inode> createNewChild(InodeType type, const std::string& name, Attributes attributes);
+	/*
+	 * A separate copy of the subtree.
+	 */
+	std::shared_ptr<Inode> clone() const;
+
+	std::shared_ptr<Inode> findExistingChildByName(std::string_view name);
+	std::shared_ptr<Inode> createNewChild(InodeType type, std::string name, Attributes attributes);
+	void addChild(std::shared_ptr<Inode> child);
+
+	inline size_t childCount() const {
+		return m_children.size();
+	}
+
+	/*
+	 * Visits the children in name order.
+	 */
+	void enumerateChildren(const std::function<void(const Inode&)>& func) const;
 
 	inline const std::filesystem::path& sourceFileName() const {
 		return m_sourceFileName;
@@ -57,18 +99,50 @@ public:
 		m_sourceFileName = std::move(filename);
 	}
 
-	size_t calculateSize(size_t clusterSizeBytes) const;
+	inline const SourceInformation& sourceInformation() const {
+		return m_sourceInformation;
+	}
 
-	void buildFilesystem(IFilesystem* fs, const std::string& pathPrefix);
+	inline void setSourceInformation(SourceInformation&& information) {
+		m_sourceInformation = std::move(information);
+	}
 
-	void enumerateInputs(const std::function<void(const std::filesystem::path&)>& func) const;
+	/*
+	 * Adds what the subtree needs from a FAT volume to contents.
+	 */
+	void collectVolumeContents(FATVolumeContents& contents) const;
+
+	/*
+	 * Adds the subtree to state, under the path of its parent.
+	 */
+	void collectBuildState(const std::string& pathPrefix, BuildState& state) const;
+
+	/*
+	 * Creates the subtree in fs. The contents of every file are left to
+	 * writeContents, which gets the newly created file and its inode.
+	 */
+	void buildFilesystem(IFilesystem* fs, const std::string& pathPrefix, const std::function<void(IFile*, const Inode&)>& writeContents);
+
+	/*
+	 * Visits the files of the subtree, in the order buildFilesystem creates
+	 * them.
+	 */
+	void enumerateInputs(const std::function<void(const Inode&)>& func) const;
+	void collectInputs(std::vector<Inode*>& inputs);
 
 private:
 	InodeType m_type;
 	std::string m_name;
 	Attributes m_attributes;
-	std::unordered_map<std::string, std::shared_ptr<Inode>> m_children;
+
+	/*
+	 * Ordered by name, so that directory entries come out in the same order
+	 * with any standard library, and adding a file does not reorder the
+	 * others. Keyed by the names the children hold.
+	 */
+	std::map<std::string_view, std::shared_ptr<Inode>, std::less<>> m_children;
 	std::filesystem::path m_sourceFileName;
+	SourceInformation m_sourceInformation;
 };
 
 #endif
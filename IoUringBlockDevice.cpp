@@ -0,0 +1,367 @@
+#include "IoUringBlockDevice.h"
+#include "RawBlockDevice.h"
+#include "FileTransfer.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+
+#include <system_error>
+#include <stdexcept>
+#include <limits>
+
+static int sysIoUringSetup(unsigned int entries, io_uring_params *params) {
+	return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int sysIoUringEnter(int fd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags) {
+	return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+IoUringBlockDevice::ManagedMapping::~ManagedMapping() {
+	if(base)
+		munmap(base, size);
+}
+
+IoUringBlockDevice::IoUringBlockDevice(std::filesystem::path&& path, uint64_t size, unsigned int queueDepth, bool keepContents) :
+	m_inFlight(0), m_mediaSize(size), m_allocationUnit(512) {
+
+	if constexpr (sizeof(m_mediaSize) != sizeof(off_t)) {
+		if(m_mediaSize > std::numeric_limits<off_t>::max())
+			throw std::runtime_error("media size is out of range");
+	}
+
+	if(queueDepth == 0)
+		throw std::logic_error("queue depth must not be zero");
+
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	m_ring.fd = sysIoUringSetup(queueDepth, &params);
+	if(m_ring.fd < 0)
+		throw std::system_error(errno, std::generic_category());
+
+	m_sqRing.size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	auto cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+		m_sqRing.size = std::max(m_sqRing.size, cqRingSize);
+
+	auto sqRing = mmap(nullptr, m_sqRing.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring.fd, IORING_OFF_SQ_RING);
+	if(sqRing == MAP_FAILED)
+		throw std::system_error(errno, std::generic_category());
+	m_sqRing.base = sqRing;
+
+	void *cqRing = sqRing;
+	if(!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		m_cqRing.size = cqRingSize;
+
+		cqRing = mmap(nullptr, m_cqRing.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring.fd, IORING_OFF_CQ_RING);
+		if(cqRing == MAP_FAILED)
+			throw std::system_error(errno, std::generic_category());
+		m_cqRing.base = cqRing;
+	}
+
+	m_sqes.size = params.sq_entries * sizeof(io_uring_sqe);
+	auto sqes = mmap(nullptr, m_sqes.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring.fd, IORING_OFF_SQES);
+	if(sqes == MAP_FAILED)
+		throw std::system_error(errno, std::generic_category());
+	m_sqes.base = sqes;
+
+	auto sqBytes = static_cast<unsigned char *>(sqRing);
+	m_sqHead = reinterpret_cast<unsigned int *>(sqBytes + params.sq_off.head);
+	m_sqTail = reinterpret_cast<unsigned int *>(sqBytes + params.sq_off.tail);
+	m_sqMask = *reinterpret_cast<unsigned int *>(sqBytes + params.sq_off.ring_mask);
+	m_sqArray = reinterpret_cast<unsigned int *>(sqBytes + params.sq_off.array);
+	m_sqEntries = static_cast<io_uring_sqe *>(sqes);
+
+	auto cqBytes = static_cast<unsigned char *>(cqRing);
+	m_cqHead = reinterpret_cast<unsigned int *>(cqBytes + params.cq_off.head);
+	m_cqTail = reinterpret_cast<unsigned int *>(cqBytes + params.cq_off.tail);
+	m_cqMask = *reinterpret_cast<unsigned int *>(cqBytes + params.cq_off.ring_mask);
+	m_cqEntries = reinterpret_cast<io_uring_cqe *>(cqBytes + params.cq_off.cqes);
+
+	m_requests.resize(params.sq_entries);
+	for(size_t index = m_requests.size(); index > 0; index--) {
+		m_requests[index - 1].inFlight = false;
+		m_freeRequests.push_back(index - 1);
+	}
+
+	m_handle.fd = open(path.c_str(), keepContents ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(m_handle.fd < 0)
+		throw std::system_error(errno, std::generic_category());
+
+	auto result = ftruncate(m_handle.fd, m_mediaSize);
+	if(result < 0)
+		throw std::system_error(errno, std::generic_category());
+
+	m_allocationUnit = hostBlockSize(m_handle.fd);
+}
+
+IoUringBlockDevice::~IoUringBlockDevice() {
+	/*
+	 * The kernel may still be reading from the request buffers, so they must
+	 * outlive every submitted write.
+	 */
+	while(m_inFlight != 0) {
+		try {
+			waitForCompletion();
+		}
+		catch(...) {
+
+		}
+	}
+}
+
+std::unique_ptr<IBlockDevice> IoUringBlockDevice::create(std::filesystem::path&& path, uint64_t size, unsigned int queueDepth, bool keepContents) {
+	if(!isSupported())
+		return std::make_unique<RawBlockDevice>(std::move(path), size, keepContents);
+
+	return std::make_unique<IoUringBlockDevice>(std::move(path), size, queueDepth, keepContents);
+}
+
+bool IoUringBlockDevice::isSupported() {
+	static const bool supported = []() {
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+
+		auto fd = sysIoUringSetup(1, &params);
+		if(fd < 0)
+			return false;
+
+		close(fd);
+
+		return true;
+	}();
+
+	return supported;
+}
+
+void IoUringBlockDevice::checkBounds(uint64_t offset, size_t size) const {
+	if constexpr (sizeof(offset) != sizeof(off_t)) {
+		if(offset > std::numeric_limits<off_t>::max())
+			throw std::runtime_error("offset is out of range");
+	}
+
+	if(offset + size > m_mediaSize || offset + size < offset)
+		throw std::runtime_error("the access requested is out of the media bounds");
+}
+
+void IoUringBlockDevice::read(uint64_t offset, void* buffer, size_t size) {
+	checkBounds(offset, size);
+
+	waitForOverlapping(offset, size);
+
+	auto result = pread(m_handle.fd, buffer, size, offset);
+	if(result < 0)
+		throw std::system_error(errno, std::generic_category());
+
+	if(static_cast<size_t>(result) != size)
+		throw std::runtime_error("short read");
+}
+
+void IoUringBlockDevice::write(uint64_t offset, const void* buffer, size_t size) {
+	WriteSegment segment{ buffer, size };
+
+	writeGather(offset, &segment, 1);
+}
+
+void IoUringBlockDevice::writeGather(uint64_t offset, const WriteSegment* segments, size_t count) {
+	size_t size = 0;
+	for(size_t index = 0; index < count; index++)
+		size += segments[index].size;
+
+	checkBounds(offset, size);
+
+	if(size == 0)
+		return;
+
+	if(size > std::numeric_limits<uint32_t>::max())
+		throw std::runtime_error("write is too large");
+
+	/*
+	 * The ring does not order the writes in flight, so an older copy of
+	 * the range, or the rest of it after a short write, could otherwise
+	 * land last.
+	 */
+	waitForOverlapping(offset, size);
+
+	auto &request = acquireRequest();
+	request.offset = offset;
+	request.completed = 0;
+	request.data.resize(size);
+
+	auto out = request.data.data();
+	for(size_t index = 0; index < count; index++) {
+		memcpy(out, segments[index].data, segments[index].size);
+		out += segments[index].size;
+	}
+
+	submit(&request - m_requests.data());
+}
+
+void IoUringBlockDevice::flush() {
+	waitForAll();
+
+	auto result = fsync(m_handle.fd);
+	if(result < 0)
+		throw std::system_error(errno, std::generic_category());
+}
+
+void IoUringBlockDevice::copyFrom(int sourceFd, uint64_t sourceOffset, uint64_t offset, uint64_t size) {
+	checkBounds(offset, size);
+
+	/*
+	 * The kernel-side copy must land after any queued write to the same
+	 * range, not race with it.
+	 */
+	waitForOverlapping(offset, size);
+
+	auto done = transferFileRange(sourceFd, sourceOffset, m_handle.fd, offset, size);
+	if(done != size)
+		IBlockDevice::copyFrom(sourceFd, sourceOffset + done, offset + done, size - done);
+}
+
+uint64_t IoUringBlockDevice::mediaSize() const {
+	return m_mediaSize;
+}
+
+unsigned int IoUringBlockDevice::allocationUnit() const {
+	return m_allocationUnit;
+}
+
+IoUringBlockDevice::Request &IoUringBlockDevice::acquireRequest() {
+	while(m_freeRequests.empty())
+		waitForCompletion();
+
+	auto index = m_freeRequests.back();
+	m_freeRequests.pop_back();
+
+	return m_requests[index];
+}
+
+void IoUringBlockDevice::submit(size_t index) {
+	auto &request = m_requests[index];
+
+	request.vector.iov_base = request.data.data() + request.completed;
+	request.vector.iov_len = request.data.size() - request.completed;
+
+	auto tail = *m_sqTail;
+	auto slot = tail & m_sqMask;
+
+	auto &sqe = m_sqEntries[slot];
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_WRITEV;
+	sqe.fd = m_handle.fd;
+	sqe.off = request.offset + request.completed;
+	sqe.addr = reinterpret_cast<uintptr_t>(&request.vector);
+	sqe.len = 1;
+	sqe.user_data = index;
+
+	m_sqArray[slot] = slot;
+	__atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	request.inFlight = true;
+	m_inFlight++;
+
+	enter(1, 0);
+}
+
+void IoUringBlockDevice::enter(unsigned int toSubmit, unsigned int minComplete) {
+	unsigned int flags = minComplete != 0 ? IORING_ENTER_GETEVENTS : 0;
+
+	while(true) {
+		auto result = sysIoUringEnter(m_ring.fd, toSubmit, minComplete, flags);
+		if(result >= 0) {
+			if(static_cast<unsigned int>(result) >= toSubmit)
+				return;
+
+			toSubmit -= result;
+		}
+		else if(errno == EAGAIN || errno == EBUSY) {
+			/*
+			 * The kernel is out of resources to accept more submissions:
+			 * retire some completions before retrying.
+			 */
+			reapCompletions();
+			flags |= IORING_ENTER_GETEVENTS;
+			minComplete = 1;
+		}
+		else if(errno != EINTR) {
+			throw std::system_error(errno, std::generic_category());
+		}
+	}
+}
+
+void IoUringBlockDevice::reapCompletions() {
+	auto head = *m_cqHead;
+	auto tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+
+	std::vector<size_t> resubmit;
+	int error = 0;
+
+	while(head != tail) {
+		const auto &cqe = m_cqEntries[head & m_cqMask];
+		auto index = static_cast<size_t>(cqe.user_data);
+		auto &request = m_requests[index];
+
+		if(cqe.res < 0) {
+			error = -cqe.res;
+			request.completed = request.data.size();
+		}
+		else if(cqe.res == 0) {
+			error = EIO;
+			request.completed = request.data.size();
+		}
+		else {
+			request.completed += cqe.res;
+		}
+
+		request.inFlight = false;
+		m_inFlight--;
+
+		if(request.completed < request.data.size()) {
+			resubmit.push_back(index);
+		}
+		else {
+			m_freeRequests.push_back(index);
+		}
+
+		head++;
+	}
+
+	__atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+
+	for(auto index : resubmit)
+		submit(index);
+
+	if(error != 0)
+		throw std::system_error(error, std::generic_category());
+}
+
+void IoUringBlockDevice::waitForCompletion() {
+	if(__atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE) == *m_cqHead)
+		enter(0, 1);
+
+	reapCompletions();
+}
+
+void IoUringBlockDevice::waitForOverlapping(uint64_t offset, uint64_t size) {
+	auto overlapsInFlight = [this, offset, size]() {
+		for(const auto &request : m_requests) {
+			if(request.inFlight && request.offset < offset + size && request.offset + request.data.size() > offset)
+				return true;
+		}
+
+		return false;
+	};
+
+	while(overlapsInFlight())
+		waitForCompletion();
+}
+
+void IoUringBlockDevice::waitForAll() {
+	while(m_inFlight != 0)
+		waitForCompletion();
+}
@@ -0,0 +1,123 @@
+#ifndef FILESYSTEM_IO_URING_BLOCK_DEVICE_H
+#define FILESYSTEM_IO_URING_BLOCK_DEVICE_H
+
+#include "IBlockDevice.h"
+
+#include <filesystem>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+#include <unistd.h>
+#include <sys/uio.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/*
+ * Output image backed by io_uring. Writes are copied and submitted
+ * asynchronously, with at most queueDepth of them in flight; the caller
+ * only waits in flush(), when the queue is full, or when a read or write
+ * overlaps a write that has not completed yet.
+ */
+class IoUringBlockDevice final : public IBlockDevice {
+public:
+	static constexpr unsigned int DefaultQueueDepth = 32;
+
+	/*
+	 * keepContents opens an existing image as RawBlockDevice does.
+	 */
+	IoUringBlockDevice(std::filesystem::path&& path, uint64_t size, unsigned int queueDepth = DefaultQueueDepth, bool keepContents = false);
+	~IoUringBlockDevice() override;
+
+	/*
+	 * Creates an IoUringBlockDevice, or a RawBlockDevice when the running
+	 * kernel does not provide io_uring.
+	 */
+	static std::unique_ptr<IBlockDevice> create(std::filesystem::path&& path, uint64_t size, unsigned int queueDepth = DefaultQueueDepth, bool keepContents = false);
+
+	static bool isSupported();
+
+	void read(uint64_t offset, void* buffer, size_t size) override;
+	void write(uint64_t offset, const void* buffer, size_t size) override;
+	void writeGather(uint64_t offset, const WriteSegment* segments, size_t count) override;
+	void flush() override;
+	void copyFrom(int sourceFd, uint64_t sourceOffset, uint64_t offset, uint64_t size) override;
+
+	uint64_t mediaSize() const override;
+	unsigned int allocationUnit() const override;
+
+private:
+	struct ManagedHandle {
+		ManagedHandle() : fd(-1) {
+
+		}
+
+		~ManagedHandle() {
+			if(fd >= 0)
+				close(fd);
+		}
+
+		ManagedHandle(const ManagedHandle &other) = delete;
+		ManagedHandle &operator =(const ManagedHandle &other) = delete;
+
+		int fd;
+	};
+
+	struct ManagedMapping {
+		ManagedMapping() : base(nullptr), size(0) {
+
+		}
+
+		~ManagedMapping();
+
+		ManagedMapping(const ManagedMapping &other) = delete;
+		ManagedMapping &operator =(const ManagedMapping &other) = delete;
+
+		void *base;
+		size_t size;
+	};
+
+	struct Request {
+		uint64_t offset;
+		std::vector<unsigned char> data;
+		size_t completed;
+		iovec vector;
+		bool inFlight;
+	};
+
+	void checkBounds(uint64_t offset, size_t size) const;
+	Request &acquireRequest();
+	void submit(size_t index);
+	void enter(unsigned int toSubmit, unsigned int minComplete);
+	void reapCompletions();
+	void waitForCompletion();
+	void waitForOverlapping(uint64_t offset, uint64_t size);
+	void waitForAll();
+
+	ManagedHandle m_handle;
+	ManagedHandle m_ring;
+	ManagedMapping m_sqRing;
+	ManagedMapping m_cqRing;
+	ManagedMapping m_sqes;
+
+	unsigned int *m_sqHead;
+	unsigned int *m_sqTail;
+	unsigned int m_sqMask;
+	unsigned int *m_sqArray;
+	io_uring_sqe *m_sqEntries;
+
+	unsigned int *m_cqHead;
+	unsigned int *m_cqTail;
+	unsigned int m_cqMask;
+	io_uring_cqe *m_cqEntries;
+
+	std::vector<Request> m_requests;
+	std::vector<size_t> m_freeRequests;
+	size_t m_inFlight;
+
+	uint64_t m_mediaSize;
+	unsigned int m_allocationUnit;
+};
+
+#endif
@@ -0,0 +1,329 @@
+#include "ManifestLexer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MANIFEST_LEXER_SSE2
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+/*
+ * White space as isspace() has it in the C locale.
+ */
+static inline bool isManifestSpace(unsigned char character) {
+	return character == ' ' || (character >= '\t' && character <= '\r');
+}
+
+static inline bool endsRun(unsigned char character) {
+	return isManifestSpace(character) || character == '"' || character == ';';
+}
+
+static inline bool endsQuoted(unsigned char character) {
+	return character == '"' || character == '\\';
+}
+
+static inline bool isLineStructure(unsigned char character) {
+	return character == '"' || character == ';' || character == '\n';
+}
+
+#if defined(MANIFEST_LEXER_SSE2)
+static inline unsigned int firstSetBit(unsigned int bits) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, bits);
+	return index;
+#else
+	return static_cast<unsigned int>(__builtin_ctz(bits));
+#endif
+}
+#endif
+
+/*
+ * The end of the unquoted part of a token starting at position: the first
+ * white space, quote or semicolon, or end.
+ */
+static const char* findRunEnd(const char* position, const char* end) {
+#if defined(MANIFEST_LEXER_SSE2)
+	const auto space = _mm_set1_epi8(' ');
+	const auto quote = _mm_set1_epi8('"');
+	const auto semicolon = _mm_set1_epi8(';');
+	const auto tab = _mm_set1_epi8('\t');
+	const auto controlSpaces = _mm_set1_epi8('\r' - '\t');
+
+	while (end - position >= 16) {
+		auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(position));
+
+		/*
+		 * \t to \r are the bytes that stay at most \r - \t when \t is
+		 * taken off, with the rest wrapping around above that.
+		 */
+		auto offset = _mm_sub_epi8(bytes, tab);
+		auto control = _mm_cmpeq_epi8(_mm_min_epu8(offset, controlSpaces), offset);
+
+		auto delimiters = _mm_or_si128(
+			_mm_or_si128(control, _mm_cmpeq_epi8(bytes, space)),
+			_mm_or_si128(_mm_cmpeq_epi8(bytes, quote), _mm_cmpeq_epi8(bytes, semicolon)));
+
+		auto bits = static_cast<unsigned int>(_mm_movemask_epi8(delimiters));
+		if (bits != 0)
+			return position + firstSetBit(bits);
+
+		position += 16;
+	}
+#endif
+
+	while (position != end && !endsRun(static_cast<unsigned char>(*position)))
+		position++;
+
+	return position;
+}
+
+/*
+ * The first quote or backslash inside a quoted string, or end.
+ */
+static const char* findQuotedEnd(const char* position, const char* end) {
+#if defined(MANIFEST_LEXER_SSE2)
+	const auto quote = _mm_set1_epi8('"');
+	const auto backslash = _mm_set1_epi8('\\');
+
+	while (end - position >= 16) {
+		auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(position));
+		auto delimiters = _mm_or_si128(_mm_cmpeq_epi8(bytes, quote), _mm_cmpeq_epi8(bytes, backslash));
+
+		auto bits = static_cast<unsigned int>(_mm_movemask_epi8(delimiters));
+		if (bits != 0)
+			return position + firstSetBit(bits);
+
+		position += 16;
+	}
+#endif
+
+	while (position != end && !endsQuoted(static_cast<unsigned char>(*position)))
+		position++;
+
+	return position;
+}
+
+/*
+ * The first quote, semicolon or newline, or end: what tells where the
+ * lines end without lexing them.
+ */
+static const char* findLineStructure(const char* position, const char* end) {
+#if defined(MANIFEST_LEXER_SSE2)
+	const auto quote = _mm_set1_epi8('"');
+	const auto semicolon = _mm_set1_epi8(';');
+	const auto newline = _mm_set1_epi8('\n');
+
+	while (end - position >= 16) {
+		auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(position));
+		auto structure = _mm_or_si128(_mm_cmpeq_epi8(bytes, quote), _mm_or_si128(_mm_cmpeq_epi8(bytes, semicolon), _mm_cmpeq_epi8(bytes, newline)));
+
+		auto bits = static_cast<unsigned int>(_mm_movemask_epi8(structure));
+		if (bits != 0)
+			return position + firstSetBit(bits);
+
+		position += 16;
+	}
+#endif
+
+	while (position != end && !isLineStructure(static_cast<unsigned char>(*position)))
+		position++;
+
+	return position;
+}
+
+ManifestError::ManifestError(size_t line, const std::string& message) : std::runtime_error("line " + std::to_string(line) + ": " + message), m_line(line) {
+
+}
+
+std::vector<ManifestChunk> splitManifest(std::string_view text, size_t chunkSize) {
+	std::vector<ManifestChunk> chunks;
+
+	auto position = text.data();
+	auto end = position + text.size();
+	auto chunkStart = position;
+	size_t lineNumber = 1;
+	size_t chunkLine = 1;
+
+	/*
+	 * Follows the quotes and comments as the lexer does, leaving whatever
+	 * is wrong with them to the lexer.
+	 */
+	while (true) {
+		position = findLineStructure(position, end);
+		if (position == end)
+			break;
+
+		if (*position == '\n') {
+			lineNumber++;
+			position++;
+
+			if (static_cast<size_t>(position - chunkStart) >= chunkSize) {
+				chunks.push_back(ManifestChunk{ std::string_view(chunkStart, static_cast<size_t>(position - chunkStart)), chunkLine });
+				chunkStart = position;
+				chunkLine = lineNumber;
+			}
+		}
+		else if (*position == ';') {
+			auto newline = static_cast<const char*>(memchr(position, '\n', static_cast<size_t>(end - position)));
+			position = newline ? newline : end;
+		}
+		else {
+			position++;
+
+			while (true) {
+				auto quotedEnd = findQuotedEnd(position, end);
+				lineNumber += static_cast<size_t>(std::count(position, quotedEnd, '\n'));
+
+				if (quotedEnd == end || quotedEnd + 1 == end) {
+					position = end;
+					break;
+				}
+
+				if (*quotedEnd == '"') {
+					position = quotedEnd + 1;
+					break;
+				}
+
+				if (quotedEnd[1] == '\n')
+					lineNumber++;
+
+				position = quotedEnd + 2;
+			}
+		}
+	}
+
+	if (chunkStart != end)
+		chunks.push_back(ManifestChunk{ std::string_view(chunkStart, static_cast<size_t>(end - chunkStart)), chunkLine });
+
+	return chunks;
+}
+
+void lexManifest(std::string_view text, const std::function<void(size_t number, const std::vector<std::string_view>& tokens)>& line, size_t firstLine) {
+	std::vector<std::string_view> tokens;
+	size_t lineNumber = firstLine;
+	size_t statementLine = firstLine;
+
+	/*
+	 * Tokens made of several pieces are put together here, and only
+	 * pointed to once the line is complete, as the buffers move when more
+	 * are added.
+	 */
+	std::vector<std::string> assembled;
+	std::vector<size_t> assembledTokens;
+
+	auto position = text.data();
+	auto end = position + text.size();
+
+	while (position != end) {
+		auto character = static_cast<unsigned char>(*position);
+
+		if (character == '\n') {
+			if (!tokens.empty()) {
+				for (size_t index = 0; index < assembledTokens.size(); index++) {
+					tokens[assembledTokens[index]] = assembled[index];
+				}
+
+				line(statementLine, tokens);
+				tokens.clear();
+				assembledTokens.clear();
+			}
+
+			lineNumber++;
+			position++;
+			continue;
+		}
+
+		if (isManifestSpace(character)) {
+			position++;
+			continue;
+		}
+
+		if (character == ';') {
+			auto newline = static_cast<const char*>(memchr(position, '\n', static_cast<size_t>(end - position)));
+			if (!newline)
+				throw ManifestError(lineNumber, "End of file reached before closing quote");
+
+			position = newline;
+			continue;
+		}
+
+		if (tokens.empty())
+			statementLine = lineNumber;
+
+		std::string_view token;
+		std::string* buffer = nullptr;
+		bool empty = true;
+
+		auto addPiece = [&](const char* from, const char* to) {
+			if (empty) {
+				token = std::string_view(from, static_cast<size_t>(to - from));
+				empty = false;
+			}
+			else {
+				if (!buffer) {
+					if (assembledTokens.size() == assembled.size())
+						assembled.emplace_back();
+
+					buffer = &assembled[assembledTokens.size()];
+					buffer->assign(token);
+					assembledTokens.push_back(tokens.size());
+				}
+
+				buffer->append(from, to);
+			}
+		};
+
+		while (true) {
+			auto runEnd = findRunEnd(position, end);
+			if (runEnd != position)
+				addPiece(position, runEnd);
+
+			position = runEnd;
+
+			if (position == end || *position != '"')
+				break;
+
+			position++;
+
+			auto quoteLine = lineNumber;
+
+			while (true) {
+				auto quotedEnd = findQuotedEnd(position, end);
+				if (quotedEnd == end || (*quotedEnd == '\\' && quotedEnd + 1 == end))
+					throw ManifestError(quoteLine, "End of file reached before closing quote");
+
+				addPiece(position, quotedEnd);
+				lineNumber += static_cast<size_t>(std::count(position, quotedEnd, '\n'));
+
+				if (*quotedEnd == '"') {
+					position = quotedEnd + 1;
+					break;
+				}
+
+				addPiece(quotedEnd + 1, quotedEnd + 2);
+				if (quotedEnd[1] == '\n')
+					lineNumber++;
+
+				position = quotedEnd + 2;
+			}
+		}
+
+		tokens.push_back(token);
+	}
+
+	if (!tokens.empty())
+		throw ManifestError(statementLine, "No newline at the end of file");
+}
+
+void lexManifest(std::istream& stream, const std::function<void(size_t number, const std::vector<std::string_view>& tokens)>& line) {
+	std::string text(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>{});
+
+	lexManifest(text, line);
+}
@@ -0,0 +1,56 @@
+#ifndef MANIFEST_LEXER_H
+#define MANIFEST_LEXER_H
+
+#include <functional>
+#include <istream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * A problem with a line of a manifest, whose number leads the message.
+ */
+class ManifestError : public std::runtime_error {
+public:
+	ManifestError(size_t line, const std::string& message);
+
+	inline size_t line() const {
+		return m_line;
+	}
+
+private:
+	size_t m_line;
+};
+
+/*
+ * Whole lines of a manifest, and the number of the first of them.
+ */
+struct ManifestChunk {
+	std::string_view text;
+	size_t firstLine;
+};
+
+/*
+ * Splits the text of a manifest into chunks of at least chunkSize bytes
+ * that end with a line outside of quotes, so that they can be lexed apart.
+ */
+std::vector<ManifestChunk> splitManifest(std::string_view text, size_t chunkSize);
+
+/*
+ * Splits the text of a manifest into lines of tokens, separated by white
+ * space. Double quotes enclose tokens with white space, in which a backslash
+ * takes the next character as it is, and a semicolon starts a comment running
+ * to the end of the line. Lines without tokens are skipped, and every line
+ * must be terminated. line is given the number of the line the tokens start
+ * on, counting from firstLine.
+ *
+ * Tokens point into text where they appear there as they are, and into
+ * buffers of the lexer where quotes or escapes had to be taken out; either
+ * way they are only valid while line runs.
+ */
+void lexManifest(std::string_view text, const std::function<void(size_t number, const std::vector<std::string_view>& tokens)>& line, size_t firstLine = 1);
+
+void lexManifest(std::istream& stream, const std::function<void(size_t number, const std::vector<std::string_view>& tokens)>& line);
+
+#endif
@@ -0,0 +1,78 @@
+#include "MappedFile.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <cerrno>
+#include <fstream>
+#include <system_error>
+
+MappedFile::MappedFile(const std::filesystem::path& path) : m_data(nullptr), m_size(0), m_mapping(nullptr) {
+#if !defined(_WIN32)
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::filesystem::filesystem_error("cannot open the file", path, std::error_code(errno, std::generic_category()));
+
+	struct stat information;
+	if (fstat(fd, &information) < 0) {
+		auto error = errno;
+		close(fd);
+		throw std::system_error(error, std::generic_category());
+	}
+
+	if (S_ISREG(information.st_mode) && information.st_size > 0) {
+		int flags = MAP_PRIVATE;
+#if defined(MAP_POPULATE)
+		/*
+		 * Everything is going to be scanned front to back right away.
+		 */
+		flags |= MAP_POPULATE;
+#endif
+
+		auto size = static_cast<size_t>(information.st_size);
+		auto base = mmap(nullptr, size, PROT_READ, flags, fd, 0);
+		if (base != MAP_FAILED) {
+			m_mapping = base;
+			m_data = static_cast<const unsigned char*>(base);
+			m_size = size;
+		}
+	}
+
+	close(fd);
+
+	if (m_mapping || (S_ISREG(information.st_mode) && information.st_size == 0))
+		return;
+#endif
+
+	read(path);
+}
+
+MappedFile::~MappedFile() {
+#if !defined(_WIN32)
+	if (m_mapping)
+		munmap(m_mapping, m_size);
+#endif
+}
+
+void MappedFile::read(const std::filesystem::path& path) {
+	std::ifstream stream;
+	stream.exceptions(std::ios::failbit | std::ios::eofbit | std::ios::badbit);
+	stream.open(path, std::ios::in | std::ios::binary);
+	stream.exceptions(std::ios::badbit);
+
+	static const size_t ChunkSize = 64 * 1024;
+
+	while (stream) {
+		auto used = m_contents.size();
+		m_contents.resize(used + ChunkSize);
+		stream.read(reinterpret_cast<char*>(m_contents.data() + used), ChunkSize);
+		m_contents.resize(used + static_cast<size_t>(stream.gcount()));
+	}
+
+	m_data = m_contents.data();
+	m_size = m_contents.size();
+}
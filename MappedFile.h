@@ -0,0 +1,42 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <filesystem>
+#include <string_view>
+#include <vector>
+
+/*
+ * The whole contents of a file, mapped read-only. Files that cannot be
+ * mapped, such as pipes, and every file on Windows, are read into memory
+ * instead.
+ */
+class MappedFile {
+public:
+	explicit MappedFile(const std::filesystem::path& path);
+	~MappedFile();
+
+	MappedFile(const MappedFile& other) = delete;
+	MappedFile &operator =(const MappedFile& other) = delete;
+
+	inline const unsigned char* data() const {
+		return m_data;
+	}
+
+	inline size_t size() const {
+		return m_size;
+	}
+
+	inline std::string_view text() const {
+		return std::string_view(reinterpret_cast<const char*>(m_data), m_size);
+	}
+
+private:
+	void read(const std::filesystem::path& path);
+
+	const unsigned char* m_data;
+	size_t m_size;
+	void* m_mapping;
+	std::vector<unsigned char> m_contents;
+};
+
+#endif
@@ -0,0 +1,255 @@
+#include "MemoryBlockDevice.h"
+
+#if defined(_WIN32)
+#include <Windows.h>
+#include <comdef.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <system_error>
+#endif
+
+#include <algorithm>
+#include <stdexcept>
+#include <limits>
+
+/*
+ * Written extents separated by less than this are stored with a single write
+ * of the (zero) bytes in between.
+ */
+static constexpr uint64_t MergeGap = 1024 * 1024;
+static constexpr size_t MaximumWriteSize = 1024 * 1024 * 1024;
+
+namespace {
+#if defined(_WIN32)
+	class ImageFile {
+	public:
+		ImageFile(const std::filesystem::path& path, uint64_t size) {
+			auto rawHandle = CreateFile(
+				path.c_str(),
+				GENERIC_WRITE,
+				0,
+				nullptr,
+				CREATE_ALWAYS,
+				FILE_ATTRIBUTE_NORMAL,
+				nullptr);
+
+			if(rawHandle == INVALID_HANDLE_VALUE)
+				_com_raise_error(HRESULT_FROM_WIN32(GetLastError()));
+
+			m_handle.reset(rawHandle);
+
+			LARGE_INTEGER pos;
+			pos.QuadPart = size;
+			if(!SetFilePointerEx(m_handle.get(), pos, nullptr, FILE_BEGIN))
+				_com_raise_error(HRESULT_FROM_WIN32(GetLastError()));
+
+			if(!SetEndOfFile(m_handle.get()))
+				_com_raise_error(HRESULT_FROM_WIN32(GetLastError()));
+		}
+
+		void write(uint64_t offset, const unsigned char* data, uint64_t size) {
+			while(size > 0) {
+				auto chunk = static_cast<DWORD>(std::min<uint64_t>(size, MaximumWriteSize));
+
+				OVERLAPPED overlapped;
+				memset(&overlapped, 0, sizeof(overlapped));
+				overlapped.Offset = static_cast<DWORD>(offset);
+				overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+				DWORD bytesWritten;
+				if(!WriteFile(m_handle.get(), data, chunk, &bytesWritten, &overlapped))
+					_com_raise_error(HRESULT_FROM_WIN32(GetLastError()));
+
+				offset += bytesWritten;
+				data += bytesWritten;
+				size -= bytesWritten;
+			}
+		}
+
+		void sync() {
+			if(!FlushFileBuffers(m_handle.get()))
+				_com_raise_error(HRESULT_FROM_WIN32(GetLastError()));
+		}
+
+	private:
+		struct WindowsHandleDeleter {
+			inline void operator()(HANDLE handle) const {
+				CloseHandle(handle);
+			}
+		};
+
+		std::unique_ptr<std::remove_pointer<HANDLE>::type, WindowsHandleDeleter> m_handle;
+	};
+#else
+	class ImageFile {
+	public:
+		ImageFile(const std::filesystem::path& path, uint64_t size) {
+			m_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if(m_fd < 0)
+				throw std::system_error(errno, std::generic_category());
+
+			if(ftruncate(m_fd, size) < 0) {
+				auto error = errno;
+				close(m_fd);
+				throw std::system_error(error, std::generic_category());
+			}
+		}
+
+		~ImageFile() {
+			close(m_fd);
+		}
+
+		ImageFile(const ImageFile& other) = delete;
+		ImageFile &operator =(const ImageFile& other) = delete;
+
+		void write(uint64_t offset, const unsigned char* data, uint64_t size) {
+			while(size > 0) {
+				auto chunk = static_cast<size_t>(std::min<uint64_t>(size, MaximumWriteSize));
+
+				auto result = pwrite(m_fd, data, chunk, offset);
+				if(result < 0) {
+					if(errno == EINTR)
+						continue;
+
+					throw std::system_error(errno, std::generic_category());
+				}
+
+				if(result == 0)
+					throw std::runtime_error("short write");
+
+				offset += result;
+				data += result;
+				size -= result;
+			}
+		}
+
+		void sync() {
+			if(fsync(m_fd) < 0)
+				throw std::system_error(errno, std::generic_category());
+		}
+
+	private:
+		int m_fd;
+	};
+#endif
+}
+
+MemoryBlockDevice::MemoryBlockDevice(uint64_t size) : m_mediaSize(size), m_allocationUnit(512) {
+	if(m_mediaSize > std::numeric_limits<size_t>::max())
+		throw std::runtime_error("media size is out of range");
+
+	/*
+	 * Large calloc allocations are backed by fresh anonymous pages, so the
+	 * image costs memory only for the parts that are actually written.
+	 */
+	m_data.reset(static_cast<unsigned char*>(calloc(std::max<size_t>(static_cast<size_t>(m_mediaSize), 1), 1)));
+	if(!m_data)
+		throw std::bad_alloc();
+}
+
+MemoryBlockDevice::MemoryBlockDevice(std::filesystem::path&& path, uint64_t size) : MemoryBlockDevice(size) {
+	m_path = std::move(path);
+}
+
+MemoryBlockDevice::~MemoryBlockDevice() = default;
+
+void MemoryBlockDevice::checkBounds(uint64_t offset, size_t size) const {
+	if(offset + size > m_mediaSize || offset + size < offset)
+		throw std::runtime_error("the access requested is out of the media bounds");
+}
+
+void MemoryBlockDevice::read(uint64_t offset, void* buffer, size_t size) {
+	checkBounds(offset, size);
+
+	memcpy(buffer, m_data.get() + offset, size);
+}
+
+void MemoryBlockDevice::write(uint64_t offset, const void* buffer, size_t size) {
+	checkBounds(offset, size);
+
+	memcpy(m_data.get() + offset, buffer, size);
+
+	std::unique_lock<std::mutex> locker(m_writtenMutex);
+	m_written.add(offset, offset + size);
+}
+
+void MemoryBlockDevice::flush() {
+	if(m_path.empty())
+		return;
+
+	auto temporaryPath = m_path;
+	temporaryPath += ".tmp";
+
+	try {
+		writeImage(temporaryPath);
+
+		std::filesystem::rename(temporaryPath, m_path);
+	}
+	catch(...) {
+		std::error_code ec;
+		std::filesystem::remove(temporaryPath, ec);
+		throw;
+	}
+}
+
+#if !defined(_WIN32)
+void MemoryBlockDevice::copyFrom(int sourceFd, uint64_t sourceOffset, uint64_t offset, uint64_t size) {
+	checkBounds(offset, size);
+
+	auto begin = offset;
+	auto dest = m_data.get() + offset;
+
+	while(size > 0) {
+		auto chunk = static_cast<size_t>(std::min<uint64_t>(size, std::numeric_limits<ssize_t>::max()));
+
+		auto result = pread(sourceFd, dest, chunk, static_cast<off_t>(sourceOffset));
+		if(result < 0) {
+			if(errno == EINTR)
+				continue;
+
+			throw std::system_error(errno, std::generic_category());
+		}
+
+		if(result == 0)
+			throw std::runtime_error("source file was truncated while copying");
+
+		sourceOffset += result;
+		offset += result;
+		dest += result;
+		size -= result;
+	}
+
+	std::unique_lock<std::mutex> locker(m_writtenMutex);
+	m_written.add(begin, offset);
+}
+#endif
+
+IBlockDevice* MemoryBlockDevice::concurrentWriter() {
+	return this;
+}
+
+uint64_t MemoryBlockDevice::mediaSize() const {
+	return m_mediaSize;
+}
+
+unsigned int MemoryBlockDevice::allocationUnit() const {
+	return m_allocationUnit;
+}
+
+void MemoryBlockDevice::writeImage(const std::filesystem::path& path) {
+	ImageFile file(path, m_mediaSize);
+
+	auto it = m_written.begin();
+	while(it != m_written.end()) {
+		auto begin = it->first;
+		auto end = it->second;
+
+		for(++it; it != m_written.end() && it->first - end < MergeGap; ++it)
+			end = it->second;
+
+		file.write(begin, m_data.get() + begin, end - begin);
+	}
+
+	file.sync();
+}
@@ -0,0 +1,62 @@
+#ifndef FILESYSTEM_MEMORY_BLOCK_DEVICE_H
+#define FILESYSTEM_MEMORY_BLOCK_DEVICE_H
+
+#include "IBlockDevice.h"
+#include "ExtentSet.h"
+
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include <cstdlib>
+
+/*
+ * Image held entirely in memory. When constructed with an output path,
+ * flush() writes the regions that have been written to a temporary file
+ * next to the output and renames it into place, so the output is either
+ * left untouched or replaced by a complete image.
+ */
+class MemoryBlockDevice final : public IBlockDevice {
+public:
+	explicit MemoryBlockDevice(uint64_t size);
+	MemoryBlockDevice(std::filesystem::path&& path, uint64_t size);
+	~MemoryBlockDevice() override;
+
+	void read(uint64_t offset, void* buffer, size_t size) override;
+	void write(uint64_t offset, const void* buffer, size_t size) override;
+	void flush() override;
+#if !defined(_WIN32)
+	void copyFrom(int sourceFd, uint64_t sourceOffset, uint64_t offset, uint64_t size) override;
+#endif
+	IBlockDevice* concurrentWriter() override;
+
+	uint64_t mediaSize() const override;
+	unsigned int allocationUnit() const override;
+
+	inline const unsigned char* data() const {
+		return m_data.get();
+	}
+
+	inline const ExtentSet& writtenExtents() const {
+		return m_written;
+	}
+
+private:
+	struct FreeDeleter {
+		inline void operator()(unsigned char* data) const {
+			free(data);
+		}
+	};
+
+	void checkBounds(uint64_t offset, size_t size) const;
+	void writeImage(const std::filesystem::path& path);
+
+	std::filesystem::path m_path;
+	std::unique_ptr<unsigned char, FreeDeleter> m_data;
+	uint64_t m_mediaSize;
+	unsigned int m_allocationUnit;
+	std::mutex m_writtenMutex;
+	ExtentSet m_written;
+};
+
+#endif
@@ -0,0 +1,201 @@
+#include "MmapBlockDevice.h"
+
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include <algorithm>
+#include <system_error>
+#include <stdexcept>
+#include <limits>
+
+MmapBlockDevice::MmapBlockDevice(std::filesystem::path&& path, uint64_t size, size_t windowSize, size_t maxWindows, bool keepContents) :
+	m_mediaSize(size), m_allocationUnit(512), m_windowSize(windowSize), m_maxWindows(std::max<size_t>(maxWindows, 1)), m_useCounter(0) {
+
+	if constexpr (sizeof(m_mediaSize) != sizeof(off_t)) {
+		if(m_mediaSize > std::numeric_limits<off_t>::max())
+			throw std::runtime_error("media size is out of range");
+	}
+
+	m_handle.fd = open(path.c_str(), keepContents ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(m_handle.fd < 0)
+		throw std::system_error(errno, std::generic_category());
+
+	auto result = ftruncate(m_handle.fd, m_mediaSize);
+	if(result < 0)
+		throw std::system_error(errno, std::generic_category());
+
+	if(m_windowSize == 0 && m_mediaSize != 0 && m_mediaSize <= std::numeric_limits<size_t>::max()) {
+		auto base = mmap(nullptr, static_cast<size_t>(m_mediaSize), PROT_READ | PROT_WRITE, MAP_SHARED, m_handle.fd, 0);
+		if(base != MAP_FAILED) {
+			m_windows.push_back(Window{ 0, static_cast<size_t>(m_mediaSize), static_cast<unsigned char*>(base), 0 });
+			m_windowSize = static_cast<size_t>(m_mediaSize);
+			m_maxWindows = 1;
+			return;
+		}
+
+		if(errno != ENOMEM)
+			throw std::system_error(errno, std::generic_category());
+	}
+
+	if(m_windowSize == 0)
+		m_windowSize = DefaultWindowSize;
+
+	auto pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	m_windowSize = (m_windowSize + pageSize - 1) / pageSize * pageSize;
+}
+
+MmapBlockDevice::~MmapBlockDevice() {
+	unmapAll();
+}
+
+void MmapBlockDevice::checkBounds(uint64_t offset, size_t size) const {
+	if(offset + size > m_mediaSize || offset + size < offset)
+		throw std::runtime_error("the access requested is out of the media bounds");
+}
+
+void MmapBlockDevice::read(uint64_t offset, void* buffer, size_t size) {
+	checkBounds(offset, size);
+
+	auto out = static_cast<unsigned char*>(buffer);
+
+	while(size > 0) {
+		size_t available;
+		auto source = map(offset, available);
+		auto chunk = std::min(size, available);
+
+		memcpy(out, source, chunk);
+
+		offset += chunk;
+		out += chunk;
+		size -= chunk;
+	}
+}
+
+void MmapBlockDevice::write(uint64_t offset, const void* buffer, size_t size) {
+	checkBounds(offset, size);
+
+	auto in = static_cast<const unsigned char*>(buffer);
+
+	while(size > 0) {
+		size_t available;
+		auto dest = map(offset, available);
+		auto chunk = std::min(size, available);
+
+		memcpy(dest, in, chunk);
+
+		offset += chunk;
+		in += chunk;
+		size -= chunk;
+	}
+}
+
+void MmapBlockDevice::flush() {
+	for(const auto &window : m_windows) {
+		if(msync(window.base, window.size, MS_SYNC) < 0)
+			throw std::system_error(errno, std::generic_category());
+	}
+
+	/*
+	 * Windows that were unmapped earlier leave their dirty pages in the page
+	 * cache, which msync no longer reaches.
+	 */
+	if(m_windowSize < m_mediaSize) {
+		if(fsync(m_handle.fd) < 0)
+			throw std::system_error(errno, std::generic_category());
+	}
+}
+
+void MmapBlockDevice::copyFrom(int sourceFd, uint64_t sourceOffset, uint64_t offset, uint64_t size) {
+	checkBounds(offset, size);
+
+	/*
+	 * Reading straight into the mapping leaves a single copy, done by the
+	 * kernel.
+	 */
+	while(size > 0) {
+		size_t available;
+		auto dest = map(offset, available);
+		auto chunk = static_cast<size_t>(std::min<uint64_t>(size, available));
+
+		auto result = pread(sourceFd, dest, chunk, static_cast<off_t>(sourceOffset));
+		if(result < 0) {
+			if(errno == EINTR)
+				continue;
+
+			throw std::system_error(errno, std::generic_category());
+		}
+
+		if(result == 0)
+			throw std::runtime_error("source file was truncated while copying");
+
+		sourceOffset += result;
+		offset += result;
+		size -= result;
+	}
+}
+
+IBlockDevice* MmapBlockDevice::concurrentWriter() {
+	/*
+	 * With the whole image in one mapping, map() changes nothing; windows
+	 * would be remapped under the feet of other threads.
+	 */
+	if(m_windowSize < m_mediaSize || m_windows.empty())
+		return nullptr;
+
+	return this;
+}
+
+uint64_t MmapBlockDevice::mediaSize() const {
+	return m_mediaSize;
+}
+
+unsigned int MmapBlockDevice::allocationUnit() const {
+	return m_allocationUnit;
+}
+
+unsigned char *MmapBlockDevice::map(uint64_t offset, size_t &available) {
+	if(m_windowSize >= m_mediaSize && !m_windows.empty()) {
+		available = static_cast<size_t>(m_mediaSize - offset);
+		return m_windows.front().base + offset;
+	}
+
+	for(auto &window : m_windows) {
+		if(offset >= window.offset && offset - window.offset < window.size) {
+			window.lastUse = ++m_useCounter;
+			available = static_cast<size_t>(window.offset + window.size - offset);
+			return window.base + (offset - window.offset);
+		}
+	}
+
+	if(m_windows.size() >= m_maxWindows) {
+		auto victim = std::min_element(m_windows.begin(), m_windows.end(), [](const Window &a, const Window &b) {
+			return a.lastUse < b.lastUse;
+		});
+
+		munmap(victim->base, victim->size);
+		m_windows.erase(victim);
+	}
+
+	Window window;
+	window.offset = offset - offset % m_windowSize;
+	window.size = static_cast<size_t>(std::min<uint64_t>(m_windowSize, m_mediaSize - window.offset));
+	window.lastUse = ++m_useCounter;
+
+	auto base = mmap(nullptr, window.size, PROT_READ | PROT_WRITE, MAP_SHARED, m_handle.fd, static_cast<off_t>(window.offset));
+	if(base == MAP_FAILED)
+		throw std::system_error(errno, std::generic_category());
+
+	window.base = static_cast<unsigned char*>(base);
+	m_windows.push_back(window);
+
+	available = static_cast<size_t>(window.offset + window.size - offset);
+	return window.base + (offset - window.offset);
+}
+
+void MmapBlockDevice::unmapAll() {
+	for(const auto &window : m_windows) {
+		munmap(window.base, window.size);
+	}
+
+	m_windows.clear();
+}
@@ -0,0 +1,76 @@
+#ifndef FILESYSTEM_MMAP_BLOCK_DEVICE_H
+#define FILESYSTEM_MMAP_BLOCK_DEVICE_H
+
+#include "IBlockDevice.h"
+
+#include <filesystem>
+#include <vector>
+#include <cstdint>
+
+#include <unistd.h>
+
+/*
+ * Output image accessed through a shared memory mapping, so reads and writes
+ * are plain copies. With a window size of zero the whole image is mapped at
+ * once (falling back to windows if that does not fit into the address
+ * space); otherwise at most maxWindows windows of windowSize bytes are mapped
+ * at any time.
+ */
+class MmapBlockDevice final : public IBlockDevice {
+public:
+	static constexpr size_t DefaultWindowSize = 256 * 1024 * 1024;
+	static constexpr size_t DefaultMaxWindows = 4;
+
+	/*
+	 * keepContents opens an existing image as RawBlockDevice does.
+	 */
+	MmapBlockDevice(std::filesystem::path&& path, uint64_t size, size_t windowSize = 0, size_t maxWindows = DefaultMaxWindows, bool keepContents = false);
+	~MmapBlockDevice() override;
+
+	void read(uint64_t offset, void* buffer, size_t size) override;
+	void write(uint64_t offset, const void* buffer, size_t size) override;
+	void flush() override;
+	void copyFrom(int sourceFd, uint64_t sourceOffset, uint64_t offset, uint64_t size) override;
+	IBlockDevice* concurrentWriter() override;
+
+	uint64_t mediaSize() const override;
+	unsigned int allocationUnit() const override;
+
+private:
+	struct ManagedHandle {
+		ManagedHandle() : fd(-1) {
+
+		}
+
+		~ManagedHandle() {
+			if(fd >= 0)
+				close(fd);
+		}
+
+		ManagedHandle(const ManagedHandle &other) = delete;
+		ManagedHandle &operator =(const ManagedHandle &other) = delete;
+
+		int fd;
+	};
+
+	struct Window {
+		uint64_t offset;
+		size_t size;
+		unsigned char *base;
+		uint64_t lastUse;
+	};
+
+	void checkBounds(uint64_t offset, size_t size) const;
+	unsigned char *map(uint64_t offset, size_t &available);
+	void unmapAll();
+
+	ManagedHandle m_handle;
+	uint64_t m_mediaSize;
+	unsigned int m_allocationUnit;
+	size_t m_windowSize;
+	size_t m_maxWindows;
+	std::vector<Window> m_windows;
+	uint64_t m_useCounter;
+};
+
+#endif
@@ -0,0 +1,865 @@
+#include "NativeFATFilesystem.h"
+#include "IBlockDevice.h"
+#include "FATNames.h"
+#include "FATLayoutMap.h"
+
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <stdexcept>
+
+static constexpr unsigned char AttributeLongName = 0x0F;
+static constexpr uint32_t EndOfChain = 0x0FFFFFFF;
+static constexpr uint32_t MaxDirectoryEntries = 65536;
+
+static void storeWord(unsigned char* destination, uint16_t value) {
+	destination[0] = static_cast<unsigned char>(value);
+	destination[1] = static_cast<unsigned char>(value >> 8);
+}
+
+static void storeDword(unsigned char* destination, uint32_t value) {
+	storeWord(destination, static_cast<uint16_t>(value));
+	storeWord(destination + 2, static_cast<uint16_t>(value >> 16));
+}
+
+static void storeLongNameEntry(unsigned char* entry, const std::u16string& name, unsigned int order, bool last, unsigned char checksum) {
+	static const unsigned char characterOffsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
+	entry[0] = static_cast<unsigned char>(order | (last ? 0x40 : 0));
+	entry[11] = AttributeLongName;
+	entry[12] = 0;
+	entry[13] = checksum;
+	storeWord(entry + 26, 0);
+
+	/*
+	 * The name is terminated by a 0 if it does not fill the entry, and the
+	 * rest is padded with 0xFFFF.
+	 */
+	size_t index = (order - 1) * 13;
+	uint16_t character = 0;
+
+	for (auto offset : characterOffsets) {
+		if (character != 0xFFFF)
+			character = index < name.size() ? name[index++] : 0;
+
+		storeWord(entry + offset, character);
+
+		if (character == 0)
+			character = 0xFFFF;
+	}
+}
+
+NativeFATFilesystem::NativeFATFilesystem(std::unique_ptr<IBlockDevice>&& storage, const FATFilesystemLayout &layout, const FATVolumeParameters& parameters) : m_storage(std::move(storage)), m_pinnedClusters(0) {
+	m_geometry = FATVolumeGeometry::planForDevice(m_storage->mediaSize(), m_storage->allocationUnit(), parameters);
+
+	m_geometry.formatMBR(m_mbr);
+	layout.installMBRCode(m_mbr);
+
+	/*
+	 * The FAT32 root directory cluster is filled in by flush(). The backup
+	 * boot sector stays without boot code, like the one written by f_mkfs.
+	 */
+	m_geometry.formatBootSector(m_bootSector, get_fattime(), 2);
+	memcpy(m_backupBootSector, m_bootSector, sizeof(m_bootSector));
+	layout.installPBRCode(m_bootSector);
+	layout.installPBRCode32Continuation(m_bootContinuation);
+
+	m_fat.assign(static_cast<size_t>(m_geometry.clusterCount) + 2, 0);
+	m_fat[0] = 0xFFFFFFF8;
+	m_fat[1] = 0xFFFFFFFF;
+	m_freeClusters = m_geometry.clusterCount;
+	m_nextFree = 2;
+	m_lastAllocated = 2;
+
+	m_root.attributes = AM_DIR;
+}
+
+NativeFATFilesystem::~NativeFATFilesystem() = default;
+
+NativeFATFilesystem::PathLookup NativeFATFilesystem::lookup(const FatfsString& path) {
+	auto names = splitFATPath(path);
+
+	PathLookup result;
+	result.directory = nullptr;
+	result.node = &m_root;
+
+	for (auto& name : names) {
+		if (!result.node)
+			throw std::runtime_error("path not found: " + fatfsStringToUtf8String(path));
+
+		if (!result.node->isDirectory())
+			throw std::runtime_error("not a directory in path: " + fatfsStringToUtf8String(path));
+
+		result.directory = result.node;
+		result.name = std::move(name);
+		makeFATShortName(result.name, result.shortName.name, result.shortName.flags);
+
+		/*
+		 * Like fatfs, match the long name case-insensitively, or the short
+		 * name when the name given converts to one without loss.
+		 */
+		result.node = nullptr;
+
+		auto byLongName = result.directory->childrenByLongName.find(foldFATName(result.name));
+		if (byLongName != result.directory->childrenByLongName.end()) {
+			result.node = byLongName->second;
+		}
+		else if (!(result.shortName.flags & FATNameLossy)) {
+			auto byShortName = result.directory->childrenByShortName.find(std::string(reinterpret_cast<const char*>(result.shortName.name), 11));
+			if (byShortName != result.directory->childrenByShortName.end())
+				result.node = byShortName->second;
+		}
+	}
+
+	return result;
+}
+
+NativeFATFilesystem::Node* NativeFATFilesystem::addChild(Node* directory, const FatfsString& path, const std::u16string& name, const ShortName& shortName, unsigned char attributes) {
+	auto node = std::make_unique<Node>();
+	node->parent = directory;
+	node->path = path;
+	node->longName = name;
+	node->attributes = attributes;
+	node->needsLongName = (shortName.flags & FATNameNeedsLong) != 0;
+	node->caseFlags = shortName.flags & (FATNameLowerBody | FATNameLowerExtension);
+	memcpy(node->shortName, shortName.name, sizeof(node->shortName));
+
+	if (shortName.flags & FATNameLossy) {
+		unsigned int sequence;
+
+		for (sequence = 1; sequence < 100; sequence++) {
+			numberFATShortName(node->shortName, shortName.name, name, sequence);
+
+			if (directory->childrenByShortName.count(std::string(reinterpret_cast<const char*>(node->shortName), 11)) == 0)
+				break;
+		}
+
+		if (sequence == 100)
+			throw std::runtime_error("too many short name collisions");
+	}
+
+	uint32_t entries = 1;
+	if (node->needsLongName)
+		entries += static_cast<uint32_t>((name.size() + 12) / 13);
+
+	uint32_t capacity = MaxDirectoryEntries;
+	if (directory == &m_root && m_geometry.type != FATVolumeGeometry::Type::FAT32)
+		capacity = m_geometry.rootEntries;
+
+	if (directory->entryCount + entries > capacity)
+		throw std::runtime_error("directory is full");
+
+	directory->entryCount += entries;
+
+	if (node->isDirectory())
+		node->entryCount = 2;
+
+	auto pin = m_pins.find(path);
+	if (pin != m_pins.end()) {
+		if (pin->second.directory == node->isDirectory()) {
+			node->order = pin->second.order;
+			node->pins = std::move(pin->second.runs);
+		}
+		else {
+			unpin(pin->second.runs);
+		}
+
+		m_pins.erase(pin);
+	}
+
+	auto child = node.get();
+	directory->childrenByLongName.emplace(foldFATName(name), child);
+	directory->childrenByShortName.emplace(std::string(reinterpret_cast<const char*>(child->shortName), 11), child);
+	directory->children.emplace_back(std::move(node));
+
+	return child;
+}
+
+bool NativeFATFilesystem::createDirectory(const FatfsString& name) {
+	auto target = lookup(name);
+	if (target.node)
+		return false;
+
+	auto node = addChild(target.directory, name, target.name, target.shortName, AM_DIR);
+	node->modifiedTime = get_fattime();
+
+	return true;
+}
+
+std::unique_ptr<IFile> NativeFATFilesystem::open(const FatfsString& name, const FatfsString& mode) {
+	bool exclusive;
+
+	if (mode == FF_T("w"))
+		exclusive = false;
+	else if (mode == FF_T("wx"))
+		exclusive = true;
+	else
+		throw std::logic_error("unsupported mode");
+
+	auto target = lookup(name);
+	if (!target.directory)
+		throw std::runtime_error("invalid file name");
+
+	auto node = target.node;
+
+	if (node) {
+		if (exclusive)
+			throw std::runtime_error("file already exists: " + fatfsStringToUtf8String(name));
+
+		if (node->attributes & (AM_RDO | AM_DIR))
+			throw std::runtime_error("access denied: " + fatfsStringToUtf8String(name));
+
+		freeChain(node->firstCluster);
+		node->firstCluster = 0;
+		node->size = 0;
+		node->attributes = AM_ARC;
+	}
+	else {
+		node = addChild(target.directory, name, target.name, target.shortName, AM_ARC);
+	}
+
+	node->createdTime = get_fattime();
+	node->modifiedTime = node->createdTime;
+
+	return std::make_unique<NativeFile>(this, node);
+}
+
+void NativeFATFilesystem::setAttributes(const FatfsString& name, unsigned int attributes, unsigned int attributeMask) {
+	auto target = lookup(name);
+	if (!target.directory)
+		throw std::runtime_error("invalid file name");
+
+	if (!target.node)
+		throw std::runtime_error("file not found: " + fatfsStringToUtf8String(name));
+
+	attributeMask &= AM_RDO | AM_HID | AM_SYS | AM_ARC;
+
+	target.node->attributes = static_cast<unsigned char>((target.node->attributes & ~attributeMask) | (attributes & attributeMask));
+}
+
+void NativeFATFilesystem::remove(const FatfsString& name) {
+	auto target = lookup(name);
+	if (!target.directory)
+		throw std::runtime_error("invalid file name");
+
+	auto node = target.node;
+	if (!node)
+		throw std::runtime_error("file not found: " + fatfsStringToUtf8String(name));
+
+	if ((node->attributes & AM_RDO) || !node->children.empty())
+		throw std::runtime_error("access denied: " + fatfsStringToUtf8String(name));
+
+	auto directory = target.directory;
+	directory->entryCount -= 1;
+	if (node->needsLongName)
+		directory->entryCount -= static_cast<uint32_t>((node->longName.size() + 12) / 13);
+
+	directory->childrenByLongName.erase(foldFATName(node->longName));
+	directory->childrenByShortName.erase(std::string(reinterpret_cast<const char*>(node->shortName), 11));
+	freeChain(node->firstCluster);
+
+	auto child = std::find_if(directory->children.begin(), directory->children.end(), [node](const auto& child) { return child.get() == node; });
+	directory->children.erase(child);
+}
+
+NativeFATFilesystem::Run NativeFATFilesystem::allocate(Node* node, uint32_t previous, uint32_t count) {
+	/*
+	 * The clusters pinned to the node come first, while they are still held.
+	 */
+	if (!node->pins.empty()) {
+		auto& run = node->pins.back();
+
+		if (m_pinnedClusters != 0 && m_pinned[run.first]) {
+			auto first = run.first;
+			auto length = std::min(run.second, count);
+
+			for (auto cluster = first; cluster < first + length; cluster++)
+				m_pinned[cluster] = 0;
+
+			m_pinnedClusters -= length;
+
+			run.first += length;
+			run.second -= length;
+			if (run.second == 0)
+				node->pins.pop_back();
+
+			link(previous, first, length);
+
+			return { first, length };
+		}
+
+		node->pins.clear();
+	}
+
+	/*
+	 * Out of other space, the pinned clusters give way.
+	 */
+	if (m_freeClusters == m_pinnedClusters && m_pinnedClusters != 0) {
+		std::fill(m_pinned.begin(), m_pinned.end(), 0);
+		m_pinnedClusters = 0;
+		m_pins.clear();
+	}
+
+	if (m_freeClusters == 0)
+		throw std::runtime_error("not enough free space in the image");
+
+	auto end = m_geometry.clusterCount + 2;
+
+	/*
+	 * Continue the chain in place when the next cluster is free, otherwise
+	 * take the next free cluster after the last allocation.
+	 */
+	uint32_t first;
+	if (previous != 0 && previous + 1 < end && available(previous + 1)) {
+		first = previous + 1;
+	}
+	else {
+		first = m_nextFree;
+		while (!available(first)) {
+			if (++first == end)
+				first = 2;
+		}
+	}
+
+	uint32_t length = 1;
+	while (length < count && first + length < end && available(first + length))
+		length++;
+
+	link(previous, first, length);
+
+	m_nextFree = first + length == end ? 2 : first + length;
+
+	return { first, length };
+}
+
+void NativeFATFilesystem::link(uint32_t previous, uint32_t first, uint32_t length) {
+	for (auto cluster = first; cluster < first + length - 1; cluster++)
+		m_fat[cluster] = cluster + 1;
+
+	m_fat[first + length - 1] = EndOfChain;
+
+	if (previous != 0)
+		m_fat[previous] = first;
+
+	m_freeClusters -= length;
+	m_lastAllocated = first + length - 1;
+}
+
+void NativeFATFilesystem::freeChain(uint32_t cluster) {
+	auto end = m_geometry.clusterCount + 2;
+
+	while (cluster >= 2 && cluster < end) {
+		auto next = m_fat[cluster];
+		m_fat[cluster] = 0;
+		m_freeClusters++;
+		cluster = next;
+	}
+}
+
+void NativeFATFilesystem::unpin(std::vector<Run>& runs) {
+	if (m_pinnedClusters != 0) {
+		for (const auto& run : runs) {
+			for (auto cluster = run.first; cluster < run.first + run.second; cluster++) {
+				if (m_pinned[cluster]) {
+					m_pinned[cluster] = 0;
+					m_pinnedClusters--;
+				}
+			}
+		}
+	}
+
+	runs.clear();
+}
+
+std::vector<NativeFATFilesystem::Run> NativeFATFilesystem::chainRuns(uint32_t cluster) const {
+	std::vector<Run> runs;
+
+	while (cluster >= 2 && cluster < m_fat.size()) {
+		uint32_t run = 1;
+		while (m_fat[cluster + run - 1] == cluster + run)
+			run++;
+
+		runs.emplace_back(cluster, run);
+		cluster = m_fat[cluster + run - 1];
+	}
+
+	return runs;
+}
+
+bool NativeFATFilesystem::pinLayout(const FATLayoutMap& previous) {
+	if (!m_root.children.empty())
+		throw std::logic_error("the layout has to be pinned before anything is created");
+
+	auto fat32 = m_geometry.type == FATVolumeGeometry::Type::FAT32;
+	if (previous.parameters.clusterSize != m_geometry.clusterSize() || (previous.parameters.types == FATVolumeParameters::Types::FAT32) != fat32)
+		return false;
+
+	m_pinned.assign(m_fat.size(), 0);
+
+	for (const auto& entry : previous.entries) {
+		Pin pin{ entry.second.directory, entry.second.order, {} };
+
+		/*
+		 * Only the part of the chain that is still inside the volume and not
+		 * claimed twice is kept.
+		 */
+		for (const auto& run : entry.second.runs) {
+			uint32_t length = 0;
+			while (length < run.second && run.first >= 2 && run.first + length < m_fat.size() && !m_pinned[run.first + length])
+				length++;
+
+			if (length != 0) {
+				for (auto cluster = run.first; cluster < run.first + length; cluster++)
+					m_pinned[cluster] = 1;
+
+				m_pinnedClusters += length;
+				pin.runs.emplace_back(run.first, length);
+			}
+
+			if (length != run.second)
+				break;
+		}
+
+		std::reverse(pin.runs.begin(), pin.runs.end());
+
+		if (entry.first == "/") {
+			m_root.pins = std::move(pin.runs);
+		}
+		else {
+			m_pins.emplace(utf8StringToFatfsString(entry.first), std::move(pin));
+		}
+	}
+
+	return true;
+}
+
+FATLayoutMap NativeFATFilesystem::layoutMap() const {
+	FATLayoutMap map;
+
+	auto fat32 = m_geometry.type == FATVolumeGeometry::Type::FAT32;
+	map.mediaSize = m_storage->mediaSize();
+	map.parameters.types = fat32 ? FATVolumeParameters::Types::FAT32 : FATVolumeParameters::Types::FAT;
+	map.parameters.fatCount = m_geometry.fatCount;
+	map.parameters.rootEntries = fat32 ? 0 : m_geometry.rootEntries;
+	map.parameters.clusterSize = m_geometry.clusterSize();
+
+	map.entries.emplace("/", FATLayoutMap::Entry{ true, 0, chainRuns(m_root.firstCluster) });
+
+	std::vector<const Node*> directories{ &m_root };
+	for (size_t index = 0; index < directories.size(); index++) {
+		uint32_t order = 0;
+
+		for (const auto& child : directories[index]->children) {
+			map.entries.emplace(fatfsStringToUtf8String(child->path), FATLayoutMap::Entry{ child->isDirectory(), order++, chainRuns(child->firstCluster) });
+
+			if (child->isDirectory())
+				directories.push_back(child.get());
+		}
+	}
+
+	return map;
+}
+
+uint32_t NativeFATFilesystem::directoryClusters(const Node* directory) const {
+	auto bytes = static_cast<uint64_t>(directory->entryCount) * FATVolumeGeometry::EntrySize;
+
+	return std::max<uint32_t>(static_cast<uint32_t>((bytes + m_geometry.clusterSize() - 1) / m_geometry.clusterSize()), 1);
+}
+
+void NativeFATFilesystem::renderDirectory(const Node* directory, unsigned char* entries) const {
+	auto entry = entries;
+
+	auto storeCluster = [this](unsigned char* entry, uint32_t cluster) {
+		storeWord(entry + 26, static_cast<uint16_t>(cluster));
+
+		if (m_geometry.type == FATVolumeGeometry::Type::FAT32)
+			storeWord(entry + 20, static_cast<uint16_t>(cluster >> 16));
+	};
+
+	if (directory != &m_root) {
+		memset(entry, ' ', 11);
+		entry[0] = '.';
+		entry[11] = AM_DIR;
+		storeDword(entry + 22, directory->modifiedTime);
+		storeCluster(entry, directory->firstCluster);
+		entry += FATVolumeGeometry::EntrySize;
+
+		memset(entry, ' ', 11);
+		entry[0] = '.';
+		entry[1] = '.';
+		entry[11] = AM_DIR;
+		storeDword(entry + 22, directory->modifiedTime);
+		storeCluster(entry, directory->parent == &m_root ? 0 : directory->parent->firstCluster);
+		entry += FATVolumeGeometry::EntrySize;
+	}
+
+	for (const auto& child : directory->children) {
+		if (child->needsLongName) {
+			auto count = static_cast<unsigned int>((child->longName.size() + 12) / 13);
+			auto checksum = fatShortNameChecksum(child->shortName);
+
+			for (auto order = count; order != 0; order--) {
+				storeLongNameEntry(entry, child->longName, order, order == count, checksum);
+				entry += FATVolumeGeometry::EntrySize;
+			}
+		}
+
+		memcpy(entry, child->shortName, 11);
+		entry[11] = child->attributes;
+		entry[12] = child->caseFlags;
+
+		if (!child->isDirectory()) {
+			storeDword(entry + 14, child->createdTime);
+			storeDword(entry + 28, child->size);
+		}
+
+		storeDword(entry + 22, child->modifiedTime);
+		storeCluster(entry, child->firstCluster);
+		entry += FATVolumeGeometry::EntrySize;
+	}
+}
+
+std::vector<unsigned char> NativeFATFilesystem::renderFAT() const {
+	std::vector<unsigned char> table(static_cast<size_t>(m_geometry.fatSectors) * FATVolumeGeometry::SectorSize);
+
+	switch (m_geometry.type) {
+	case FATVolumeGeometry::Type::FAT12:
+		for (size_t cluster = 0; cluster < m_fat.size(); cluster++) {
+			auto value = m_fat[cluster] & 0xFFF;
+			auto destination = &table[cluster + cluster / 2];
+
+			if (cluster & 1) {
+				destination[0] = static_cast<unsigned char>((destination[0] & 0x0F) | (value << 4));
+				destination[1] = static_cast<unsigned char>(value >> 4);
+			}
+			else {
+				destination[0] = static_cast<unsigned char>(value);
+				destination[1] = static_cast<unsigned char>((destination[1] & 0xF0) | (value >> 8));
+			}
+		}
+		break;
+
+	case FATVolumeGeometry::Type::FAT16:
+		for (size_t cluster = 0; cluster < m_fat.size(); cluster++)
+			storeWord(&table[cluster * 2], static_cast<uint16_t>(m_fat[cluster]));
+		break;
+
+	case FATVolumeGeometry::Type::FAT32:
+		for (size_t cluster = 0; cluster < m_fat.size(); cluster++)
+			storeDword(&table[cluster * 4], m_fat[cluster]);
+		break;
+	}
+
+	return table;
+}
+
+void NativeFATFilesystem::flush() {
+	auto clusterSize = m_geometry.clusterSize();
+	auto fat32 = m_geometry.type == FATVolumeGeometry::Type::FAT32;
+
+	std::vector<Node*> directories{ &m_root };
+	for (size_t index = 0; index < directories.size(); index++) {
+		for (const auto& child : directories[index]->children) {
+			if (child->isDirectory())
+				directories.push_back(child.get());
+		}
+	}
+
+	/*
+	 * Directories are placed anew on every flush, so they can grow freely
+	 * until then and end up after the file contents.
+	 */
+	for (auto directory : directories) {
+		freeChain(directory->firstCluster);
+		directory->firstCluster = 0;
+	}
+
+	/*
+	 * Entries kept from a previous layout stay in their old order, and new
+	 * ones follow.
+	 */
+	if (!m_pinned.empty()) {
+		for (auto directory : directories) {
+			std::stable_sort(directory->children.begin(), directory->children.end(), [](const auto& a, const auto& b) { return a->order < b->order; });
+		}
+	}
+
+	for (auto directory : directories) {
+		if (directory == &m_root && !fat32)
+			continue;
+
+		auto remaining = directoryClusters(directory);
+		uint32_t last = 0;
+
+		while (remaining != 0) {
+			auto run = allocate(directory, last, remaining);
+
+			if (directory->firstCluster == 0)
+				directory->firstCluster = run.first;
+
+			last = run.first + run.second - 1;
+			remaining -= run.second;
+		}
+
+		unpin(directory->pins);
+	}
+
+	struct Piece {
+		uint64_t offset;
+		const unsigned char* data;
+		size_t size;
+	};
+
+	std::vector<Piece> pieces;
+	std::deque<std::vector<unsigned char>> buffers;
+	static constexpr uint64_t SectorSize = FATVolumeGeometry::SectorSize;
+
+	uint64_t volumeStart = m_geometry.volumeStart * SectorSize;
+
+	pieces.push_back({ 0, m_mbr, sizeof(m_mbr) });
+	pieces.push_back({ volumeStart, m_bootSector, sizeof(m_bootSector) });
+
+	if (fat32) {
+		storeDword(m_bootSector + 44, m_root.firstCluster);
+		storeDword(m_backupBootSector + 44, m_root.firstCluster);
+
+		auto& fsInfo = buffers.emplace_back(SectorSize);
+		m_geometry.formatFSInfo(fsInfo.data(), m_freeClusters, m_lastAllocated);
+
+		pieces.push_back({ volumeStart + 1 * SectorSize, fsInfo.data(), fsInfo.size() });
+		pieces.push_back({ volumeStart + 2 * SectorSize, m_bootContinuation, sizeof(m_bootContinuation) });
+		pieces.push_back({ volumeStart + 6 * SectorSize, m_backupBootSector, sizeof(m_backupBootSector) });
+		pieces.push_back({ volumeStart + 7 * SectorSize, fsInfo.data(), fsInfo.size() });
+	}
+
+	auto& fat = buffers.emplace_back(renderFAT());
+	for (uint32_t copy = 0; copy < m_geometry.fatCount; copy++) {
+		pieces.push_back({ (m_geometry.fatStart() + static_cast<uint64_t>(copy) * m_geometry.fatSectors) * SectorSize, fat.data(), fat.size() });
+	}
+
+	for (auto directory : directories) {
+		if (directory == &m_root && !fat32) {
+			auto& entries = buffers.emplace_back(static_cast<size_t>(m_geometry.rootSectors) * SectorSize);
+			renderDirectory(directory, entries.data());
+			pieces.push_back({ m_geometry.rootStart() * SectorSize, entries.data(), entries.size() });
+			continue;
+		}
+
+		auto& entries = buffers.emplace_back(static_cast<size_t>(directoryClusters(directory)) * clusterSize);
+		renderDirectory(directory, entries.data());
+
+		size_t position = 0;
+		auto cluster = directory->firstCluster;
+
+		while (position < entries.size()) {
+			uint32_t run = 1;
+			while (m_fat[cluster + run - 1] == cluster + run)
+				run++;
+
+			auto size = std::min<size_t>(static_cast<size_t>(run) * clusterSize, entries.size() - position);
+			pieces.push_back({ m_geometry.clusterOffset(cluster), entries.data() + position, size });
+
+			position += size;
+			cluster = m_fat[cluster + run - 1];
+		}
+	}
+
+	/*
+	 * Write everything in ascending order, merging adjacent pieces.
+	 */
+	std::sort(pieces.begin(), pieces.end(), [](const Piece& a, const Piece& b) { return a.offset < b.offset; });
+
+	std::vector<IBlockDevice::WriteSegment> segments;
+
+	for (size_t index = 0; index < pieces.size(); ) {
+		auto offset = pieces[index].offset;
+		auto end = offset;
+
+		segments.clear();
+
+		while (index < pieces.size() && pieces[index].offset == end) {
+			segments.push_back({ pieces[index].data, pieces[index].size });
+			end += pieces[index].size;
+			index++;
+		}
+
+		m_storage->writeGather(offset, segments.data(), segments.size());
+	}
+
+	m_storage->flush();
+}
+
+size_t NativeFATFilesystem::clusterSize() const {
+	return m_geometry.clusterSize();
+}
+
+IBlockDevice* NativeFATFilesystem::storage() {
+	return m_storage.get();
+}
+
+NativeFATFilesystem::NativeFile::NativeFile(NativeFATFilesystem* parent, Node* node) :
+	m_parent(parent), m_node(node), m_lastCluster(0), m_tailKnown(true) {
+
+}
+
+NativeFATFilesystem::NativeFile::~NativeFile() {
+	/*
+	 * What the file no longer takes is free for others.
+	 */
+	m_parent->unpin(m_node->pins);
+}
+
+int64_t NativeFATFilesystem::NativeFile::seek(int64_t offset, SeekWhence whence) {
+	int64_t target;
+
+	switch (whence) {
+	case SeekWhence::Begin:
+		target = offset;
+		break;
+
+	case SeekWhence::Current:
+	case SeekWhence::End:
+		target = static_cast<int64_t>(m_node->size) + offset;
+		break;
+
+	default:
+		throw std::logic_error("bad SeekWhence");
+	}
+
+	if (target != static_cast<int64_t>(m_node->size))
+		throw std::logic_error("files are only written sequentially");
+
+	return target;
+}
+
+size_t NativeFATFilesystem::NativeFile::read(void* data, size_t size) {
+	(void)data;
+	(void)size;
+
+	throw std::logic_error("files cannot be read back");
+}
+
+void NativeFATFilesystem::NativeFile::appendRun(const Run& run) {
+	if (m_node->firstCluster == 0)
+		m_node->firstCluster = run.first;
+
+	m_lastCluster = run.first + run.second - 1;
+}
+
+void NativeFATFilesystem::NativeFile::writeTail(size_t begin, size_t end) {
+	static constexpr size_t SectorSize = FATVolumeGeometry::SectorSize;
+
+	begin = begin / SectorSize * SectorSize;
+	end = (end + SectorSize - 1) / SectorSize * SectorSize;
+
+	m_parent->m_storage->write(m_parent->m_geometry.clusterOffset(m_lastCluster) + begin, m_tail.data() + begin, end - begin);
+}
+
+size_t NativeFATFilesystem::NativeFile::write(const void* data, size_t size) {
+	if (size == 0)
+		return 0;
+
+	if (size > std::numeric_limits<uint32_t>::max() - m_node->size)
+		throw std::runtime_error("file is too large");
+
+	size_t clusterSize = m_parent->m_geometry.clusterSize();
+	auto in = static_cast<const unsigned char*>(data);
+	auto remaining = size;
+
+	/*
+	 * The last, partial cluster is kept in m_tail and rewritten as it fills
+	 * up; whole clusters go to the storage straight from the caller.
+	 */
+	auto used = m_node->size % clusterSize;
+	if (used != 0) {
+		if (!m_tailKnown)
+			throw std::logic_error("cannot append to a preallocated file");
+
+		auto piece = std::min(clusterSize - used, remaining);
+		memcpy(m_tail.data() + used, in, piece);
+		writeTail(used, used + piece);
+
+		in += piece;
+		remaining -= piece;
+		m_node->size += static_cast<uint32_t>(piece);
+	}
+
+	while (remaining >= clusterSize) {
+		auto run = m_parent->allocate(m_node, m_lastCluster, static_cast<uint32_t>(remaining / clusterSize));
+		auto bytes = static_cast<size_t>(run.second) * clusterSize;
+
+		m_parent->m_storage->write(m_parent->m_geometry.clusterOffset(run.first), in, bytes);
+		appendRun(run);
+
+		in += bytes;
+		remaining -= bytes;
+		m_node->size += static_cast<uint32_t>(bytes);
+	}
+
+	if (remaining != 0) {
+		appendRun(m_parent->allocate(m_node, m_lastCluster, 1));
+
+		m_tail.assign(clusterSize, 0);
+		memcpy(m_tail.data(), in, remaining);
+		writeTail(0, remaining);
+
+		m_node->size += static_cast<uint32_t>(remaining);
+	}
+
+	m_node->modifiedTime = get_fattime();
+
+	return size;
+}
+
+void NativeFATFilesystem::NativeFile::preallocate(uint64_t size) {
+	if (size == 0)
+		return;
+
+	if (m_node->size != 0)
+		throw std::logic_error("only empty files can be preallocated");
+
+	if (size > std::numeric_limits<uint32_t>::max())
+		throw std::runtime_error("file is too large");
+
+	uint64_t clusterSize = m_parent->m_geometry.clusterSize();
+	auto remaining = static_cast<uint32_t>((size + clusterSize - 1) / clusterSize);
+
+	if (remaining > m_parent->m_freeClusters)
+		throw std::runtime_error("not enough free space for the file");
+
+	while (remaining != 0) {
+		auto run = m_parent->allocate(m_node, m_lastCluster, remaining);
+		appendRun(run);
+		remaining -= run.second;
+	}
+
+	m_node->size = static_cast<uint32_t>(size);
+	m_node->modifiedTime = get_fattime();
+	m_tailKnown = false;
+}
+
+std::vector<IFile::Extent> NativeFATFilesystem::NativeFile::extents() {
+	std::vector<Extent> extents;
+
+	const auto& fat = m_parent->m_fat;
+	uint64_t clusterSize = m_parent->m_geometry.clusterSize();
+	uint64_t remaining = m_node->size;
+	auto cluster = m_node->firstCluster;
+
+	while (remaining != 0) {
+		if (cluster < 2 || cluster >= fat.size())
+			throw std::runtime_error("cluster chain is shorter than the file");
+
+		uint32_t run = 1;
+		while (fat[cluster + run - 1] == cluster + run)
+			run++;
+
+		auto length = std::min<uint64_t>(run * clusterSize, remaining);
+		extents.push_back({ m_parent->m_geometry.clusterOffset(cluster), length });
+
+		remaining -= length;
+		cluster = fat[cluster + run - 1];
+	}
+
+	return extents;
+}
@@ -0,0 +1,179 @@
+#ifndef FILESYSTEM_NATIVE_FAT_FILESYSTEM_H
+#define FILESYSTEM_NATIVE_FAT_FILESYSTEM_H
+
+#include "IFilesystem.h"
+#include "IFile.h"
+#include "StringUtils.h"
+#include "FATFilesystemLayout.h"
+#include "FATVolumeGeometry.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+#include <unordered_map>
+
+#include <ff.h>
+
+class IBlockDevice;
+struct FATLayoutMap;
+
+/*
+ * Composes a FAT volume without going through fatfs. The FAT and the
+ * directory tree are kept in memory and written out by flush() in a single
+ * ascending pass, while file contents go to the storage as they are written,
+ * in whole cluster runs. Files can only be created and written sequentially.
+ *
+ * The geometry, names and directory entries are the ones FATFilesystem
+ * produces, so both build volumes with the same contents.
+ */
+class NativeFATFilesystem final : public IFilesystem {
+public:
+	explicit NativeFATFilesystem(std::unique_ptr<IBlockDevice>&& storage, const FATFilesystemLayout &layout = FATFilesystemLayout(), const FATVolumeParameters& parameters = FATVolumeParameters());
+	~NativeFATFilesystem() override;
+
+	bool createDirectory(const FatfsString& name) override;
+	std::unique_ptr<IFile> open(const FatfsString& name, const FatfsString& mode) override;
+	void setAttributes(const FatfsString& name, unsigned int attributes, unsigned int attributeMask) override;
+	void remove(const FatfsString& name) override;
+	void flush() override;
+
+	size_t clusterSize() const override;
+	IBlockDevice* storage() override;
+
+	/*
+	 * Keeps the directories and files created from now on where the
+	 * previous layout map places them, as far as they still take the space:
+	 * other data goes around their clusters, and their entries come first,
+	 * in their old order. Growth goes to free space, and pinned clusters are
+	 * given up when there is no free space left. Pins nothing and returns
+	 * false when the map is of a volume with another cluster size or FAT
+	 * type.
+	 */
+	bool pinLayout(const FATLayoutMap& previous);
+
+	/*
+	 * The layout of the volume as of the last flush().
+	 */
+	FATLayoutMap layoutMap() const;
+
+private:
+	using Run = std::pair<uint32_t, uint32_t>;
+
+	static constexpr uint32_t NoOrder = UINT32_MAX;
+
+	struct ShortName {
+		unsigned char name[11];
+		unsigned char flags;
+	};
+
+	struct Node {
+		Node* parent = nullptr;
+		std::u16string longName;
+		unsigned char shortName[11] = {};
+		unsigned char caseFlags = 0;
+		bool needsLongName = false;
+		unsigned char attributes = 0;
+		uint32_t createdTime = 0;
+		uint32_t modifiedTime = 0;
+		uint32_t firstCluster = 0;
+		uint32_t size = 0;
+
+		/*
+		 * The path the node was created with, and where the previous layout
+		 * had it: its position in the directory and its remaining pinned
+		 * runs, last first.
+		 */
+		FatfsString path;
+		uint32_t order = NoOrder;
+		std::vector<Run> pins;
+
+		/*
+		 * Directories only: entries used, and the children in creation order
+		 * (sorted by their previous order by flush() when a layout is
+		 * pinned), indexed by case-folded long name and by short name.
+		 */
+		uint32_t entryCount = 0;
+		std::vector<std::unique_ptr<Node>> children;
+		std::unordered_map<std::u16string, Node*> childrenByLongName;
+		std::unordered_map<std::string, Node*> childrenByShortName;
+
+		inline bool isDirectory() const {
+			return (attributes & AM_DIR) != 0;
+		}
+	};
+
+	struct Pin {
+		bool directory;
+		uint32_t order;
+		std::vector<Run> runs;
+	};
+
+	struct PathLookup {
+		Node* directory;
+		Node* node;
+		std::u16string name;
+		ShortName shortName;
+	};
+
+	class NativeFile final : public IFile {
+	public:
+		NativeFile(NativeFATFilesystem* parent, Node* node);
+		~NativeFile() override;
+
+		int64_t seek(int64_t offset, SeekWhence whence) override;
+		size_t read(void* data, size_t size) override;
+		size_t write(const void* data, size_t size) override;
+		void preallocate(uint64_t size) override;
+		std::vector<Extent> extents() override;
+
+	private:
+		void appendRun(const Run& run);
+		void writeTail(size_t begin, size_t end);
+
+		NativeFATFilesystem* m_parent;
+		Node* m_node;
+		uint32_t m_lastCluster;
+		bool m_tailKnown;
+		std::vector<unsigned char> m_tail;
+	};
+
+	PathLookup lookup(const FatfsString& path);
+	Node* addChild(Node* directory, const FatfsString& path, const std::u16string& name, const ShortName& shortName, unsigned char attributes);
+
+	inline bool available(uint32_t cluster) const {
+		return m_fat[cluster] == 0 && (m_pinnedClusters == 0 || !m_pinned[cluster]);
+	}
+
+	Run allocate(Node* node, uint32_t previous, uint32_t count);
+	void link(uint32_t previous, uint32_t first, uint32_t length);
+	void freeChain(uint32_t cluster);
+	void unpin(std::vector<Run>& runs);
+	std::vector<Run> chainRuns(uint32_t cluster) const;
+
+	uint32_t directoryClusters(const Node* directory) const;
+	void renderDirectory(const Node* directory, unsigned char* entries) const;
+	std::vector<unsigned char> renderFAT() const;
+
+	std::unique_ptr<IBlockDevice> m_storage;
+	FATVolumeGeometry m_geometry;
+	unsigned char m_mbr[FATVolumeGeometry::SectorSize];
+	unsigned char m_bootSector[FATVolumeGeometry::SectorSize];
+	unsigned char m_backupBootSector[FATVolumeGeometry::SectorSize];
+	unsigned char m_bootContinuation[FATVolumeGeometry::SectorSize];
+	std::vector<uint32_t> m_fat;
+	uint32_t m_freeClusters;
+	uint32_t m_nextFree;
+	uint32_t m_lastAllocated;
+	Node m_root;
+
+	/*
+	 * Clusters held for the nodes of a previous layout, and the pins of the
+	 * paths not created yet.
+	 */
+	std::vector<unsigned char> m_pinned;
+	uint32_t m_pinnedClusters;
+	std::unordered_map<FatfsString, Pin> m_pins;
+};
+
+#endif
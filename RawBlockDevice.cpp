@@ -4,18 +4,23 @@
 #include <Windows.h>
 #include <comdef.h>
 #else
+#include "FileTransfer.h"
+
 #include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
 #include <system_error>
+#include <vector>
 #endif
 
-RawBlockDevice::RawBlockDevice(std::filesystem::path&& path, uint64_t size) : m_mediaSize(size), m_allocationUnit(512) {
+RawBlockDevice::RawBlockDevice(std::filesystem::path&& path, uint64_t size, bool keepContents) : m_mediaSize(size), m_allocationUnit(512), m_concurrent(false) {
 #if defined(_WIN32)
 	auto rawHandle = CreateFile(
 		path.c_str(),
 		GENERIC_READ | GENERIC_WRITE,
 		0,
 		nullptr,
-		CREATE_ALWAYS,
+		keepContents ? OPEN_EXISTING : CREATE_ALWAYS,
 		FILE_ATTRIBUTE_NORMAL,
 		nullptr);
 
@@ -37,13 +42,15 @@ RawBlockDevice::RawBlockDevice(std::filesystem::path&& path, uint64_t size) : m_
 			throw std::runtime_error("media size is out of range");
 	}
 
-	m_handle.fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	m_handle.fd = open(path.c_str(), keepContents ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
 	if(m_handle.fd < 0)
 		throw std::system_error(errno, std::generic_category());
 
 	auto result = ftruncate(m_handle.fd, m_mediaSize);
 	if(result < 0)
 		throw std::system_error(errno, std::generic_category());
+
+	m_allocationUnit = hostBlockSize(m_handle.fd);
 #endif
 }
 
@@ -134,6 +141,10 @@ void RawBlockDevice::doWrite(uint64_t offset, const void* buffer, size_t size) {
 	}
 }
 
+void RawBlockDevice::writeGather(uint64_t offset, const WriteSegment* segments, size_t count) {
+	IBlockDevice::writeGather(offset, segments, count);
+}
+
 void RawBlockDevice::flush() {
 	if (!FlushFileBuffers(m_handle.get()))
 		_com_raise_error(HRESULT_FROM_WIN32(GetLastError()));
@@ -174,14 +185,99 @@ void RawBlockDevice::write(uint64_t offset, const void* buffer, size_t size) {
 		throw std::runtime_error("short write");
 }
 
+void RawBlockDevice::writeGather(uint64_t offset, const WriteSegment* segments, size_t count) {
+	if constexpr (sizeof(offset) != sizeof(off_t)) {
+		if(offset > std::numeric_limits<off_t>::max())
+			throw std::runtime_error("offset is out of range");
+	}
+
+	uint64_t size = 0;
+	for(size_t index = 0; index < count; index++)
+		size += segments[index].size;
+
+	if(offset + size > m_mediaSize || offset + size < offset)
+		throw std::runtime_error("the access requested is out of the media bounds");
+
+	std::vector<iovec> vectors;
+
+	while(count > 0) {
+		auto batch = std::min<size_t>(count, IOV_MAX);
+
+		vectors.resize(batch);
+		size_t batchSize = 0;
+		for(size_t index = 0; index < batch; index++) {
+			vectors[index].iov_base = const_cast<void*>(segments[index].data);
+			vectors[index].iov_len = segments[index].size;
+			batchSize += segments[index].size;
+		}
+
+		auto result = pwritev(m_handle.fd, vectors.data(), static_cast<int>(batch), offset);
+		if(result < 0)
+			throw std::system_error(errno, std::generic_category());
+
+		if(static_cast<size_t>(result) != batchSize) {
+			/*
+			 * Short vectored write: finish the remainder of this batch
+			 * segment by segment.
+			 */
+			auto done = static_cast<size_t>(result);
+			for(size_t index = 0; index < batch; index++) {
+				auto segmentSize = segments[index].size;
+				if(done >= segmentSize) {
+					done -= segmentSize;
+					continue;
+				}
+
+				write(offset + result, static_cast<const unsigned char*>(segments[index].data) + done, segmentSize - done);
+				result += segmentSize - done;
+				done = 0;
+			}
+		}
+
+		offset += batchSize;
+		segments += batch;
+		count -= batch;
+	}
+}
+
 void RawBlockDevice::flush() {
 	auto result = fsync(m_handle.fd);
 	if(result < 0)
 		throw std::system_error(errno, std::generic_category());
 }
 
+void RawBlockDevice::copyFrom(int sourceFd, uint64_t sourceOffset, uint64_t offset, uint64_t size) {
+	if constexpr (sizeof(offset) != sizeof(off_t)) {
+		if(offset > std::numeric_limits<off_t>::max())
+			throw std::runtime_error("offset is out of range");
+	}
+
+	if(offset + size > m_mediaSize || offset + size < offset)
+		throw std::runtime_error("the access requested is out of the media bounds");
+
+	auto done = transferFileRange(sourceFd, sourceOffset, m_handle.fd, offset, size, !m_concurrent);
+	if(done != size)
+		IBlockDevice::copyFrom(sourceFd, sourceOffset + done, offset + done, size - done);
+}
+
 #endif
 
+IBlockDevice* RawBlockDevice::concurrentWriter() {
+#if defined(_WIN32)
+	/*
+	 * Unaligned writes go through the shared bounce buffer.
+	 */
+	return nullptr;
+#else
+	/*
+	 * pread and pwrite take their own offsets; only sendfile, which writes
+	 * at the file position, has to be kept out.
+	 */
+	m_concurrent = true;
+	return this;
+#endif
+}
+
 uint64_t RawBlockDevice::mediaSize() const {
 	return m_mediaSize;
 }
@@ -15,14 +15,24 @@
 #include <filesystem>
 #include <cstdint>
 
+/*
+ * Output image written with plain file I/O. The image is created empty
+ * unless keepContents is set, which opens an existing image of the given
+ * size for updating it in place.
+ */
 class RawBlockDevice final : public IBlockDevice {
 public:
-	RawBlockDevice(std::filesystem::path&& path, uint64_t size);
+	RawBlockDevice(std::filesystem::path&& path, uint64_t size, bool keepContents = false);
 	~RawBlockDevice() override;
 
 	void read(uint64_t offset, void* buffer, size_t size) override;
 	void write(uint64_t offset, const void* buffer, size_t size) override;
+	void writeGather(uint64_t offset, const WriteSegment* segments, size_t count) override;
 	void flush() override;
+#if !defined(_WIN32)
+	void copyFrom(int sourceFd, uint64_t sourceOffset, uint64_t offset, uint64_t size) override;
+#endif
+	IBlockDevice* concurrentWriter() override;
 
 	uint64_t mediaSize() const override;
 	virtual unsigned int allocationUnit() const override;
@@ -63,6 +73,7 @@ private:
 #endif
 	uint64_t m_mediaSize;
 	unsigned int m_allocationUnit;
+	bool m_concurrent;
 #if defined(_WIN32)
 #endif
 };
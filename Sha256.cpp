@@ -0,0 +1,138 @@
+#include "Sha256.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+static const uint32_t RoundConstants[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotateRight(uint32_t value, unsigned int count) {
+	return (value >> count) | (value << (32 - count));
+}
+
+Sha256::Sha256() : m_state{ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 },
+	m_length(0), m_buffered(0) {
+
+}
+
+void Sha256::update(const void* data, size_t size) {
+	auto in = static_cast<const uint8_t*>(data);
+	m_length += size;
+
+	if (m_buffered != 0) {
+		auto piece = std::min(size, sizeof(m_buffer) - m_buffered);
+		memcpy(m_buffer + m_buffered, in, piece);
+		m_buffered += piece;
+		in += piece;
+		size -= piece;
+
+		if (m_buffered < sizeof(m_buffer))
+			return;
+
+		transform(m_buffer);
+		m_buffered = 0;
+	}
+
+	while (size >= sizeof(m_buffer)) {
+		transform(in);
+		in += sizeof(m_buffer);
+		size -= sizeof(m_buffer);
+	}
+
+	memcpy(m_buffer, in, size);
+	m_buffered = size;
+}
+
+Sha256::Digest Sha256::finish() {
+	auto bits = m_length * 8;
+
+	static const uint8_t padding[64] = { 0x80 };
+	update(padding, m_buffered < 56 ? 56 - m_buffered : 120 - m_buffered);
+
+	uint8_t length[8];
+	for (unsigned int index = 0; index < 8; index++)
+		length[index] = static_cast<uint8_t>(bits >> (56 - index * 8));
+
+	update(length, sizeof(length));
+
+	Digest digest;
+	for (unsigned int index = 0; index < 8; index++) {
+		digest[index * 4] = static_cast<uint8_t>(m_state[index] >> 24);
+		digest[index * 4 + 1] = static_cast<uint8_t>(m_state[index] >> 16);
+		digest[index * 4 + 2] = static_cast<uint8_t>(m_state[index] >> 8);
+		digest[index * 4 + 3] = static_cast<uint8_t>(m_state[index]);
+	}
+
+	return digest;
+}
+
+std::string Sha256::hex(const Digest& digest) {
+	static const char digits[] = "0123456789abcdef";
+
+	std::string text;
+	text.reserve(digest.size() * 2);
+
+	for (auto byte : digest) {
+		text.push_back(digits[byte >> 4]);
+		text.push_back(digits[byte & 15]);
+	}
+
+	return text;
+}
+
+void Sha256::transform(const uint8_t* block) {
+	uint32_t schedule[64];
+
+	for (unsigned int index = 0; index < 16; index++) {
+		schedule[index] =
+			(static_cast<uint32_t>(block[index * 4]) << 24) |
+			(static_cast<uint32_t>(block[index * 4 + 1]) << 16) |
+			(static_cast<uint32_t>(block[index * 4 + 2]) << 8) |
+			static_cast<uint32_t>(block[index * 4 + 3]);
+	}
+
+	for (unsigned int index = 16; index < 64; index++) {
+		auto s0 = rotateRight(schedule[index - 15], 7) ^ rotateRight(schedule[index - 15], 18) ^ (schedule[index - 15] >> 3);
+		auto s1 = rotateRight(schedule[index - 2], 17) ^ rotateRight(schedule[index - 2], 19) ^ (schedule[index - 2] >> 10);
+		schedule[index] = schedule[index - 16] + s0 + schedule[index - 7] + s1;
+	}
+
+	auto a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+	auto e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+
+	for (unsigned int index = 0; index < 64; index++) {
+		auto s1 = rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25);
+		auto choice = (e & f) ^ (~e & g);
+		auto first = h + s1 + choice + RoundConstants[index] + schedule[index];
+		auto s0 = rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22);
+		auto majority = (a & b) ^ (a & c) ^ (b & c);
+		auto second = s0 + majority;
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + first;
+		d = c;
+		c = b;
+		b = a;
+		a = first + second;
+	}
+
+	m_state[0] += a;
+	m_state[1] += b;
+	m_state[2] += c;
+	m_state[3] += d;
+	m_state[4] += e;
+	m_state[5] += f;
+	m_state[6] += g;
+	m_state[7] += h;
+}
@@ -0,0 +1,39 @@
+#ifndef UTILITY_SHA256_H
+#define UTILITY_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <string>
+#include <string_view>
+
+class Sha256 {
+public:
+	typedef std::array<uint8_t, 32> Digest;
+
+	Sha256();
+
+	void update(const void* data, size_t size);
+
+	inline void update(std::string_view data) {
+		update(data.data(), data.size());
+	}
+
+	/*
+	 * Finishes the hash; update must not be called afterwards.
+	 */
+	Digest finish();
+
+	static std::string hex(const Digest& digest);
+
+private:
+	void transform(const uint8_t* block);
+
+	uint32_t m_state[8];
+	uint64_t m_length;
+	uint8_t m_buffer[64];
+	size_t m_buffered;
+};
+
+#endif
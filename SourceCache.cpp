@@ -0,0 +1,82 @@
+#include "SourceCache.h"
+#include "BuildState.h"
+
+SourceCache::SourceCache(size_t capacity) : m_capacity(capacity), m_size(0) {
+
+}
+
+SourceCache::~SourceCache() = default;
+
+SourceCache::Contents SourceCache::contents(const SourceInformation& source, const std::function<void(std::vector<unsigned char>& data)>& read) {
+	auto key = source.absolutePath.u8string();
+
+	std::promise<Contents> promise;
+
+	{
+		std::unique_lock<std::mutex> locker(m_mutex);
+
+		auto entry = m_entries.find(key);
+		if (entry != m_entries.end() && BuildState::sameSource(entry->second.source, source)) {
+			m_uses.splice(m_uses.end(), m_uses, entry->second.use);
+
+			auto contents = entry->second.contents;
+			locker.unlock();
+
+			return contents.get();
+		}
+
+		if (entry != m_entries.end()) {
+			m_size -= entry->second.size;
+			m_uses.erase(entry->second.use);
+			m_entries.erase(entry);
+		}
+
+		/*
+		 * Entries are accounted for at their full size while they are read,
+		 * so concurrent misses cannot overrun the capacity.
+		 */
+		auto size = static_cast<size_t>(source.size);
+		m_size += size;
+		m_entries.emplace(key, Entry{ source, promise.get_future().share(), m_uses.insert(m_uses.end(), key), size });
+
+		evict();
+	}
+
+	try {
+		auto data = std::make_shared<std::vector<unsigned char>>();
+		read(*data);
+
+		Contents contents = std::move(data);
+		promise.set_value(contents);
+
+		return contents;
+	}
+	catch (...) {
+		promise.set_exception(std::current_exception());
+
+		std::unique_lock<std::mutex> locker(m_mutex);
+
+		auto entry = m_entries.find(key);
+		if (entry != m_entries.end() && BuildState::sameSource(entry->second.source, source)) {
+			m_size -= entry->second.size;
+			m_uses.erase(entry->second.use);
+			m_entries.erase(entry);
+		}
+
+		throw;
+	}
+}
+
+void SourceCache::evict() {
+	/*
+	 * Readers hold on to the contents they were given, so dropping an entry
+	 * only stops it from being handed out again.
+	 */
+	while (m_size > m_capacity && !m_uses.empty()) {
+		auto entry = m_entries.find(m_uses.front());
+
+		m_size -= entry->second.size;
+		m_uses.pop_front();
+		m_entries.erase(entry);
+	}
+}
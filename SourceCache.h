@@ -0,0 +1,64 @@
+#ifndef SOURCE_CACHE_H
+#define SOURCE_CACHE_H
+
+#include "Inode.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Keeps the contents of the sources read by several builds in one process, so
+ * that a file going into many images is read from disk once. A source is
+ * known by its absolute path and served only while it is the same file of the
+ * same size and modification time. Sources used least recently are dropped
+ * beyond the capacity; larger files are never kept.
+ */
+class SourceCache {
+public:
+	static constexpr size_t DefaultCapacity = 256 * 1024 * 1024;
+
+	typedef std::shared_ptr<const std::vector<unsigned char>> Contents;
+
+	explicit SourceCache(size_t capacity = DefaultCapacity);
+	~SourceCache();
+
+	SourceCache(const SourceCache& other) = delete;
+	SourceCache &operator =(const SourceCache& other) = delete;
+
+	inline uint64_t maxFileSize() const {
+		return m_capacity / 16;
+	}
+
+	/*
+	 * The contents of the source, read into the vector by read when they are
+	 * not kept. Callers asking for a source that is being read wait for it
+	 * instead of reading it again.
+	 */
+	Contents contents(const SourceInformation& source, const std::function<void(std::vector<unsigned char>& data)>& read);
+
+private:
+	struct Entry {
+		SourceInformation source;
+		std::shared_future<Contents> contents;
+		std::list<std::string>::iterator use;
+		size_t size;
+	};
+
+	void evict();
+
+	size_t m_capacity;
+	std::mutex m_mutex;
+	size_t m_size;
+	std::list<std::string> m_uses;
+	std::unordered_map<std::string, Entry> m_entries;
+};
+
+#endif
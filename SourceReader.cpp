@@ -0,0 +1,254 @@
+#include "SourceReader.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static void readRange(const std::filesystem::path& path, uint64_t offset, unsigned char* data, size_t size) {
+	std::ifstream stream;
+	stream.exceptions(std::ios::failbit | std::ios::badbit | std::ios::eofbit);
+	stream.open(path, std::ios::in | std::ios::binary);
+	stream.exceptions(std::ios::badbit);
+
+	if (offset != 0)
+		stream.seekg(offset);
+
+	stream.read(reinterpret_cast<char*>(data), size);
+
+	if (static_cast<size_t>(stream.gcount()) != size)
+		throw std::runtime_error("source file was truncated while reading: " + path.u8string());
+}
+
+SourceReader::SourceReader(std::vector<Source>&& sources, ThreadPool* pool, Mode mode, size_t readAhead, size_t chunkSize, SourceCache* cache) :
+	m_sources(std::move(sources)), m_pool(pool), m_mode(mode), m_cache(cache), m_nextJob(0), m_released(0), m_inFlight(0), m_holding(false) {
+
+	chunkSize = std::max<size_t>(chunkSize, 1);
+
+	for (size_t source = 0; source < m_sources.size(); source++) {
+		uint64_t offset = 0;
+		auto size = m_sources[source].size;
+
+		if (m_sources[source].direct) {
+			m_jobs.push_back({ source, 0, size, true });
+			continue;
+		}
+
+		do {
+			auto chunk = static_cast<size_t>(std::min<uint64_t>(size - offset, chunkSize));
+			m_jobs.push_back({ source, offset, chunk, offset + chunk == size });
+			offset += chunk;
+		} while (offset < size);
+	}
+
+	size_t slots = 1;
+	if (m_pool) {
+		slots = std::max<size_t>(readAhead / chunkSize, m_pool->threadCount() + 1);
+	}
+
+	m_slots.resize(slots);
+	for (auto& slot : m_slots) {
+		slot.mapping = nullptr;
+		slot.mappingSize = 0;
+		slot.ready = false;
+	}
+
+	std::unique_lock<std::mutex> locker(m_mutex);
+	schedule();
+}
+
+SourceReader::~SourceReader() {
+	std::unique_lock<std::mutex> locker(m_mutex);
+	m_nextJob = m_jobs.size();
+	m_condition.wait(locker, [this]() { return m_inFlight == 0; });
+
+	for (auto& slot : m_slots) {
+		unmap(slot);
+	}
+}
+
+const SourceReader::Chunk& SourceReader::next() {
+	std::unique_lock<std::mutex> locker(m_mutex);
+
+	if (m_holding) {
+		m_slots[m_released % m_slots.size()].ready = false;
+		m_released++;
+		m_holding = false;
+
+		schedule();
+	}
+
+	if (m_released >= m_jobs.size())
+		throw std::logic_error("no more source data");
+
+	auto& slot = m_slots[m_released % m_slots.size()];
+
+	if (m_pool) {
+		m_condition.wait(locker, [&slot]() { return slot.ready; });
+	}
+	else {
+		locker.unlock();
+		readJob(m_released);
+		locker.lock();
+	}
+
+	m_holding = true;
+
+	if (slot.error)
+		std::rethrow_exception(slot.error);
+
+	return slot.chunk;
+}
+
+void SourceReader::schedule() {
+	if (!m_pool)
+		return;
+
+	while (m_nextJob < m_jobs.size() && m_nextJob - m_released < m_slots.size()) {
+		auto job = m_nextJob++;
+		m_inFlight++;
+
+		m_pool->submit([this, job]() {
+			readJob(job);
+
+			std::unique_lock<std::mutex> locker(m_mutex);
+			m_slots[job % m_slots.size()].ready = true;
+			m_inFlight--;
+			m_condition.notify_all();
+		});
+	}
+}
+
+void SourceReader::readJob(size_t job) {
+	const auto& description = m_jobs[job];
+	const auto& source = m_sources[description.source];
+	auto& slot = m_slots[job % m_slots.size()];
+
+	slot.error = nullptr;
+	slot.cached.reset();
+	unmap(slot);
+
+	try {
+		if (source.direct) {
+			slot.chunk.path = &source.path;
+			slot.chunk.data = nullptr;
+			slot.chunk.size = description.size;
+			slot.chunk.last = true;
+			slot.chunk.direct = true;
+			return;
+		}
+
+		slot.chunk.path = &source.path;
+		slot.chunk.size = description.size;
+		slot.chunk.last = description.last;
+		slot.chunk.direct = false;
+
+		if (m_cache && source.information && description.offset == 0 && description.last && description.size != 0 && description.size <= m_cache->maxFileSize()) {
+			slot.cached = m_cache->contents(*source.information, [&source](std::vector<unsigned char>& data) {
+				data.resize(static_cast<size_t>(source.size));
+				readRange(source.path, 0, data.data(), data.size());
+			});
+
+			slot.chunk.data = slot.cached->data();
+			return;
+		}
+
+		if (m_mode == Mode::Map && mapJob(job))
+			return;
+
+		slot.buffer.resize(static_cast<size_t>(description.size));
+
+		if (description.size != 0)
+			readRange(source.path, description.offset, slot.buffer.data(), slot.buffer.size());
+
+		slot.chunk.data = slot.buffer.data();
+	}
+	catch (...) {
+		slot.error = std::current_exception();
+	}
+}
+
+bool SourceReader::mapJob(size_t job) {
+#if defined(_WIN32)
+	(void)job;
+
+	return false;
+#else
+	const auto& description = m_jobs[job];
+	const auto& source = m_sources[description.source];
+	auto& slot = m_slots[job % m_slots.size()];
+
+	if (description.size == 0)
+		return false;
+
+	auto fd = open(source.path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category());
+
+	struct stat information;
+	if (fstat(fd, &information) < 0) {
+		auto error = errno;
+		close(fd);
+		throw std::system_error(error, std::generic_category());
+	}
+
+	/*
+	 * Touching a mapping beyond the end of the file raises SIGBUS, so a file
+	 * that shrank must be caught here rather than by the consumer.
+	 */
+	if (static_cast<uint64_t>(information.st_size) < description.offset + description.size) {
+		close(fd);
+		throw std::runtime_error("source file was truncated while reading: " + source.path.u8string());
+	}
+
+	static const uint64_t pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+	auto mapOffset = description.offset - description.offset % pageSize;
+	auto mapSize = static_cast<size_t>(description.offset - mapOffset + description.size);
+
+	int flags = MAP_PRIVATE;
+#if defined(MAP_POPULATE)
+	/*
+	 * Fault the whole chunk in here, on the reading thread, so the consumer
+	 * never waits for the disk.
+	 */
+	flags |= MAP_POPULATE;
+#endif
+
+	auto base = mmap(nullptr, mapSize, PROT_READ, flags, fd, static_cast<off_t>(mapOffset));
+	close(fd);
+
+	if (base == MAP_FAILED)
+		return false;
+
+	slot.mapping = base;
+	slot.mappingSize = mapSize;
+
+	slot.chunk.path = &source.path;
+	slot.chunk.data = static_cast<const unsigned char*>(base) + (description.offset - mapOffset);
+	slot.chunk.size = description.size;
+	slot.chunk.last = description.last;
+	slot.chunk.direct = false;
+
+	return true;
+#endif
+}
+
+void SourceReader::unmap(Slot& slot) {
+#if !defined(_WIN32)
+	if (slot.mapping) {
+		munmap(slot.mapping, slot.mappingSize);
+		slot.mapping = nullptr;
+		slot.mappingSize = 0;
+	}
+#else
+	(void)slot;
+#endif
+}
@@ -0,0 +1,111 @@
+#ifndef SOURCE_READER_H
+#define SOURCE_READER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <mutex>
+#include <vector>
+
+#include "SourceCache.h"
+
+class ThreadPool;
+
+/*
+ * Reads a fixed sequence of source files ahead of their consumer. Files are
+ * split into chunks, which are read on the thread pool into a bounded set of
+ * buffers and handed out strictly in order by next(). Without a thread pool,
+ * every chunk is read synchronously by next().
+ *
+ * Sources marked as direct are not read at all: they are handed out as a
+ * single chunk without data, for the consumer to copy by other means.
+ *
+ * In Map mode, chunks are memory mapped and faulted in instead of copied
+ * into buffers (falling back to reading where mapping fails). Mapping is not
+ * available on Windows, where Map behaves as Read.
+ *
+ * With a source cache, sources read in a single chunk that carry their
+ * information are taken from the cache, and read into it when missing.
+ */
+class SourceReader {
+public:
+	static constexpr size_t DefaultChunkSize = 4 * 1024 * 1024;
+	static constexpr size_t DefaultReadAhead = 64 * 1024 * 1024;
+
+	enum class Mode {
+		Read,
+		Map
+	};
+
+#if defined(_WIN32)
+	static constexpr Mode DefaultMode = Mode::Read;
+#else
+	static constexpr Mode DefaultMode = Mode::Map;
+#endif
+
+	struct Source {
+		std::filesystem::path path;
+		uint64_t size;
+		bool direct = false;
+		const SourceInformation* information = nullptr;
+	};
+
+	struct Chunk {
+		const std::filesystem::path* path;
+		const unsigned char* data;
+		uint64_t size;
+		bool last;
+		bool direct;
+	};
+
+	SourceReader(std::vector<Source>&& sources, ThreadPool* pool, Mode mode = DefaultMode, size_t readAhead = DefaultReadAhead, size_t chunkSize = DefaultChunkSize, SourceCache* cache = nullptr);
+	~SourceReader();
+
+	SourceReader(const SourceReader& other) = delete;
+	SourceReader &operator =(const SourceReader& other) = delete;
+
+	/*
+	 * Returns the next chunk. The chunk stays valid until the next call.
+	 */
+	const Chunk& next();
+
+private:
+	struct Job {
+		size_t source;
+		uint64_t offset;
+		uint64_t size;
+		bool last;
+	};
+
+	struct Slot {
+		std::vector<unsigned char> buffer;
+		SourceCache::Contents cached;
+		void* mapping;
+		size_t mappingSize;
+		Chunk chunk;
+		std::exception_ptr error;
+		bool ready;
+	};
+
+	void schedule();
+	void readJob(size_t job);
+	bool mapJob(size_t job);
+	void unmap(Slot& slot);
+
+	std::vector<Source> m_sources;
+	std::vector<Job> m_jobs;
+	ThreadPool* m_pool;
+	Mode m_mode;
+	SourceCache* m_cache;
+	std::vector<Slot> m_slots;
+
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	size_t m_nextJob;
+	size_t m_released;
+	size_t m_inFlight;
+	bool m_holding;
+};
+
+#endif
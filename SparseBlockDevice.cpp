@@ -0,0 +1,172 @@
+#include "SparseBlockDevice.h"
+#include "ZeroDetection.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+SparseBlockDevice::SparseBlockDevice(std::unique_ptr<IBlockDevice>&& storage, size_t minimumHole) :
+	m_storage(std::move(storage)), m_minimumHole(minimumHole) {
+
+}
+
+SparseBlockDevice::~SparseBlockDevice() = default;
+
+void SparseBlockDevice::read(uint64_t offset, void* buffer, size_t size) {
+	if (offset + size > m_storage->mediaSize() || offset + size < offset)
+		throw std::runtime_error("the access requested is out of the media bounds");
+
+	bool data;
+	{
+		std::unique_lock<std::mutex> locker(m_dataExtentsMutex);
+		data = m_dataExtents.intersects(offset, offset + size);
+	}
+
+	if (!data) {
+		memset(buffer, 0, size);
+		return;
+	}
+
+	m_storage->read(offset, buffer, size);
+}
+
+void SparseBlockDevice::write(uint64_t offset, const void* buffer, size_t size) {
+	WriteSegment segment{ buffer, size };
+
+	writeGather(offset, &segment, 1);
+}
+
+void SparseBlockDevice::writeGather(uint64_t offset, const WriteSegment* segments, size_t count) {
+	uint64_t size = 0;
+	for (size_t index = 0; index < count; index++)
+		size += segments[index].size;
+
+	if (offset + size > m_storage->mediaSize() || offset + size < offset)
+		throw std::runtime_error("the access requested is out of the media bounds");
+
+	/*
+	 * Splits the write into runs of zero and non-zero blocks. Zero runs that
+	 * only cover never-written ranges are dropped, as long as they are large
+	 * enough to be worth splitting the write for (or make up all of it).
+	 */
+	struct Run {
+		uint64_t offset;
+		uint64_t size;
+		bool zero;
+		bool drop;
+	};
+
+	std::vector<Run> runs;
+	auto position = offset;
+
+	for (size_t index = 0; index < count; index++) {
+		auto bytes = static_cast<const unsigned char*>(segments[index].data);
+		auto remaining = segments[index].size;
+
+		while (remaining > 0) {
+			auto chunk = std::min<size_t>(remaining, BlockSize - position % BlockSize);
+			auto zero = isZeroBuffer(bytes, chunk);
+
+			if (!runs.empty() && runs.back().zero == zero) {
+				runs.back().size += chunk;
+			}
+			else {
+				runs.push_back({ position, chunk, zero, false });
+			}
+
+			position += chunk;
+			bytes += chunk;
+			remaining -= chunk;
+		}
+	}
+
+	{
+		std::unique_lock<std::mutex> locker(m_dataExtentsMutex);
+
+		for (auto& run : runs) {
+			if (!run.zero)
+				m_dataExtents.add(run.offset, run.offset + run.size);
+			else
+				run.drop = (run.size >= m_minimumHole || run.size == size) && !m_dataExtents.intersects(run.offset, run.offset + run.size);
+		}
+	}
+
+	std::vector<WriteSegment> batch;
+	uint64_t batchOffset = offset;
+	size_t segment = 0;
+	size_t segmentOffset = 0;
+
+	auto emit = [this, &batch, &batchOffset]() {
+		if (!batch.empty()) {
+			m_storage->writeGather(batchOffset, batch.data(), batch.size());
+			batch.clear();
+		}
+	};
+
+	for (const auto& run : runs) {
+		if (run.drop)
+			emit();
+
+		if (batch.empty())
+			batchOffset = run.offset;
+
+		/*
+		 * Walk the source segments that make up this run.
+		 */
+		auto remaining = run.size;
+		while (remaining > 0) {
+			auto available = segments[segment].size - segmentOffset;
+			auto piece = static_cast<size_t>(std::min<uint64_t>(remaining, available));
+
+			if (!run.drop)
+				batch.push_back({ static_cast<const unsigned char*>(segments[segment].data) + segmentOffset, piece });
+
+			segmentOffset += piece;
+			remaining -= piece;
+
+			if (segmentOffset == segments[segment].size) {
+				segment++;
+				segmentOffset = 0;
+			}
+		}
+	}
+
+	emit();
+}
+
+void SparseBlockDevice::flush() {
+	m_storage->flush();
+}
+
+#if !defined(_WIN32)
+void SparseBlockDevice::copyFrom(int sourceFd, uint64_t sourceOffset, uint64_t offset, uint64_t size) {
+	if (offset + size > m_storage->mediaSize() || offset + size < offset)
+		throw std::runtime_error("the access requested is out of the media bounds");
+
+	if (size == 0)
+		return;
+
+	m_storage->copyFrom(sourceFd, sourceOffset, offset, size);
+
+	std::unique_lock<std::mutex> locker(m_dataExtentsMutex);
+	m_dataExtents.add(offset, offset + size);
+}
+#endif
+
+IBlockDevice* SparseBlockDevice::concurrentWriter() {
+	/*
+	 * The zero detection cannot be bypassed, so the writes have to come here
+	 * and go on to a device that takes them concurrently.
+	 */
+	if (m_storage->concurrentWriter() != m_storage.get())
+		return nullptr;
+
+	return this;
+}
+
+uint64_t SparseBlockDevice::mediaSize() const {
+	return m_storage->mediaSize();
+}
+
+unsigned int SparseBlockDevice::allocationUnit() const {
+	return m_storage->allocationUnit();
+}
@@ -0,0 +1,48 @@
+#ifndef FILESYSTEM_SPARSE_BLOCK_DEVICE_H
+#define FILESYSTEM_SPARSE_BLOCK_DEVICE_H
+
+#include "IBlockDevice.h"
+#include "ExtentSet.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+ * Keeps a freshly created (and therefore all-zero) image sparse. Tracks the
+ * ranges that may hold non-zero data; writes of all-zero blocks outside of
+ * them are dropped, and reads entirely outside of them are answered without
+ * touching the underlying device.
+ *
+ * The underlying device must read as all zeros when this is constructed.
+ * Writes may come from several threads at once when the underlying device
+ * takes them that way.
+ */
+class SparseBlockDevice final : public IBlockDevice {
+public:
+	static constexpr unsigned int BlockSize = 512;
+	static constexpr size_t DefaultMinimumHole = 4096;
+
+	explicit SparseBlockDevice(std::unique_ptr<IBlockDevice>&& storage, size_t minimumHole = DefaultMinimumHole);
+	~SparseBlockDevice() override;
+
+	void read(uint64_t offset, void* buffer, size_t size) override;
+	void write(uint64_t offset, const void* buffer, size_t size) override;
+	void writeGather(uint64_t offset, const WriteSegment* segments, size_t count) override;
+	void flush() override;
+#if !defined(_WIN32)
+	void copyFrom(int sourceFd, uint64_t sourceOffset, uint64_t offset, uint64_t size) override;
+#endif
+	IBlockDevice* concurrentWriter() override;
+
+	uint64_t mediaSize() const override;
+	unsigned int allocationUnit() const override;
+
+private:
+	std::unique_ptr<IBlockDevice> m_storage;
+	size_t m_minimumHole;
+	std::mutex m_dataExtentsMutex;
+	ExtentSet m_dataExtents;
+};
+
+#endif
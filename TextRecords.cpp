@@ -0,0 +1,68 @@
+#include "TextRecords.h"
+
+std::string escapeRecordField(const std::string& field) {
+	std::string escaped;
+	escaped.reserve(field.size());
+
+	for (auto character : field) {
+		if (character == '\\')
+			escaped += "\\\\";
+		else if (character == '\t')
+			escaped += "\\t";
+		else if (character == '\n')
+			escaped += "\\n";
+		else
+			escaped += character;
+	}
+
+	return escaped;
+}
+
+static bool unescapeField(std::string_view escaped, std::string& field) {
+	field.clear();
+
+	while (true) {
+		auto backslash = escaped.find('\\');
+		field.append(escaped.substr(0, backslash));
+		if (backslash == std::string_view::npos)
+			return true;
+
+		if (backslash + 1 == escaped.size())
+			return false;
+
+		auto character = escaped[backslash + 1];
+		if (character == 't')
+			field += '\t';
+		else if (character == 'n')
+			field += '\n';
+		else if (character == '\\')
+			field += '\\';
+		else
+			return false;
+
+		escaped.remove_prefix(backslash + 2);
+	}
+}
+
+bool splitRecordFields(std::string_view line, std::vector<std::string>& fields) {
+	size_t count = 0;
+
+	while (true) {
+		auto tab = line.find('\t');
+
+		if (fields.size() == count)
+			fields.emplace_back();
+
+		if (!unescapeField(line.substr(0, tab), fields[count++]))
+			return false;
+
+		if (tab == std::string_view::npos)
+			break;
+
+		line.remove_prefix(tab + 1);
+	}
+
+	fields.resize(count);
+
+	return true;
+}
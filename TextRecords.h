@@ -0,0 +1,31 @@
+#ifndef TEXT_RECORDS_H
+#define TEXT_RECORDS_H
+
+#include <charconv>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * The line format of the files fatbuilder keeps between builds: one record
+ * per line, with fields separated by tabs. Tabs, line breaks and backslashes
+ * in the fields are escaped.
+ */
+std::string escapeRecordField(const std::string& field);
+
+/*
+ * Returns false on a bad escape sequence.
+ */
+bool splitRecordFields(std::string_view line, std::vector<std::string>& fields);
+
+/*
+ * A decimal number taking up the whole field.
+ */
+template<typename T>
+bool parseRecordNumber(const std::string& field, T& value) {
+	auto result = std::from_chars(field.data(), field.data() + field.size(), value);
+
+	return result.ec == std::errc() && result.ptr == field.data() + field.size();
+}
+
+#endif
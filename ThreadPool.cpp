@@ -0,0 +1,117 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+
+ThreadPool::ThreadPool(unsigned int threads) : m_stopping(false) {
+	if (threads == 0)
+		threads = defaultThreadCount();
+
+	m_threads.reserve(threads);
+
+	for (unsigned int index = 0; index < threads; index++) {
+		m_threads.emplace_back(&ThreadPool::worker, this);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::unique_lock<std::mutex> locker(m_mutex);
+		m_stopping = true;
+	}
+
+	m_condition.notify_all();
+
+	for (auto& thread : m_threads) {
+		thread.join();
+	}
+}
+
+unsigned int ThreadPool::defaultThreadCount() {
+	auto threads = std::thread::hardware_concurrency();
+	if (threads == 0)
+		threads = 1;
+
+	return threads;
+}
+
+void ThreadPool::forEach(ThreadPool* pool, size_t count, const std::function<void(size_t index)>& body) {
+	/*
+	 * Each worker takes the next index until none are left, or one of them
+	 * fails.
+	 */
+	struct Progress {
+		std::mutex mutex;
+		std::condition_variable condition;
+		unsigned int running = 0;
+		std::exception_ptr error;
+		std::atomic<size_t> next{ 0 };
+	} progress;
+
+	auto work = [&progress, count, &body]() {
+		std::exception_ptr error;
+
+		try {
+			size_t index;
+			while ((index = progress.next.fetch_add(1)) < count)
+				body(index);
+		}
+		catch (...) {
+			error = std::current_exception();
+			progress.next = count;
+		}
+
+		std::unique_lock<std::mutex> locker(progress.mutex);
+		if (error && !progress.error)
+			progress.error = error;
+
+		progress.running--;
+		progress.condition.notify_all();
+	};
+
+	auto workers = pool ? static_cast<unsigned int>(std::min<size_t>(pool->threadCount(), count)) : 0;
+	if (workers < 2) {
+		progress.running = 1;
+		work();
+	}
+	else {
+		progress.running = workers;
+		for (unsigned int worker = 0; worker < workers; worker++)
+			pool->submit(work);
+
+		std::unique_lock<std::mutex> locker(progress.mutex);
+		progress.condition.wait(locker, [&progress]() { return progress.running == 0; });
+	}
+
+	if (progress.error)
+		std::rethrow_exception(progress.error);
+}
+
+void ThreadPool::submit(std::function<void()>&& task) {
+	{
+		std::unique_lock<std::mutex> locker(m_mutex);
+		m_tasks.emplace_back(std::move(task));
+	}
+
+	m_condition.notify_one();
+}
+
+void ThreadPool::worker() {
+	while (true) {
+		std::function<void()> task;
+
+		{
+			std::unique_lock<std::mutex> locker(m_mutex);
+			m_condition.wait(locker, [this]() { return m_stopping || !m_tasks.empty(); });
+
+			if (m_tasks.empty())
+				return;
+
+			task = std::move(m_tasks.front());
+			m_tasks.pop_front();
+		}
+
+		task();
+	}
+}
@@ -0,0 +1,49 @@
+#ifndef UTILITY_THREAD_POOL_H
+#define UTILITY_THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+	explicit ThreadPool(unsigned int threads = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool& other) = delete;
+	ThreadPool &operator =(const ThreadPool& other) = delete;
+
+	/*
+	 * Queues a task for execution on one of the worker threads. Tasks must
+	 * not throw.
+	 */
+	void submit(std::function<void()>&& task);
+
+	inline unsigned int threadCount() const {
+		return static_cast<unsigned int>(m_threads.size());
+	}
+
+	static unsigned int defaultThreadCount();
+
+	/*
+	 * Calls body with every index below count, from as many workers of pool
+	 * as are useful, or on the calling thread when pool is null, and waits
+	 * for all of them. The first exception thrown stops the others from
+	 * taking further indices and is rethrown.
+	 */
+	static void forEach(ThreadPool* pool, size_t count, const std::function<void(size_t index)>& body);
+
+private:
+	void worker();
+
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	std::deque<std::function<void()>> m_tasks;
+	bool m_stopping;
+	std::vector<std::thread> m_threads;
+};
+
+#endif
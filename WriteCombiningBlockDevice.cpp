@@ -0,0 +1,176 @@
+#include "WriteCombiningBlockDevice.h"
+
+#include <algorithm>
+#include <deque>
+#include <stdexcept>
+
+WriteCombiningBlockDevice::WriteCombiningBlockDevice(std::unique_ptr<IBlockDevice>&& storage, size_t maxBatchSize, size_t maxGap, size_t bypassSize) :
+	m_storage(std::move(storage)),
+	m_maxBatchSize(maxBatchSize),
+	m_maxGap(maxGap),
+	m_bypassSize(std::min(bypassSize, maxBatchSize)),
+	m_pendingBytes(0) {
+
+}
+
+WriteCombiningBlockDevice::~WriteCombiningBlockDevice() {
+	try {
+		submitPending();
+	}
+	catch (...) {
+
+	}
+}
+
+void WriteCombiningBlockDevice::read(uint64_t offset, void* buffer, size_t size) {
+	if (overlapsPending(offset, size))
+		submitPending();
+
+	m_storage->read(offset, buffer, size);
+}
+
+void WriteCombiningBlockDevice::write(uint64_t offset, const void* buffer, size_t size) {
+	if (offset + size > m_storage->mediaSize() || offset + size < offset)
+		throw std::runtime_error("the access requested is out of the media bounds");
+
+	if (size == 0)
+		return;
+
+	if (size >= m_bypassSize) {
+		if (overlapsPending(offset, size))
+			submitPending();
+
+		m_storage->write(offset, buffer, size);
+		return;
+	}
+
+	auto in = static_cast<const unsigned char*>(buffer);
+
+	if (!m_pending.empty()) {
+		auto next = m_pending.upper_bound(offset);
+
+		if (next != m_pending.begin()) {
+			auto previous = std::prev(next);
+			auto previousEnd = previous->first + previous->second.size();
+
+			if (offset + size <= previousEnd) {
+				/*
+				 * Rewrite of data that is still pending: update it in place.
+				 */
+				memcpy(previous->second.data() + (offset - previous->first), in, size);
+				return;
+			}
+
+			if (offset == previousEnd && (next == m_pending.end() || next->first >= offset + size)) {
+				previous->second.insert(previous->second.end(), in, in + size);
+				m_pendingBytes += size;
+
+				if (m_pendingBytes >= m_maxBatchSize)
+					submitPending();
+
+				return;
+			}
+		}
+
+		if (overlapsPending(offset, size))
+			submitPending();
+	}
+
+	m_pending.emplace(offset, std::vector<unsigned char>(in, in + size));
+	m_pendingBytes += size;
+
+	if (m_pendingBytes >= m_maxBatchSize)
+		submitPending();
+}
+
+void WriteCombiningBlockDevice::flush() {
+	submitPending();
+
+	m_storage->flush();
+}
+
+#if !defined(_WIN32)
+void WriteCombiningBlockDevice::copyFrom(int sourceFd, uint64_t sourceOffset, uint64_t offset, uint64_t size) {
+	if (offset + size > m_storage->mediaSize() || offset + size < offset)
+		throw std::runtime_error("the access requested is out of the media bounds");
+
+	if (overlapsPending(offset, size))
+		submitPending();
+
+	m_storage->copyFrom(sourceFd, sourceOffset, offset, size);
+}
+#endif
+
+IBlockDevice* WriteCombiningBlockDevice::concurrentWriter() {
+	auto writer = m_storage->concurrentWriter();
+
+	/*
+	 * A gap may be written through the concurrent writer at any time, so
+	 * what is read back into it could be stale by the time it is written.
+	 */
+	if (writer)
+		m_maxGap = 0;
+
+	return writer;
+}
+
+uint64_t WriteCombiningBlockDevice::mediaSize() const {
+	return m_storage->mediaSize();
+}
+
+unsigned int WriteCombiningBlockDevice::allocationUnit() const {
+	return m_storage->allocationUnit();
+}
+
+bool WriteCombiningBlockDevice::overlapsPending(uint64_t offset, size_t size) const {
+	if (m_pending.empty())
+		return false;
+
+	auto next = m_pending.lower_bound(offset);
+	if (next != m_pending.end() && next->first < offset + size)
+		return true;
+
+	if (next != m_pending.begin()) {
+		auto previous = std::prev(next);
+		if (previous->first + previous->second.size() > offset)
+			return true;
+	}
+
+	return false;
+}
+
+void WriteCombiningBlockDevice::submitPending() {
+	if (m_pending.empty())
+		return;
+
+	std::vector<WriteSegment> segments;
+	std::deque<std::vector<unsigned char>> gaps;
+
+	auto it = m_pending.begin();
+
+	while (it != m_pending.end()) {
+		auto batchOffset = it->first;
+		auto batchEnd = batchOffset;
+
+		segments.clear();
+		gaps.clear();
+
+		do {
+			if (it->first != batchEnd) {
+				auto& gap = gaps.emplace_back(static_cast<size_t>(it->first - batchEnd));
+				m_storage->read(batchEnd, gap.data(), gap.size());
+				segments.push_back({ gap.data(), gap.size() });
+			}
+
+			segments.push_back({ it->second.data(), it->second.size() });
+			batchEnd = it->first + it->second.size();
+
+			++it;
+		} while (it != m_pending.end() && it->first - batchEnd <= m_maxGap);
+
+		m_storage->writeGather(batchOffset, segments.data(), segments.size());
+	}
+
+	m_pending.clear();
+	m_pendingBytes = 0;
+}
@@ -0,0 +1,53 @@
+#ifndef FILESYSTEM_WRITE_COMBINING_BLOCK_DEVICE_H
+#define FILESYSTEM_WRITE_COMBINING_BLOCK_DEVICE_H
+
+#include "IBlockDevice.h"
+
+#include <memory>
+#include <map>
+#include <vector>
+
+/*
+ * Holds back writes to another block device and submits them in batches,
+ * merging adjacent writes, and writes separated by no more than maxGap
+ * bytes, into single gathered writes. Gaps are filled with the data already
+ * on the device, until a concurrent writer is handed out; only adjacent
+ * writes are merged from then on. Writes of bypassSize bytes or more are
+ * large enough on their own and are passed through without being copied.
+ */
+class WriteCombiningBlockDevice final : public IBlockDevice {
+public:
+	static constexpr size_t DefaultMaxBatchSize = 8 * 1024 * 1024;
+	static constexpr size_t DefaultMaxGap = 4096;
+	static constexpr size_t DefaultBypassSize = 1024 * 1024;
+
+	explicit WriteCombiningBlockDevice(std::unique_ptr<IBlockDevice>&& storage,
+		size_t maxBatchSize = DefaultMaxBatchSize,
+		size_t maxGap = DefaultMaxGap,
+		size_t bypassSize = DefaultBypassSize);
+	~WriteCombiningBlockDevice() override;
+
+	void read(uint64_t offset, void* buffer, size_t size) override;
+	void write(uint64_t offset, const void* buffer, size_t size) override;
+	void flush() override;
+#if !defined(_WIN32)
+	void copyFrom(int sourceFd, uint64_t sourceOffset, uint64_t offset, uint64_t size) override;
+#endif
+	IBlockDevice* concurrentWriter() override;
+
+	uint64_t mediaSize() const override;
+	unsigned int allocationUnit() const override;
+
+private:
+	bool overlapsPending(uint64_t offset, size_t size) const;
+	void submitPending();
+
+	std::unique_ptr<IBlockDevice> m_storage;
+	size_t m_maxBatchSize;
+	size_t m_maxGap;
+	size_t m_bypassSize;
+	std::map<uint64_t, std::vector<unsigned char>> m_pending;
+	size_t m_pendingBytes;
+};
+
+#endif
@@ -0,0 +1,94 @@
+#include "ZeroDetection.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ZERO_DETECTION_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+static bool isZeroTail(const unsigned char* bytes, size_t size) {
+	uint64_t accumulator = 0;
+
+	while (size >= sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, bytes, sizeof(word));
+		accumulator |= word;
+
+		bytes += sizeof(word);
+		size -= sizeof(word);
+	}
+
+	while (size > 0) {
+		accumulator |= *bytes++;
+		size--;
+	}
+
+	return accumulator == 0;
+}
+
+bool isZeroBuffer(const void* data, size_t size) {
+	auto bytes = static_cast<const unsigned char*>(data);
+
+	/*
+	 * Checks 64 bytes per iteration, so that non-zero data is rejected
+	 * quickly while zero data is scanned at memory bandwidth.
+	 */
+#if defined(__AVX2__)
+	while (size >= 64) {
+		auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes));
+		auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes + 32));
+
+		if (!_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b)))
+			return false;
+
+		bytes += 64;
+		size -= 64;
+	}
+#elif defined(ZERO_DETECTION_SSE2)
+	auto zero = _mm_setzero_si128();
+
+	while (size >= 64) {
+		auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes));
+		auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + 16));
+		auto c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + 32));
+		auto d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + 48));
+
+		auto combined = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(combined, zero)) != 0xFFFF)
+			return false;
+
+		bytes += 64;
+		size -= 64;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	while (size >= 64) {
+		auto a = vld1q_u8(bytes);
+		auto b = vld1q_u8(bytes + 16);
+		auto c = vld1q_u8(bytes + 32);
+		auto d = vld1q_u8(bytes + 48);
+
+		auto combined = vorrq_u8(vorrq_u8(a, b), vorrq_u8(c, d));
+		if (vmaxvq_u8(combined) != 0)
+			return false;
+
+		bytes += 64;
+		size -= 64;
+	}
+#else
+	while (size >= 64) {
+		if (!isZeroTail(bytes, 64))
+			return false;
+
+		bytes += 64;
+		size -= 64;
+	}
+#endif
+
+	return isZeroTail(bytes, size);
+}
@@ -0,0 +1,8 @@
+#ifndef UTILITY_ZERO_DETECTION_H
+#define UTILITY_ZERO_DETECTION_H
+
+#include <cstddef>
+
+bool isZeroBuffer(const void* data, size_t size);
+
+#endif
@@ -1,83 +1,161 @@
 #include <CLI/CLI.hpp>
 
-#include "FATFilesystemLayout.h"
+#include "BuildCommand.h"
 #include "FilesystemTree.h"
-#include "RawBlockDevice.h"
-#include "FATFilesystem.h"
+#include "SourceCache.h"
+#include "ThreadPool.h"
 
-static std::unique_ptr<unsigned char[]> loadCodeFile(const std::filesystem::path& path, size_t size) {
-	std::ifstream stream;
-	stream.exceptions(std::ios::failbit | std::ios::eofbit | std::ios::badbit);
-	stream.open(path, std::ios::in | std::ios::binary);
+#if !defined(_WIN32)
+#include "BuildServer.h"
 
-	auto result = std::make_unique<unsigned char[]>(size);
+#include <signal.h>
+#endif
 
-	stream.read(reinterpret_cast<char*>(result.get()), size);
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
 
-	return result;
-}
+#if !defined(_WIN32)
+static int serve(int argc, char** argv) {
+	CLI::App app("FAT filesystem build server", "fatbuilder");
 
-int main(int argc, char** argv) {
-	CLI::App app("FAT filesystem builder", "fatbuilder");
+	bool serve = false;
+	std::filesystem::path socketPath;
+	unsigned int jobs = ThreadPool::defaultThreadCount();
+	unsigned int readThreads = ThreadPool::defaultThreadCount();
+	size_t sourceCacheSize = 0;
+
+	app.add_flag("--serve", serve, "Run the builds of other fatbuilder invocations by this user until terminated; they build on their own while no server is running")->required(true);
+	app.add_option("--socket", socketPath, "Unix socket to listen on, by default FATBUILDER_SOCKET or the user's socket in XDG_RUNTIME_DIR or /tmp");
+	app.add_option("--jobs", jobs, "Number of builds run at once")->check(CLI::Range(1u, 1024u));
+	app.add_option("--read-threads", readThreads, "Number of threads examining and reading source files, shared by all builds");
+	app.add_option("--source-cache-size", sourceCacheSize, "Bytes of source file contents kept in memory for the builds to share, 0 to read the sources of every build");
+
+	CLI11_PARSE(app, argc, argv);
+
+	if (socketPath.empty()) {
+		auto configured = BuildServer::socketPath();
+		if (!configured) {
+			std::cerr << "fatbuilder: FATBUILDER_SOCKET is empty, give the socket with --socket" << std::endl;
+			return 1;
+		}
 
-	std::filesystem::path inputFilename;
-	std::filesystem::path outputFilename;
-	std::filesystem::path depfile;
+		socketPath = std::move(*configured);
+	}
 
-	FATFilesystemLayout layout;
+	/*
+	 * Clients that go away are noticed by the failing writes.
+	 */
+	signal(SIGPIPE, SIG_IGN);
 
-	std::unique_ptr<unsigned char[]> mbrCode;
-	std::unique_ptr<unsigned char[]> pbrCode12_16;
-	std::unique_ptr<unsigned char[]> pbrCode32;
+	try {
+		BuildServer server(std::move(socketPath), jobs, readThreads, sourceCacheSize);
+		server.run();
+	}
+	catch (const std::exception& e) {
+		std::cerr << "fatbuilder: " << e.what() << std::endl;
+		return 1;
+	}
 
-	app.add_option("--input", inputFilename)->required(true);
-	app.add_option("--output", outputFilename)->required(true);
-	app.add_option("--depfile", depfile);
+	return 0;
+}
+#endif
 
-	app.add_option_function<std::filesystem::path>("--mbr-code", [&layout, &mbrCode](const std::filesystem::path& path) {
-		mbrCode = loadCodeFile(path, FATFilesystemLayout::MBRCodeSize);
-		layout.mbrCode = mbrCode.get();
-	});
+static int batch(int argc, char** argv, const BuildCommand& base) {
+	CLI::App app("FAT filesystem builder, building many images at once", "fatbuilder");
 
-	app.add_option_function<std::filesystem::path>("--pbr-code1216", [&layout, &pbrCode12_16](const std::filesystem::path& path) {
-		pbrCode12_16 = loadCodeFile(path, FATFilesystemLayout::PBRCode12_16Size);
-		layout.pbrCode12_16 = pbrCode12_16.get();
-	});
+	std::filesystem::path batchFile;
+	unsigned int jobs = ThreadPool::defaultThreadCount();
+	unsigned int readThreads = ThreadPool::defaultThreadCount();
+	size_t sourceCacheSize = SourceCache::DefaultCapacity;
 
-	app.add_option_function<std::filesystem::path>("--pbr-code32", [&layout, &pbrCode32](const std::filesystem::path& path) {
-		pbrCode32 = loadCodeFile(path, FATFilesystemLayout::PBRCode32Size);
-		layout.pbrCode32 = pbrCode32.get();
-	});
+	app.add_option("--batch", batchFile, "File listing the builds to run, one per line, as their fatbuilder arguments in manifest syntax")->required(true);
+	app.add_option("--jobs", jobs, "Number of builds run at once")->check(CLI::Range(1u, 1024u));
+	app.add_option("--read-threads", readThreads, "Number of threads examining and reading source files, shared by all builds");
+	app.add_option("--source-cache-size", sourceCacheSize, "Bytes of source file contents kept in memory, so that files going into several images are read once; 0 to disable");
 
 	CLI11_PARSE(app, argc, argv);
 
-	FilesystemTree tree;
-	tree.parse(inputFilename);
+	try {
+		auto commands = parseBuildBatch(batchFile, base);
 
-	if (!depfile.empty()) {
-		std::basic_ofstream<FatfsCharacter> stream;
-		stream.exceptions(std::ios::failbit | std::ios::eofbit | std::ios::badbit);
-		stream.open(depfile, std::ios::out | std::ios::trunc | std::ios::binary);
+		BuildResources resources(readThreads, sourceCacheSize);
 
-		stream << std::filesystem::absolute(outputFilename).generic_string<FatfsCharacter>() << ": \\\n";
+		return runBuildBatch(commands, &resources, jobs, std::cout, std::cerr);
+	}
+	catch (const std::exception& e) {
+		std::cerr << "fatbuilder: " << e.what() << std::endl;
+		return 1;
+	}
+}
 
-		auto printInput = [&stream](const std::filesystem::path& inputFilename) {
-			stream << "\t" << std::filesystem::absolute(inputFilename).generic_string<FatfsCharacter>() << " \\\n";
-		};
+static int compileManifest(int argc, char** argv) {
+	CLI::App app("FAT filesystem builder, compiling a manifest", "fatbuilder");
 
-		printInput(inputFilename);
+	std::filesystem::path manifest;
+	std::filesystem::path output;
+	unsigned int readThreads = ThreadPool::defaultThreadCount();
 
-		tree.enumerateInputs(printInput);
+	app.add_option("--compile-manifest", manifest, "Manifest to compile into a binary one, which --input loads without parsing it")->required(true);
+	app.add_option("--output", output, "Compiled manifest to write")->required(true);
+	app.add_option("--read-threads", readThreads, "Number of threads parsing the manifest, 0 to parse it on the main thread");
 
-		stream << "\n\n";
-	}
+	CLI11_PARSE(app, argc, argv);
 
-	auto size = tree.calculateSize(32768, 1024 * 1024);
+	try {
+		std::unique_ptr<ThreadPool> pool;
+		if (readThreads != 0)
+			pool = std::make_unique<ThreadPool>(readThreads);
 
-	auto blockDevice = std::make_unique<RawBlockDevice>(std::move(outputFilename), size);
-	auto fs = std::make_unique<FATFilesystem>(std::move(blockDevice), layout);
+		auto information = examineFile(manifest, std::filesystem::current_path());
 
-	tree.buildFilesystem(fs.get());
+		FilesystemTree tree;
+		tree.parse(manifest, pool.get());
+		tree.compile(output, information);
+	}
+	catch (const std::exception& e) {
+		std::cerr << "fatbuilder: " << e.what() << std::endl;
+		return 1;
+	}
 
 	return 0;
 }
+
+int main(int argc, char** argv) {
+#if !defined(_WIN32)
+	if (argc > 1 && strcmp(argv[1], "--serve") == 0)
+		return serve(argc, argv);
+#endif
+
+	BuildCommand command;
+	command.workingDirectory = std::filesystem::current_path();
+
+	auto sourceDateEpoch = getenv("SOURCE_DATE_EPOCH");
+	if (sourceDateEpoch)
+		command.sourceDateEpoch = sourceDateEpoch;
+
+	if (argc > 1 && strcmp(argv[1], "--compile-manifest") == 0)
+		return compileManifest(argc, argv);
+
+	if (argc > 1 && strcmp(argv[1], "--batch") == 0)
+		return batch(argc, argv, command);
+
+	command.arguments.assign(argv + 1, argv + argc);
+
+#if !defined(_WIN32)
+	auto socketPath = BuildServer::socketPath();
+	if (socketPath) {
+		auto status = BuildServer::runRemotely(*socketPath, command, std::cout, std::cerr);
+		if (status)
+			return *status;
+	}
+#endif
+
+	try {
+		return runBuildCommand(command, nullptr, std::cout, std::cerr);
+	}
+	catch (const std::exception& e) {
+		std::cerr << "fatbuilder: " << e.what() << std::endl;
+		return 1;
+	}
+}
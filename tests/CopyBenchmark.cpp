@@ -0,0 +1,173 @@
+#include "FATFilesystem.h"
+#include "FATImageBuilder.h"
+#include "FilesystemTree.h"
+#include "IFile.h"
+#include "MemoryBlockDevice.h"
+#include "ThreadPool.h"
+#include "TestSources.h"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * Measures how fast file contents go into an image: the 8 KiB ifstream loop
+ * the tree used to be built with, against the chunked copy engine reading
+ * or mapping its sources, and against the copies made by the kernel, with
+ * either writer. Images are built in memory, so that neither the writeback
+ * of the page cache nor fsync is measured, and the sources are read once
+ * before timing, so that they come from the page cache.
+ *
+ * usage: CopyBenchmark <work directory> [files] [MiB per file] [runs]
+ */
+
+static std::vector<std::filesystem::path> writeSources(const std::filesystem::path& directory, unsigned int count, uint64_t size) {
+	std::filesystem::create_directories(directory);
+
+	std::vector<std::filesystem::path> paths;
+
+	for (unsigned int index = 0; index < count; index++) {
+		auto path = directory / ("source" + std::to_string(index) + ".bin");
+
+		std::error_code error;
+		if (std::filesystem::file_size(path, error) != size)
+			path = writeSource(directory, index, size);
+
+		paths.push_back(path);
+	}
+
+	return paths;
+}
+
+static void warmSources(const std::vector<std::filesystem::path>& paths) {
+	std::vector<char> buffer(1024 * 1024);
+
+	for (const auto& path : paths) {
+		std::ifstream stream(path, std::ios::in | std::ios::binary);
+		while (stream.read(buffer.data(), static_cast<std::streamsize>(buffer.size())) || stream.gcount() != 0) {
+		}
+	}
+}
+
+static std::string imageName(size_t index) {
+	return "file" + std::to_string(index) + ".bin";
+}
+
+/*
+ * The copy loop of Inode::buildFilesystem before the copy engine.
+ */
+static void copyWithLoop(FilesystemTree& tree, const std::vector<std::filesystem::path>& sources) {
+	FATImageBuilder::Options options;
+	options.writer = FATImageBuilder::Writer::Fatfs;
+
+	FATImageBuilder builder(tree, options);
+	FATFilesystem filesystem(std::make_unique<MemoryBlockDevice>(builder.mediaSize()), FATFilesystemLayout(), builder.parameters());
+
+	for (size_t index = 0; index < sources.size(); index++) {
+		auto file = filesystem.open(utf8StringToFatfsString("/" + imageName(index)), FF_T("w"));
+
+		std::ifstream source;
+		source.exceptions(std::ios::failbit | std::ios::badbit | std::ios::eofbit);
+		source.open(sources[index], std::ios::in | std::ios::binary);
+		source.exceptions(std::ios::badbit);
+
+		std::vector<char> buf(8192);
+		size_t bytesTransferred;
+		do {
+			source.read(buf.data(), buf.size());
+			bytesTransferred = source.gcount();
+
+			file->write(buf.data(), bytesTransferred);
+
+		} while (bytesTransferred == buf.size());
+	}
+
+	filesystem.flush();
+}
+
+static void copyWithEngine(FilesystemTree& tree, ThreadPool* readPool, FATImageBuilder::Writer writer, SourceReader::Mode mode, uint64_t directCopyThreshold) {
+	FATImageBuilder::Options options;
+	options.writer = writer;
+
+	FATImageBuilder builder(tree, options);
+
+	FilesystemBuildOptions buildOptions;
+	buildOptions.readPool = readPool;
+	buildOptions.readMode = mode;
+	buildOptions.directCopyThreshold = directCopyThreshold;
+
+	builder.build(std::make_unique<MemoryBlockDevice>(builder.mediaSize()), buildOptions);
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2 || argc > 5) {
+		std::cerr << "usage: CopyBenchmark <work directory> [files] [MiB per file] [runs]" << std::endl;
+		return 2;
+	}
+
+	try {
+		std::filesystem::path work(argv[1]);
+		unsigned int count = argc > 2 ? static_cast<unsigned int>(std::stoul(argv[2])) : 32;
+		uint64_t size = (argc > 3 ? std::stoull(argv[3]) : 32) * 1024 * 1024;
+		unsigned int runs = argc > 4 ? static_cast<unsigned int>(std::stoul(argv[4])) : 3;
+
+		auto sources = writeSources(work / "sources", count, size);
+		warmSources(sources);
+
+		ThreadPool readPool(ThreadPool::defaultThreadCount());
+
+		FilesystemTree tree;
+		for (size_t index = 0; index < sources.size(); index++)
+			tree.addFile(imageName(index), sources[index]);
+
+		tree.statInputs(&readPool);
+
+		struct Case {
+			const char* name;
+			std::function<void()> run;
+		};
+
+		const Case cases[] = {
+			{ "8 KiB ifstream loop", [&]() { copyWithLoop(tree, sources); } },
+			{ "fatfs, read", [&]() { copyWithEngine(tree, &readPool, FATImageBuilder::Writer::Fatfs, SourceReader::Mode::Read, 0); } },
+			{ "fatfs, mmap", [&]() { copyWithEngine(tree, &readPool, FATImageBuilder::Writer::Fatfs, SourceReader::Mode::Map, 0); } },
+			{ "fatfs, kernel copy", [&]() { copyWithEngine(tree, &readPool, FATImageBuilder::Writer::Fatfs, SourceReader::DefaultMode, FilesystemBuildOptions::DefaultDirectCopyThreshold); } },
+			{ "native, read", [&]() { copyWithEngine(tree, &readPool, FATImageBuilder::Writer::Native, SourceReader::Mode::Read, 0); } },
+			{ "native, mmap", [&]() { copyWithEngine(tree, &readPool, FATImageBuilder::Writer::Native, SourceReader::Mode::Map, 0); } },
+			{ "native, kernel copy", [&]() { copyWithEngine(tree, &readPool, FATImageBuilder::Writer::Native, SourceReader::DefaultMode, FilesystemBuildOptions::DefaultDirectCopyThreshold); } },
+		};
+
+		double total = static_cast<double>(count) * static_cast<double>(size) / (1024.0 * 1024.0);
+
+		std::cout << count << " files of " << size / (1024 * 1024) << " MiB, best of " << runs << " runs" << std::endl;
+
+		for (const auto& benchmark : cases) {
+			double best = 0;
+
+			for (unsigned int run = 0; run < runs; run++) {
+				auto start = std::chrono::steady_clock::now();
+				benchmark.run();
+				std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+				if (run == 0 || elapsed.count() < best)
+					best = elapsed.count();
+			}
+
+			std::cout << std::left << std::setw(24) << benchmark.name << std::right << std::fixed <<
+				std::setprecision(3) << std::setw(8) << best << " s" <<
+				std::setprecision(0) << std::setw(8) << total / best << " MiB/s" << std::endl;
+		}
+	}
+	catch (const std::exception& e) {
+		std::cerr << "CopyBenchmark: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef FILESYSTEM_TEST_SOURCES_H
+#define FILESYSTEM_TEST_SOURCES_H
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * Source files for the tests and benchmarks. Each index gets contents of its
+ * own, so that files cannot be mistaken for each other and do not compress
+ * or deduplicate.
+ */
+inline std::filesystem::path writeSource(const std::filesystem::path& directory, unsigned int index, uint64_t size) {
+	auto path = directory / ("source" + std::to_string(index) + ".bin");
+
+	std::vector<char> data(1024 * 1024);
+	uint32_t state = 2166136261u ^ index;
+
+	std::ofstream stream(path, std::ios::out | std::ios::trunc | std::ios::binary);
+
+	for (uint64_t written = 0; written < size; written += data.size()) {
+		auto chunk = static_cast<size_t>(std::min<uint64_t>(data.size(), size - written));
+
+		for (size_t position = 0; position < chunk; position++) {
+			state = state * 1664525u + 1013904223u;
+			data[position] = static_cast<char>(state >> 24);
+		}
+
+		stream.write(data.data(), static_cast<std::streamsize>(chunk));
+	}
+
+	if (!stream)
+		throw std::runtime_error("cannot write " + path.u8string());
+
+	return path;
+}
+
+/*
+ * A token of the manifest, quoted.
+ */
+inline std::string quote(const std::filesystem::path& path) {
+	std::string quoted = "\"";
+
+	for (auto character : path.u8string()) {
+		if (character == '"' || character == '\\')
+			quoted.push_back('\\');
+
+		quoted.push_back(character);
+	}
+
+	quoted.push_back('"');
+
+	return quoted;
+}
+
+#endif
@@ -0,0 +1,306 @@
+#include "FATFilesystem.h"
+#include "IFile.h"
+#include "RawBlockDevice.h"
+#include "TestSources.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * Builds the same tree with the native writer and with fatfs, and checks
+ * that both images hold the same entries: names, short names, attributes,
+ * timestamps, sizes and contents. Where the clusters end up may differ.
+ * The layout policies are used to put the trees on each FAT type.
+ */
+
+static void writeManifest(const std::filesystem::path& manifestPath, const std::filesystem::path& sources, bool large) {
+	static const size_t sizes[] = { 0, 1, 511, 512, 513, 4095, 4096, 4097, 65539, 300000 };
+
+	std::ostringstream manifest;
+	unsigned int sourceIndex = 0;
+
+	auto file = [&](const std::string& name, size_t size, const char* attributes) {
+		auto source = writeSource(sources, sourceIndex++, size);
+		manifest << "file " << quote(name) << ' ' << quote(source) << ' ' << attributes << '\n';
+	};
+
+	manifest << "dir top\n";
+	manifest << "dir \"top/A rather long directory name\" h\n";
+	manifest << "dir top/empty\n";
+	manifest << "dir sys s\n";
+	manifest << "dir a\n";
+	manifest << "dir a/b\n";
+	manifest << "dir a/b/c\n";
+	manifest << "dir a/b/c/d\n";
+	manifest << "dir a/b/c/d/e\n";
+
+	for (size_t index = 0; index < sizeof(sizes) / sizeof(sizes[0]); index++)
+		file("top/file" + std::to_string(index) + ".bin", sizes[index], "a");
+
+	file("README", 1000, "ar");
+	file("lower.txt", 20, "a");
+	file("MixedCase.Txt", 20, "a");
+	file("two.dots.in.name", 20, "a");
+	file("sys/hidden.sys", 512, "ash");
+	file("a/b/c/d/e/deep.txt", 4097, "a");
+	file("top/A rather long directory name/\xc3\x9c" "berraschung \xe2\x82\xac.txt", 100, "a");
+
+	/*
+	 * Enough names with the same short form to go past the numbered tails
+	 * into the hashed ones.
+	 */
+	for (unsigned int index = 0; index < 12; index++)
+		file("top/Long File Name Number " + std::to_string(index) + ".data", 700 + index, "a");
+
+	/*
+	 * A directory spanning several clusters.
+	 */
+	manifest << "dir many\n";
+	for (unsigned int index = 0; index < 300; index++)
+		file("many/entry with a long name " + std::to_string(index), index % 7, "a");
+
+	/*
+	 * More than 32 MiB, which does not fit FAT16 with 512-byte clusters,
+	 * and enough small files for those clusters to still give the smallest
+	 * image, on FAT32.
+	 */
+	if (large) {
+		file("large.bin", 33 * 1024 * 1024, "a");
+
+		manifest << "dir small\n";
+		for (unsigned int index = 0; index < 1000; index++)
+			file("small/" + std::to_string(index) + ".txt", 100, "a");
+	}
+
+	std::ofstream stream(manifestPath, std::ios::out | std::ios::trunc | std::ios::binary);
+	stream << manifest.str();
+	if (!stream)
+		throw std::runtime_error("cannot write " + manifestPath.u8string());
+}
+
+static void build(const std::filesystem::path& fatbuilder, const std::filesystem::path& manifest, const std::filesystem::path& image, const char* writer, const std::string& options) {
+	auto argument = [](const std::filesystem::path& path) {
+		return "\"" + path.u8string() + "\"";
+	};
+
+	auto command = argument(fatbuilder) + " --input " + argument(manifest) + " --output " + argument(image) + " --fat-writer " + writer + " --timestamps epoch " + options;
+
+#if defined(_WIN32)
+	/*
+	 * cmd.exe drops the first and last quote of the line.
+	 */
+	command = "\"" + command + "\"";
+#endif
+
+	if (std::system(command.c_str()) != 0)
+		throw std::runtime_error("building with the " + std::string(writer) + " writer failed");
+}
+
+static std::string contentsHash(FATFilesystem& filesystem, const FatfsString& name) {
+	auto file = filesystem.open(name, FF_T("r"));
+
+	uint64_t hash = 14695981039346656037ull;
+	uint64_t size = 0;
+	std::vector<unsigned char> buffer(65536);
+
+	while (true) {
+		auto done = file->read(buffer.data(), buffer.size());
+		for (size_t index = 0; index < done; index++)
+			hash = (hash ^ buffer[index]) * 1099511628211ull;
+
+		size += done;
+
+		if (done < buffer.size())
+			break;
+	}
+
+	std::ostringstream result;
+	result << size << ':' << std::hex << hash;
+
+	return result.str();
+}
+
+static void walk(FATFilesystem& filesystem, const FatfsString& directory, std::vector<std::string>& lines) {
+	auto entries = filesystem.listDirectory(directory);
+
+	std::sort(entries.begin(), entries.end(), [](const FILINFO& left, const FILINFO& right) {
+		return FatfsString(left.fname) < FatfsString(right.fname);
+	});
+
+	for (const auto& entry : entries) {
+		auto name = directory;
+		if (!name.empty())
+			name.push_back(static_cast<FatfsCharacter>('/'));
+
+		name.append(entry.fname);
+
+		std::ostringstream line;
+		line << fatfsStringToUtf8String(name) << " short=" << fatfsStringToUtf8String(entry.altname) <<
+			" attributes=" << static_cast<unsigned int>(entry.fattrib) <<
+			" date=" << entry.fdate << " time=" << entry.ftime;
+
+		if (entry.fattrib & AM_DIR) {
+			lines.push_back(line.str());
+			walk(filesystem, name, lines);
+		}
+		else {
+			line << " size=" << entry.fsize << " contents=" << contentsHash(filesystem, name);
+			lines.push_back(line.str());
+		}
+	}
+}
+
+/*
+ * The FAT type of the volume in the first partition, from its cluster count.
+ */
+static std::string fatType(const std::filesystem::path& image) {
+	std::ifstream stream;
+	stream.exceptions(std::ios::failbit | std::ios::badbit | std::ios::eofbit);
+	stream.open(image, std::ios::in | std::ios::binary);
+
+	auto read = [&stream](uint64_t offset, unsigned char* sector) {
+		stream.seekg(static_cast<std::streamoff>(offset));
+		stream.read(reinterpret_cast<char*>(sector), 512);
+	};
+
+	auto field = [](const unsigned char* data, size_t size) {
+		uint32_t value = 0;
+		for (size_t index = size; index > 0; index--)
+			value = (value << 8) | data[index - 1];
+
+		return value;
+	};
+
+	unsigned char mbr[512], pbr[512];
+	read(0, mbr);
+	read(uint64_t(field(mbr + 0x1C6, 4)) * 512, pbr);
+
+	auto bytesPerSector = field(pbr + 11, 2);
+	auto sectorsPerCluster = field(pbr + 13, 1);
+	auto reservedSectors = field(pbr + 14, 2);
+	auto fats = field(pbr + 16, 1);
+	auto rootEntries = field(pbr + 17, 2);
+	auto totalSectors = field(pbr + 19, 2) != 0 ? field(pbr + 19, 2) : field(pbr + 32, 4);
+	auto fatSectors = field(pbr + 22, 2) != 0 ? field(pbr + 22, 2) : field(pbr + 36, 4);
+	auto rootSectors = (rootEntries * 32 + bytesPerSector - 1) / bytesPerSector;
+
+	auto clusters = (totalSectors - reservedSectors - fats * fatSectors - rootSectors) / sectorsPerCluster;
+
+	if (clusters < 4085)
+		return "FAT12";
+	else if (clusters < 65525)
+		return "FAT16";
+	else
+		return "FAT32";
+}
+
+static std::vector<std::string> listImage(const std::filesystem::path& image) {
+	auto size = std::filesystem::file_size(image);
+
+	FATFilesystem filesystem(std::make_unique<RawBlockDevice>(std::filesystem::path(image), size, true), FATFilesystem::MountExisting());
+
+	std::vector<std::string> lines;
+	walk(filesystem, FatfsString(), lines);
+
+	return lines;
+}
+
+/*
+ * Compares the entries of two images, printing the first differences.
+ */
+static size_t compareImages(const std::filesystem::path& nativeImage, const std::filesystem::path& fatfsImage, size_t& entries) {
+	auto native = listImage(nativeImage);
+	auto fatfs = listImage(fatfsImage);
+
+	size_t differences = 0;
+
+	for (size_t index = 0; index < std::max(native.size(), fatfs.size()); index++) {
+		auto nativeLine = index < native.size() ? native[index] : "(nothing)";
+		auto fatfsLine = index < fatfs.size() ? fatfs[index] : "(nothing)";
+
+		if (nativeLine != fatfsLine) {
+			if (differences++ < 20)
+				std::cerr << "native: " << nativeLine << "\nfatfs:  " << fatfsLine << std::endl;
+		}
+	}
+
+	entries = native.size();
+
+	return differences;
+}
+
+int main(int argc, char** argv) {
+	if (argc != 3) {
+		std::cerr << "usage: WriterEquivalenceTest <fatbuilder> <work directory>" << std::endl;
+		return 2;
+	}
+
+	try {
+		std::filesystem::path fatbuilder(argv[1]);
+		auto work = std::filesystem::absolute(argv[2]);
+
+		std::filesystem::remove_all(work);
+		std::filesystem::create_directories(work / "sources");
+
+		auto manifest = work / "manifest.txt";
+		writeManifest(manifest, work / "sources", false);
+
+		auto largeManifest = work / "manifest-large.txt";
+		writeManifest(largeManifest, work / "sources", true);
+
+		/*
+		 * The memory backend has 512-byte allocation units wherever the
+		 * test runs, so the policies choose the same volumes everywhere.
+		 */
+		struct Run {
+			const char* name;
+			const std::filesystem::path& manifest;
+			const char* options;
+			const char* expectedType;
+		};
+
+		const Run runs[] = {
+			{ "mkfs", manifest, "", "FAT12" },
+			{ "metadata", largeManifest, "--layout-policy metadata --io-backend memory", "FAT16" },
+			{ "size", largeManifest, "--layout-policy size --io-backend memory", "FAT32" },
+		};
+
+		bool passed = true;
+
+		for (const auto& run : runs) {
+			auto nativeImage = work / (std::string(run.name) + "-native.img");
+			auto fatfsImage = work / (std::string(run.name) + "-fatfs.img");
+
+			build(fatbuilder, run.manifest, nativeImage, "native", run.options);
+			build(fatbuilder, run.manifest, fatfsImage, "fatfs", run.options);
+
+			auto type = fatType(nativeImage);
+
+			size_t entries;
+			auto differences = compareImages(nativeImage, fatfsImage, entries);
+
+			std::cout << run.name << ": " << type << ", " << entries << " entries, " << differences << " different" << std::endl;
+
+			if (type != run.expectedType) {
+				std::cerr << run.name << ": expected " << run.expectedType << std::endl;
+				passed = false;
+			}
+
+			if (differences != 0 || entries == 0)
+				passed = false;
+		}
+
+		return passed ? 0 : 1;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "WriterEquivalenceTest: " << e.what() << std::endl;
+		return 1;
+	}
+}